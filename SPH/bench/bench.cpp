@@ -0,0 +1,815 @@
+// Steps the SPH solver without a window or GL context and reports throughput.
+//
+//   SPH_bench [--particles 10000,100000] [--threads 1,2,4] [--steps 100]
+//             [--warmup 10] [--dt 0.015625] [--solver eos|dfsph] [--box 0]
+//             [--sdf mesh.obj] [--sdf-resolution 64] [--bake file] [--bake-channels vd]
+//             [--cache file] [--cache-encoding raw|q16] [--bodies 1] [--surface]
+//             [--profile prefix] [--adaptive] [--sleep] [--ranks k] [--transport shm|socket]
+//             [--checkpoint file] [--compact] [--json]
+//
+// Every particle count runs once per thread count, so one call charts scaling.
+// --dt 0 lets the solver pick each step with Particles::stable_dt. With
+// --solver dfsph the mean pressure solve iterations and errors are reported.
+// --box s closes the fluid in a cube of side s sampled into wall particles.
+// --sdf puts the mesh below the fluid as a distance field collider, baked
+// next to the mesh file on the first run and loaded from there after.
+// --bake streams every timed step to a bake file, v and d in --bake-channels
+// add velocities and densities; the writer's compression and throughput are
+// reported. --cache writes the timed steps to a playback cache instead, then
+// maps it and times serving every frame in order and in random order, as
+// the renderer would on playback and on scrubbing; the files just written
+// are likely still in the page cache. --bodies k steps k independent fluids
+// of the given size through the scheduler, side by side on the pool; the
+// phase times and outputs are those of the first. --surface extracts the
+// fluid surface after every timed step and reports its cost and size.
+// --profile writes per phase timings of the timed steps, a frame a step, to
+// prefix-<particles>-<threads>.csv and .json; it needs a build with
+// SPH_PROFILE. --adaptive lets particles merge away from the surface and
+// walls and split back near them; the particles left, by level, and the
+// splits and merges over the timed steps are reported. --sleep lets settled
+// particles sleep and reports how many were asleep over the timed steps; a
+// long --warmup settles the fluid first. --ranks k splits the fluid into k
+// slabs stepped by as many forked processes, over a --transport of shared
+// memory or Unix sockets; each rank's step time and count, the halo bytes,
+// the imbalance and the largest distance of any particle from where one
+// process stepping it alone puts it are reported. The ranks step the fluid
+// and its box only, with EOS: no DFSPH, collider, bake, cache, surface or
+// bodies.
+// --checkpoint snapshots the registry after the timed steps, writes it from
+// the checkpoint writer's thread and restores it into a fresh registry; the
+// time the snapshot holds the caller up, the write and read rates and
+// whether the restored particles match are reported. The read likely comes
+// from the page cache.
+// --compact packs the final state into the renderer's instance stream both
+// ways, floats and QuantizedInstances, and reports the time of each and the
+// largest error of a decoded compact instance against its bound.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Bake.h"
+#include "Boundary.h"
+#include "Cache.h"
+#include "Checkpoint.h"
+#include "Domain.h"
+#include "Particles.h"
+#include "Profile.h"
+#include "Scheduler.h"
+#include "SDF.h"
+#include "Surface.h"
+#include "ThreadPool.h"
+#include "Transport.h"
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+struct Result {
+	int particles, bodies, threads, steps, walls;
+	double seconds, neighbors, dt;
+	double reorder_ms, neighbors_ms, density_ms, forces_ms, integrate_ms;
+	double density_iterations, divergence_iterations, density_residual, divergence_residual;
+	double walls_ms, wall_neighbors;
+	int sdf_nodes;
+	double sdf_ms, sdf_bytes;
+	bool sdf_cached;
+	int bake_frames, bake_stalls;
+	double bake_bytes, bake_mbps;
+	int cache_frames;
+	double cache_mb, cache_write_ms, play_ms, scrub_ms, cache_error;
+	int surface_blocks, surface_vertices, surface_triangles;
+	double surface_ms, splat_ms, march_ms, assemble_ms, surface_remeshed, surface_mb;
+	bool adaptive;
+	int adapted, splits, merges, population[PARTICLE_LEVELS];
+	double adapt_ms;
+	bool sleeping;
+	int asleep;
+	double mean_asleep;
+	int ranks, rebalances;
+	std::string transport;
+	std::vector<double> rank_ms, rank_exchange_ms, rank_particles;
+	double halo_bytes, migrated, particle_imbalance, time_imbalance, deviation;
+	double checkpoint_mb, checkpoint_ms, checkpoint_write_mbps, restore_ms, restore_mbps;
+	bool restored;
+	bool compact;
+	double pack_ms, compact_pack_ms, position_bound, position_error, radius_bound, radius_error;
+};
+
+// triangles of an obj file, fit to a unit box around the origin like Mesh does
+static std::vector<glm::vec3> load_triangles(const std::string& file) {
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string err;
+	std::vector<glm::vec3> triangles;
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, file.c_str())) {
+		std::cerr << err << std::endl;
+		return triangles;
+	}
+	for (auto& shape : shapes) {
+		for (auto& idx : shape.mesh.indices) {
+			triangles.push_back(glm::vec3(attrib.vertices[3*idx.vertex_index+0], attrib.vertices[3*idx.vertex_index+1], attrib.vertices[3*idx.vertex_index+2]));
+		}
+	}
+	if (triangles.empty()) return triangles;
+
+	glm::vec3 lo = triangles[0], hi = triangles[0];
+	for (auto& v : triangles) {
+		lo = glm::min(lo, v);
+		hi = glm::max(hi, v);
+	}
+	glm::vec3 diff = hi - lo;
+	float scale = 1.0f / glm::max(diff.x, glm::max(diff.y, diff.z));
+	for (auto& v : triangles) v = (v - 0.5f * (lo + hi)) * scale;
+	return triangles;
+}
+
+// the 12 triangles of an axis aligned cube of side s around the origin
+static std::vector<glm::vec3> box_triangles(float s) {
+	std::vector<glm::vec3> triangles;
+	for (int axis = 0; axis < 3; ++axis) {
+		for (float side : {-0.5f, 0.5f}) {
+			glm::vec3 c[4];
+			for (int k = 0; k < 4; ++k) {
+				glm::vec3 p;
+				p[axis] = side;
+				p[(axis + 1) % 3] = (k == 1 || k == 2) ? 0.5f : -0.5f;
+				p[(axis + 2) % 3] = (k >= 2) ? 0.5f : -0.5f;
+				c[k] = p * s;
+			}
+			for (int k : {0, 1, 2, 0, 2, 3}) triangles.push_back(c[k]);
+		}
+	}
+	return triangles;
+}
+
+static std::vector<int> parse_list(const char * arg) {
+	std::vector<int> values;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ',')) values.push_back(std::atoi(item.c_str()));
+	return values;
+}
+
+struct Obstacle {
+	std::string mesh;
+	int resolution;
+};
+
+struct Output {
+	std::string path;
+	unsigned channels;
+	std::string cache;
+	unsigned encoding;
+	bool surface;
+	std::string profile;
+	std::string checkpoint;
+	bool compact;
+};
+
+// Serves every frame of a cache into an instance stream, in order with
+// prefetch as playback does, then in a random order as scrubbing might.
+static void play(const std::string& path, ThreadPool& pool, Result& result) {
+	ParticleCache cache;
+	if (!cache.open(path)) {
+		std::cerr << "cannot map " << path << "\n";
+		return;
+	}
+	cache.pool = &pool;
+	int frames = cache.frames();
+	std::vector<glm::vec4> instances(cache.particles());
+
+	auto start = std::chrono::steady_clock::now();
+	for (int f = 0; f < frames; ++f) {
+		cache.decode(f, instances.data());
+		cache.prefetch(f);
+	}
+	auto middle = std::chrono::steady_clock::now();
+	std::vector<int> order(frames);
+	for (int f = 0; f < frames; ++f) order[f] = (int)((f * 2654435761u) % (unsigned)frames);
+	for (int f : order) cache.decode(f, instances.data());
+	auto end = std::chrono::steady_clock::now();
+
+	result.cache_frames = frames;
+	result.play_ms = std::chrono::duration<double, std::milli>(middle - start).count() / std::max(frames, 1);
+	result.scrub_ms = std::chrono::duration<double, std::milli>(end - middle).count() / std::max(frames, 1);
+	// q16 rounds to the nearest of 65535 steps across each frame's bounds
+	if (cache.header.encoding == CACHE_Q16) {
+		for (int f = 0; f < frames; ++f) {
+			const CacheFrame& frame = cache.frame(f);
+			for (int c = 0; c < 3; ++c) result.cache_error = std::max(result.cache_error, (double)(frame.hi[c] - frame.lo[c]) / 131070.0);
+		}
+	}
+}
+
+static Result run(int n, int bodies, int threads, int steps, int warmup, float dt, Solver solver, float box, bool adaptive, bool sleeping, const Obstacle& obstacle, const Output& output) {
+	ThreadPool pool(threads);
+	entt::registry registry;
+	for (int b = 0; b < bodies; ++b) {
+		auto& body = registry.emplace<Particles>(registry.create(), n);
+		body.pool = &pool;
+		body.solver = solver;
+		body.adaptive = adaptive;
+		body.sleeping = sleeping;
+	}
+	auto fluids = registry.view<Particles>();
+	Particles& particles = fluids.get<Particles>(fluids.front());
+
+	Boundary walls;
+	if (box > 0.0f) {
+		walls.spacing = particles.radius;
+		walls.sample(box_triangles(box));
+		walls.build(particles.r, particles.rho, pool);
+		for (auto&& [entity, body] : fluids.each()) body.boundary = &walls;
+	}
+
+	// half the box wide, on its floor; without a box just under the fluid
+	SDF collider;
+	if (!obstacle.mesh.empty()) {
+		float side = 0.5f * (box > 0.0f ? box : 1.0f);
+		glm::vec3 at(0.0f, box > 0.0f ? 0.5f * (side - box) : -side, 0.0f);
+		std::vector<glm::vec3> triangles = load_triangles(obstacle.mesh);
+		for (auto& v : triangles) v = v * side + at;
+		collider.resolution = obstacle.resolution;
+		collider.bake(triangles, obstacle.mesh + ".sdf", pool);
+		for (auto&& [entity, body] : fluids.each()) body.collider = &collider;
+	}
+
+	// the same system Simulation steps its fluids with
+	Scheduler scheduler(registry);
+	scheduler.add("fluids", Scheduler::reads<Boundary, SDF>{}, Scheduler::writes<Particles>{}, [&](entt::registry&, float h) {
+		std::vector<entt::entity> entities(fluids.begin(), fluids.end());
+		pool.parallel_for(entities.size(), 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) fluids.get<Particles>(entities[i]).update(h);
+		});
+	});
+	auto step = [&]() {
+		float h = dt > 0.0f ? dt : particles.stable_dt();
+		if (dt <= 0.0f) {
+			for (auto&& [entity, body] : fluids.each()) {
+				if (&body != &particles) h = std::min(h, body.stable_dt());
+			}
+		}
+		scheduler.run(h, pool);
+		return h;
+	};
+	for (int s = 0; s < warmup; ++s) step();
+#ifdef SPH_PROFILE
+	Profiler::get().reset();
+#endif
+
+	std::unique_ptr<BakeWriter> bake;
+	if (!output.path.empty()) {
+		bake = std::make_unique<BakeWriter>(output.path, n, output.channels);
+		if (!bake->ok()) std::cerr << "cannot write " << output.path << "\n";
+	}
+	std::unique_ptr<CacheWriter> cache;
+	if (!output.cache.empty()) {
+		cache = std::make_unique<CacheWriter>(output.cache, n, particles.radius, output.encoding);
+		if (!cache->ok()) std::cerr << "cannot write " << output.cache << "\n";
+	}
+
+	Surface surface;
+
+	Result result = {n, bodies, pool.size(), steps, walls.size()};
+	result.walls_ms = walls.build_ms;
+	result.sdf_nodes = (int)collider.nodes.size();
+	result.sdf_ms = collider.bake_ms;
+	result.sdf_bytes = (double)collider.bytes();
+	result.sdf_cached = collider.cached;
+	auto start = std::chrono::steady_clock::now();
+	float time = 0.0f;
+	for (int s = 0; s < steps; ++s) {
+		float h = step();
+		result.dt += h;
+		time += h;
+		if (bake) bake->write(particles, time, h);
+		if (cache) cache->write(particles, time);
+		if (output.surface) {
+			surface.extract(particles);
+			result.surface_ms += surface.stats.ms;
+			result.splat_ms += surface.stats.splat_ms;
+			result.march_ms += surface.stats.march_ms;
+			result.assemble_ms += surface.stats.assemble_ms;
+			result.surface_remeshed += (double)surface.stats.remeshed / std::max(surface.stats.blocks, 1);
+		}
+		// reorder_ms only changes on the steps that sorted, the adapt counts
+		// on the steps that adapted
+		if (particles.reorder_interval > 0 && (particles.steps - 1) % particles.reorder_interval == 0) {
+			result.reorder_ms += particles.reorder_ms;
+		}
+		if (adaptive && particles.adapt_interval > 0 && (particles.steps - 1) % particles.adapt_interval == 0) {
+			result.splits += particles.splits;
+			result.merges += particles.merges;
+			result.adapt_ms += particles.adapt_ms;
+		}
+		result.neighbors += (double)particles.neighbors.size() / n;
+		result.wall_neighbors += (double)particles.boundary_neighbors.size() / n;
+		result.neighbors_ms += particles.neighbors_ms;
+		result.mean_asleep += particles.asleep;
+		PROFILE_FRAME();
+		result.density_ms += particles.density_ms;
+		result.forces_ms += particles.forces_ms;
+		result.integrate_ms += particles.integrate_ms;
+		result.density_iterations += particles.density_iterations;
+		result.divergence_iterations += particles.divergence_iterations;
+		result.density_residual += particles.density_residual;
+		result.divergence_residual += particles.divergence_residual;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!output.checkpoint.empty()) {
+		auto taken = std::chrono::steady_clock::now();
+		CheckpointOutput out;
+		checkpoint<Particles>(registry, time, out);
+		result.checkpoint_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - taken).count();
+		result.checkpoint_mb = out.bytes.size() / 1e6;
+		CheckpointWriter writer;
+		writer.write(output.checkpoint, std::move(out.bytes));
+		writer.wait();
+		result.checkpoint_write_mbps = writer.megabytes_per_second();
+		if (writer.failed) std::cerr << "cannot write " << output.checkpoint << "\n";
+
+		auto read = std::chrono::steady_clock::now();
+		CheckpointInput in(output.checkpoint);
+		entt::registry restored;
+		bool ok = restore<Particles>(restored, in);
+		result.restore_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - read).count();
+		result.restore_mbps = in.bytes_read / 1e3 / std::max(result.restore_ms, 1e-3);
+		// every body, in the registry's order, bit for bit
+		auto bodies = restored.view<Particles>();
+		result.restored = ok && bodies.size() == fluids.size();
+		for (auto&& [entity, body] : fluids.each()) {
+			if (!result.restored || !restored.valid(entity) || !restored.all_of<Particles>(entity)) {
+				result.restored = false;
+				break;
+			}
+			const Particles& back = restored.get<Particles>(entity);
+			result.restored = back.size == body.size && back.steps == body.steps
+				&& !std::memcmp(back.x, body.x, body.size * sizeof(float)) && !std::memcmp(back.vz, body.vz, body.size * sizeof(float))
+				&& !std::memcmp(back.id, body.id, body.size * sizeof(unsigned));
+		}
+	}
+
+	if (output.compact && particles.size > 0) {
+		// the best of a few packs each way, decoded as the shaders do
+		std::vector<glm::vec4> floats(particles.size);
+		std::vector<QuantizedInstance> packed(particles.size);
+		Quantization q;
+		result.compact = true;
+		result.pack_ms = result.compact_pack_ms = INFINITY;
+		for (int k = 0; k < 5; ++k) {
+			auto begin = std::chrono::steady_clock::now();
+			particles.pack(floats.data());
+			auto middle = std::chrono::steady_clock::now();
+			q = particles.quantization(true);
+			particles.pack(packed.data(), q);
+			auto end = std::chrono::steady_clock::now();
+			result.pack_ms = std::min(result.pack_ms, std::chrono::duration<double, std::milli>(middle - begin).count());
+			result.compact_pack_ms = std::min(result.compact_pack_ms, std::chrono::duration<double, std::milli>(end - middle).count());
+		}
+		result.position_bound = q.position_error();
+		result.radius_bound = q.radius_error();
+		glm::vec3 extent = q.hi - q.lo;
+		for (int i = 0; i < particles.size; ++i) {
+			const QuantizedInstance& c = packed[i];
+			glm::vec3 p = q.lo + extent * (glm::vec3(c.x, c.y, c.z) / 65535.0f);
+			float radius = q.radius * c.radius / 255.0f;
+			result.position_error = std::max(result.position_error, (double)glm::length(p - glm::vec3(floats[i])));
+			result.radius_error = std::max(result.radius_error, (double)std::abs(radius - floats[i].w));
+		}
+	}
+
+	if (cache) {
+		cache->close();
+		result.cache_mb = cache->bytes() / 1e6;
+		result.cache_write_ms = cache->write_seconds * 1e3 / steps;
+		play(output.cache, pool, result);
+	}
+
+	if (bake) {
+		bake->close();
+		result.bake_frames = bake->frames;
+		result.bake_stalls = bake->stalls;
+		result.bake_bytes = bake->bytes_per_particle_frame();
+		result.bake_mbps = bake->megabytes_per_second();
+	}
+
+	if (output.surface) {
+		result.surface_blocks = surface.stats.blocks;
+		result.surface_vertices = surface.stats.vertices;
+		result.surface_triangles = surface.stats.triangles;
+		result.surface_mb = surface.stats.bytes / 1e6;
+		for (double* v : {&result.surface_ms, &result.splat_ms, &result.march_ms, &result.assemble_ms, &result.surface_remeshed}) *v /= steps;
+	}
+
+	result.adaptive = adaptive;
+	result.adapted = particles.size;
+	std::copy(particles.population, particles.population + PARTICLE_LEVELS, result.population);
+	result.adapt_ms /= steps;
+	result.sleeping = sleeping;
+	result.asleep = particles.asleep;
+	result.mean_asleep /= steps;
+	result.neighbors /= steps;
+	result.wall_neighbors /= steps;
+	result.dt /= steps;
+	for (double* ms : {&result.reorder_ms, &result.neighbors_ms, &result.density_ms, &result.forces_ms, &result.integrate_ms}) {
+		*ms /= steps;
+	}
+	for (double* v : {&result.density_iterations, &result.divergence_iterations, &result.density_residual, &result.divergence_residual}) {
+		*v /= steps;
+	}
+#ifdef SPH_PROFILE
+	if (!output.profile.empty()) {
+		std::string path = output.profile + "-" + std::to_string(n) + "-" + std::to_string(pool.size());
+		if (!Profiler::get().write_csv(path + ".csv") || !Profiler::get().write_json(path + ".json")) std::cerr << "cannot write " << path << "\n";
+	}
+#endif
+	return result;
+}
+
+// One rank of run_ranks: steps its slab, then leaves every rank's numbers
+// and all the positions by id on rank 0.
+static Result step_rank(Transport& transport, int n, int threads, int steps, int warmup, float dt, Solver solver, float box, bool sleeping, std::vector<glm::vec3>& positions) {
+	ThreadPool pool(threads);
+	// no rank ever holds all n
+	Particles particles(n, transport.rank, transport.ranks);
+	particles.pool = &pool;
+	particles.solver = solver;
+	particles.sleeping = sleeping;
+
+	Boundary walls;
+	if (box > 0.0f) {
+		walls.spacing = particles.radius;
+		walls.sample(box_triangles(box));
+		walls.build(particles.r, particles.rho, pool);
+		particles.boundary = &walls;
+	}
+
+	Domain domain(transport, particles);
+	auto step = [&]() {
+		float h = dt > 0.0f ? dt : domain.stable_dt();
+		domain.step(h);
+		return h;
+	};
+	for (int s = 0; s < warmup && domain.ok; ++s) step();
+
+	Result result = {n, 1, pool.size(), steps, walls.size()};
+	result.walls_ms = walls.build_ms;
+	result.ranks = transport.ranks;
+	result.transport = transport.name();
+	double step_ms = 0.0, exchange_ms = 0.0, owned = 0.0;
+	auto start = std::chrono::steady_clock::now();
+	for (int s = 0; s < steps && domain.ok; ++s) {
+		result.dt += step();
+		step_ms += domain.step_ms;
+		exchange_ms += domain.exchange_ms;
+		owned += particles.size;
+		result.halo_bytes += (double)domain.halo_bytes;
+		result.migrated += domain.migrated;
+		result.neighbors += (double)particles.neighbors.size() / std::max(particles.size, 1);
+		result.neighbors_ms += particles.neighbors_ms;
+		result.density_ms += particles.density_ms;
+		result.forces_ms += particles.forces_ms;
+		result.integrate_ms += particles.integrate_ms;
+		result.mean_asleep += particles.asleep;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// every rank's step and exchange time, mean count, halo bytes and migrants
+	std::vector<double> mine = {step_ms / steps, exchange_ms / steps, owned / steps, result.halo_bytes / steps, result.migrated / steps};
+	std::vector<char> message(mine.size() * sizeof(double));
+	std::memcpy(message.data(), mine.data(), message.size());
+	std::vector<std::vector<char>> all;
+	if (!domain.ok || !domain.gather(message, all) || !domain.gather_positions(n, positions)) {
+		std::cerr << "rank " << transport.rank << " lost its peers\n";
+		result.ranks = 0;
+		return result;
+	}
+	if (transport.rank != 0) return result;
+
+	result.halo_bytes = result.migrated = 0.0;
+	double total_ms = 0.0, total_particles = 0.0, largest_ms = 0.0, largest_particles = 0.0;
+	for (const auto& m : all) {
+		if (m.size() != message.size()) continue;
+		const double* v = reinterpret_cast<const double*>(m.data());
+		result.rank_ms.push_back(v[0]);
+		result.rank_exchange_ms.push_back(v[1]);
+		result.rank_particles.push_back(v[2]);
+		result.halo_bytes += v[3];
+		result.migrated += v[4];
+		total_ms += v[0] - v[1];
+		total_particles += v[2];
+		largest_ms = std::max(largest_ms, v[0] - v[1]);
+		largest_particles = std::max(largest_particles, v[2]);
+	}
+	// of the stepping alone, the exchanges include waiting on the slowest rank
+	result.time_imbalance = total_ms > 0.0 ? largest_ms * all.size() / total_ms - 1.0 : 0.0;
+	result.particle_imbalance = total_particles > 0.0 ? largest_particles * all.size() / total_particles - 1.0 : 0.0;
+	result.rebalances = domain.rebalances;
+	result.adapted = n;
+	result.sleeping = sleeping;
+	result.asleep = particles.asleep;
+	result.mean_asleep /= steps;
+	result.neighbors /= steps;
+	result.dt /= steps;
+	for (double* ms : {&result.neighbors_ms, &result.density_ms, &result.forces_ms, &result.integrate_ms}) *ms /= steps;
+	return result;
+}
+
+// Forks ranks - 1 processes, steps the fluid split between all of them, then
+// steps it again in this process alone to compare the positions.
+static Result run_ranks(int ranks, const std::string& kind, int n, int threads, int steps, int warmup, float dt, Solver solver, float box, bool sleeping) {
+	Result result = {n, 1, threads, steps};
+#ifndef _WIN32
+	std::unique_ptr<Transport> transport = make_transport(kind, ranks);
+	if (!transport) {
+		std::cerr << "cannot make a " << kind << " transport for " << ranks << " ranks\n";
+		return result;
+	}
+	// children must not flush what the parent has buffered
+	std::cout.flush();
+	std::vector<pid_t> children;
+	int rank = 0;
+	for (int r = 1; r < ranks; ++r) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			rank = r;
+			break;
+		}
+		if (pid > 0) children.push_back(pid);
+	}
+	transport->bind(rank);
+	std::vector<glm::vec3> positions;
+	result = step_rank(*transport, n, threads, steps, warmup, dt, solver, box, sleeping, positions);
+	if (rank != 0) _exit(result.ranks ? 0 : 1);
+	for (pid_t pid : children) waitpid(pid, nullptr, 0);
+	if (!result.ranks) return result;
+
+	// the same steps in one process
+	ThreadPool pool(threads);
+	Particles alone(n);
+	alone.pool = &pool;
+	alone.solver = solver;
+	alone.sleeping = sleeping;
+	Boundary walls;
+	if (box > 0.0f) {
+		walls.spacing = alone.radius;
+		walls.sample(box_triangles(box));
+		walls.build(alone.r, alone.rho, pool);
+		alone.boundary = &walls;
+	}
+	for (int s = 0; s < warmup + steps; ++s) alone.update(dt > 0.0f ? dt : alone.stable_dt());
+	for (int i = 0; i < alone.size; ++i) {
+		glm::vec3 d = glm::vec3(alone.x[i], alone.y[i], alone.z[i]) - positions[alone.id[i]];
+		// a particle no rank had is lost
+		result.deviation = std::isnan(d.x) ? INFINITY : std::max(result.deviation, (double)glm::length(d));
+	}
+#else
+	std::cerr << "--ranks needs fork, not available here\n";
+#endif
+	return result;
+}
+
+static void print_text(const Result& r) {
+	std::cout << r.particles << " particles";
+	if (r.bodies > 1) std::cout << " x " << r.bodies << " bodies";
+	std::cout << ", " << r.threads << " threads, " << r.steps << " steps\n"
+		<< "  steps/s            " << r.steps / r.seconds << "\n"
+		<< "  particle-steps/s   " << (double)r.particles * r.bodies * r.steps / r.seconds << "\n"
+		<< "  mean neighbors     " << r.neighbors << "\n";
+	if (r.walls) {
+		std::cout << "  wall particles     " << r.walls << " (built in " << r.walls_ms << " ms, " << r.wall_neighbors << " per particle)\n";
+	}
+	if (r.sdf_nodes) {
+		std::cout << "  sdf nodes          " << r.sdf_nodes << " (" << r.sdf_bytes / (1024 * 1024) << " MiB, "
+			<< (r.sdf_cached ? "loaded in " : "baked in ") << r.sdf_ms << " ms)\n";
+	}
+	if (r.bake_frames) {
+		std::cout << "  baked frames       " << r.bake_frames << " (" << r.bake_bytes << " bytes/particle/frame, "
+			<< r.bake_mbps << " MB/s, " << r.bake_stalls << " stalls)\n";
+	}
+	if (r.cache_frames) {
+		std::cout << "  cached frames      " << r.cache_frames << " (" << r.cache_mb << " MB, written in " << r.cache_write_ms << " ms/frame)\n"
+			<< "  ms/frame playback  " << r.play_ms << "\n"
+			<< "           scrub     " << r.scrub_ms << "\n";
+		if (r.cache_error > 0.0) std::cout << "  cache max error    " << r.cache_error << "\n";
+	}
+	if (r.surface_blocks) {
+		std::cout << "  surface            " << r.surface_triangles << " triangles, " << r.surface_vertices << " vertices, "
+			<< r.surface_blocks << " blocks, " << r.surface_mb << " MB\n"
+			<< "  ms/step surface    " << r.surface_ms << " (splat " << r.splat_ms << ", march " << r.march_ms
+			<< ", assemble " << r.assemble_ms << ", " << 100.0 * r.surface_remeshed << "% of blocks remeshed)\n";
+	}
+	if (r.checkpoint_mb > 0.0) {
+		std::cout << "  checkpoint         " << r.checkpoint_mb << " MB, taken in " << r.checkpoint_ms << " ms, written at "
+			<< r.checkpoint_write_mbps << " MB/s in the background\n"
+			<< "  restore            " << r.restore_ms << " ms (" << r.restore_mbps << " MB/s), " << (r.restored ? "identical" : "DIFFERENT") << "\n";
+	}
+	if (r.compact) {
+		std::cout << "  instances          " << sizeof(glm::vec4) << " B packed in " << r.pack_ms << " ms, compact "
+			<< sizeof(QuantizedInstance) << " B in " << r.compact_pack_ms << " ms\n"
+			<< "  compact error      position " << r.position_error << " (bound " << r.position_bound << "), radius "
+			<< r.radius_error << " (bound " << r.radius_bound << ")\n";
+	}
+	if (r.adaptive) {
+		std::cout << "  adaptive           " << r.adapted << " particles left (" << (double)r.particles / r.adapted << "x fewer), by level";
+		for (int l = 0; l < PARTICLE_LEVELS; ++l) std::cout << " " << r.population[l];
+		std::cout << "\n  splits, merges     " << r.splits << ", " << r.merges << " (" << r.adapt_ms << " ms/step)\n";
+	}
+	if (r.sleeping) {
+		std::cout << "  asleep             " << r.asleep << " of " << r.adapted << " after the last step, "
+			<< r.mean_asleep << " on average\n";
+	}
+	if (r.ranks > 1) {
+		std::cout << "  ranks              " << r.ranks << " over " << r.transport << ", " << r.rebalances << " rebalances\n"
+			<< "  ms/step by rank   ";
+		for (size_t k = 0; k < r.rank_ms.size(); ++k) std::cout << " " << r.rank_ms[k] << " (" << r.rank_exchange_ms[k] << " exchanging)";
+		std::cout << "\n  particles by rank ";
+		for (double c : r.rank_particles) std::cout << " " << c;
+		std::cout << "\n  imbalance          " << 100.0 * r.particle_imbalance << "% particles, " << 100.0 * r.time_imbalance << "% time\n"
+			<< "  halo bytes/step    " << r.halo_bytes << " (" << r.migrated << " particles migrated)\n"
+			<< "  max deviation      " << r.deviation << " from one process\n";
+	}
+	std::cout << "  mean dt            " << r.dt << "\n"
+		<< "  ms/step reorder    " << r.reorder_ms << "\n"
+		<< "          neighbors  " << r.neighbors_ms << "\n"
+		<< "          density    " << r.density_ms << "\n"
+		<< "          forces     " << r.forces_ms << "\n"
+		<< "          integrate  " << r.integrate_ms << "\n";
+	// the ranks step with eos, which does not iterate
+	if (r.ranks > 1) return;
+	std::cout << "  iterations density " << r.density_iterations << " (error " << r.density_residual << ")\n"
+		<< "          divergence " << r.divergence_iterations << " (error " << r.divergence_residual << ")\n";
+}
+
+static void print_json(const std::vector<Result>& results) {
+	std::cout << "[\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& r = results[i];
+		std::cout << "  {\"particles\": " << r.particles
+			<< ", \"bodies\": " << r.bodies
+			<< ", \"threads\": " << r.threads
+			<< ", \"steps\": " << r.steps
+			<< ", \"seconds\": " << r.seconds
+			<< ", \"steps_per_sec\": " << r.steps / r.seconds
+			<< ", \"particle_steps_per_sec\": " << (double)r.particles * r.bodies * r.steps / r.seconds
+			<< ", \"mean_neighbors\": " << r.neighbors
+			<< ", \"walls\": " << r.walls
+			<< ", \"walls_build_ms\": " << r.walls_ms
+			<< ", \"mean_wall_neighbors\": " << r.wall_neighbors
+			<< ", \"sdf\": {\"nodes\": " << r.sdf_nodes
+			<< ", \"bytes\": " << r.sdf_bytes
+			<< ", \"ms\": " << r.sdf_ms
+			<< ", \"cached\": " << (r.sdf_cached ? "true" : "false") << "}"
+			<< ", \"bake\": {\"frames\": " << r.bake_frames
+			<< ", \"bytes_per_particle_frame\": " << r.bake_bytes
+			<< ", \"mb_per_sec\": " << r.bake_mbps
+			<< ", \"stalls\": " << r.bake_stalls << "}"
+			<< ", \"cache\": {\"frames\": " << r.cache_frames
+			<< ", \"mb\": " << r.cache_mb
+			<< ", \"write_ms\": " << r.cache_write_ms
+			<< ", \"play_ms\": " << r.play_ms
+			<< ", \"scrub_ms\": " << r.scrub_ms
+			<< ", \"max_error\": " << r.cache_error << "}"
+			<< ", \"surface\": {\"triangles\": " << r.surface_triangles
+			<< ", \"vertices\": " << r.surface_vertices
+			<< ", \"blocks\": " << r.surface_blocks
+			<< ", \"mb\": " << r.surface_mb
+			<< ", \"ms\": " << r.surface_ms
+			<< ", \"splat_ms\": " << r.splat_ms
+			<< ", \"march_ms\": " << r.march_ms
+			<< ", \"assemble_ms\": " << r.assemble_ms
+			<< ", \"remeshed\": " << r.surface_remeshed << "}"
+			<< ", \"checkpoint\": {\"mb\": " << r.checkpoint_mb
+			<< ", \"take_ms\": " << r.checkpoint_ms
+			<< ", \"write_mb_per_sec\": " << r.checkpoint_write_mbps
+			<< ", \"restore_ms\": " << r.restore_ms
+			<< ", \"restore_mb_per_sec\": " << r.restore_mbps
+			<< ", \"identical\": " << (r.restored ? "true" : "false") << "}"
+			<< ", \"compact\": {\"on\": " << (r.compact ? "true" : "false")
+			<< ", \"pack_ms\": " << r.pack_ms
+			<< ", \"compact_pack_ms\": " << r.compact_pack_ms
+			<< ", \"position_error\": " << r.position_error
+			<< ", \"position_bound\": " << r.position_bound
+			<< ", \"radius_error\": " << r.radius_error
+			<< ", \"radius_bound\": " << r.radius_bound << "}"
+			<< ", \"adaptive\": {\"on\": " << (r.adaptive ? "true" : "false")
+			<< ", \"particles\": " << r.adapted
+			<< ", \"splits\": " << r.splits
+			<< ", \"merges\": " << r.merges
+			<< ", \"ms\": " << r.adapt_ms
+			<< ", \"levels\": [";
+		for (int l = 0; l < PARTICLE_LEVELS; ++l) std::cout << (l ? ", " : "") << r.population[l];
+		std::cout << "]}"
+			<< ", \"sleeping\": {\"on\": " << (r.sleeping ? "true" : "false")
+			<< ", \"asleep\": " << r.asleep
+			<< ", \"active\": " << r.adapted - r.asleep
+			<< ", \"mean_asleep\": " << r.mean_asleep << "}"
+			<< ", \"domain\": {\"ranks\": " << r.ranks
+			<< ", \"transport\": \"" << r.transport << "\""
+			<< ", \"rebalances\": " << r.rebalances
+			<< ", \"rank_ms\": [";
+		for (size_t k = 0; k < r.rank_ms.size(); ++k) std::cout << (k ? ", " : "") << r.rank_ms[k];
+		std::cout << "], \"rank_exchange_ms\": [";
+		for (size_t k = 0; k < r.rank_exchange_ms.size(); ++k) std::cout << (k ? ", " : "") << r.rank_exchange_ms[k];
+		std::cout << "], \"rank_particles\": [";
+		for (size_t k = 0; k < r.rank_particles.size(); ++k) std::cout << (k ? ", " : "") << r.rank_particles[k];
+		std::cout << "], \"halo_bytes_per_step\": " << r.halo_bytes
+			<< ", \"migrated_per_step\": " << r.migrated
+			<< ", \"particle_imbalance\": " << r.particle_imbalance
+			<< ", \"time_imbalance\": " << r.time_imbalance
+			<< ", \"max_deviation\": " << (std::isinf(r.deviation) ? 1e30 : r.deviation) << "}"
+			<< ", \"mean_dt\": " << r.dt
+			<< ", \"phase_ms\": {\"reorder\": " << r.reorder_ms
+			<< ", \"neighbors\": " << r.neighbors_ms
+			<< ", \"density\": " << r.density_ms
+			<< ", \"forces\": " << r.forces_ms
+			<< ", \"integrate\": " << r.integrate_ms << "}"
+			<< ", \"iterations\": {\"density\": " << r.density_iterations
+			<< ", \"divergence\": " << r.divergence_iterations << "}"
+			<< ", \"residual\": {\"density\": " << r.density_residual
+			<< ", \"divergence\": " << r.divergence_residual << "}}"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	std::cout << "]\n";
+}
+
+int main(int argc, char **argv) {
+	std::vector<int> counts = {10000}, threads = {0};
+	int steps = 100, warmup = 10, bodies = 1;
+	float dt = 1.0f/64.0f;
+	bool json = false;
+	Solver solver = Solver::EOS;
+	float box = 0.0f;
+	bool adaptive = false, sleeping = false;
+	int ranks = 1;
+	std::string transport = "shm";
+	Obstacle obstacle = {"", 64};
+	Output output = {"", 0, "", CACHE_RAW, false, "", "", false};
+
+	for (int i = 1; i < argc; ++i) {
+		bool more = i + 1 < argc;
+		if (!std::strcmp(argv[i], "--particles") && more) counts = parse_list(argv[++i]);
+		else if (!std::strcmp(argv[i], "--threads") && more) threads = parse_list(argv[++i]);
+		else if (!std::strcmp(argv[i], "--steps") && more) steps = std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--warmup") && more) warmup = std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--dt") && more) dt = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--solver") && more) solver = !std::strcmp(argv[++i], "dfsph") ? Solver::DFSPH : Solver::EOS;
+		else if (!std::strcmp(argv[i], "--box") && more) box = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--sdf") && more) obstacle.mesh = argv[++i];
+		else if (!std::strcmp(argv[i], "--sdf-resolution") && more) obstacle.resolution = std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--bake") && more) output.path = argv[++i];
+		else if (!std::strcmp(argv[i], "--bake-channels") && more) {
+			std::string c = argv[++i];
+			output.channels = (c.find('v') != std::string::npos ? BAKE_VELOCITY : 0) | (c.find('d') != std::string::npos ? BAKE_DENSITY : 0);
+		}
+		else if (!std::strcmp(argv[i], "--cache") && more) output.cache = argv[++i];
+		else if (!std::strcmp(argv[i], "--cache-encoding") && more) output.encoding = !std::strcmp(argv[++i], "q16") ? CACHE_Q16 : CACHE_RAW;
+		else if (!std::strcmp(argv[i], "--bodies") && more) bodies = std::max(1, std::atoi(argv[++i]));
+		else if (!std::strcmp(argv[i], "--surface")) output.surface = true;
+		else if (!std::strcmp(argv[i], "--profile") && more) output.profile = argv[++i];
+		else if (!std::strcmp(argv[i], "--checkpoint") && more) output.checkpoint = argv[++i];
+		else if (!std::strcmp(argv[i], "--compact")) output.compact = true;
+		else if (!std::strcmp(argv[i], "--adaptive")) adaptive = true;
+		else if (!std::strcmp(argv[i], "--sleep")) sleeping = true;
+		else if (!std::strcmp(argv[i], "--ranks") && more) ranks = std::max(1, std::atoi(argv[++i]));
+		else if (!std::strcmp(argv[i], "--transport") && more) transport = argv[++i];
+		else if (!std::strcmp(argv[i], "--json")) json = true;
+		else {
+			std::cerr << "usage: " << argv[0] << " [--particles n,...] [--threads t,...] [--steps m] [--warmup w] [--dt s] [--solver eos|dfsph] [--box s] [--sdf mesh.obj] [--sdf-resolution n] [--bake file] [--bake-channels vd] [--cache file] [--cache-encoding raw|q16] [--bodies k] [--surface] [--profile prefix] [--adaptive] [--sleep] [--ranks k] [--transport shm|socket] [--checkpoint file] [--compact] [--json]\n";
+			return -1;
+		}
+	}
+	if (steps <= 0) steps = 1;
+	if (ranks > 1 && solver == Solver::DFSPH) {
+		std::cerr << "--ranks steps the slabs with eos only, drop --solver dfsph\n";
+		return -1;
+	}
+#ifndef SPH_PROFILE
+	if (!output.profile.empty()) std::cerr << "built without SPH_PROFILE, --profile ignored\n";
+#endif
+
+	std::vector<Result> results;
+	for (int n : counts) {
+		for (int t : threads) {
+			if (ranks > 1) results.push_back(run_ranks(ranks, transport, n, t, steps, warmup, dt, solver, box, sleeping));
+			else results.push_back(run(n, bodies, t, steps, warmup, dt, solver, box, adaptive, sleeping, obstacle, output));
+			if (!json) print_text(results.back());
+		}
+	}
+	if (json) print_json(results);
+	return 0;
+}
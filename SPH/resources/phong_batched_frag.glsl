@@ -0,0 +1,26 @@
+#version 120
+#extension GL_ARB_uniform_buffer_object : require
+
+layout(std140) uniform Frame {
+	mat4 P;
+	mat4 V;
+	vec4 lightPos;		// view space
+};
+
+varying vec3 position;
+varying vec3 normal;
+varying vec3 fka;
+varying vec3 fkd;
+varying vec3 fks;
+varying vec2 fshine;    // s, a
+
+void main()
+{
+	vec3 n = normalize(normal);
+
+	vec3 h1 = normalize((normalize(lightPos.xyz-position.xyz) - (normalize(position.xyz)) ));
+	vec3 cs1 = fks * pow(max(0.0, dot(h1,n)), fshine.x);
+	vec3 cd1 = fkd * max(0.0 , dot(n.xyz, normalize(lightPos.xyz-position.xyz)));
+
+	gl_FragColor = vec4(fka + cd1 + cs1, fshine.y);
+}
@@ -0,0 +1,41 @@
+#version 120
+#extension GL_ARB_uniform_buffer_object : require
+
+layout(std140) uniform Frame {
+	mat4 P;
+	mat4 V;
+	vec4 lightPos;		// view space
+};
+
+attribute vec3 aPos;
+attribute vec3 aNor;
+
+// per instance
+attribute mat4 model;
+attribute mat3 normalMat;
+attribute vec3 ka;
+attribute vec3 kd;
+attribute vec3 ks;
+attribute vec2 shine;
+
+varying vec3 position;
+varying vec3 normal;
+varying vec3 fka;
+varying vec3 fkd;
+varying vec3 fks;
+varying vec2 fshine;
+
+
+void main()
+{
+	position = (V * model * vec4(aPos, 1.0)).xyz;
+	// V is rigid, so it carries normals as it is
+	normal = normalize((V * vec4(normalMat * aNor, 0.0)).xyz);
+
+	fka = ka;
+	fkd = kd;
+	fks = ks;
+	fshine = shine;
+
+	gl_Position = P * vec4(position, 1.0);
+}
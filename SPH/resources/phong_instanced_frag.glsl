@@ -1,27 +1,36 @@
 #version 120
+#extension GL_ARB_uniform_buffer_object : require
 
-uniform vec3 lightPos;
-uniform vec3 ka;
-uniform vec3 kd;
-uniform vec3 ks;
-uniform float s;
-uniform float a;
+layout(std140) uniform Frame {
+	mat4 P;
+	mat4 V;
+	vec4 lightPos;		// view space
+};
+
+layout(std140) uniform Material {
+	vec4 ka;
+	vec4 kd;
+	vec4 ks;
+	vec4 shine;			// s, a
+};
 
 
 varying vec3 pos;
 varying vec3 normal;
+varying float density;
 
 void main()
 {
 	vec3 n = normalize(normal);
 
 	vec3 h1 = normalize((normalize(lightPos.xyz-pos.xyz) - (normalize(pos.xyz)) ));
-	vec3 cs1 = ks * pow(max(0.0, dot(h1,n)), s);
-	vec3 cd1 = kd * max(0.0 , dot(n.xyz, normalize(lightPos.xyz-pos.xyz)));
+	vec3 cs1 = ks.rgb * pow(max(0.0, dot(h1,n)), shine.x);
+	// denser than at rest is lighter, sparser darker
+	vec3 cd1 = (0.5 + density) * kd.rgb * max(0.0 , dot(n.xyz, normalize(lightPos.xyz-pos.xyz)));
 
 	float r = ka.r + cd1.r + cs1.r ;
 	float g = ka.g + cd1.g + cs1.g ;
 	float b = ka.b + cd1.b + cs1.b ;
 
-	gl_FragColor = vec4(r, g, b, a);
+	gl_FragColor = vec4(r, g, b, shine.y);
 }
\ No newline at end of file
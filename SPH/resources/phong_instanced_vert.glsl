@@ -1,23 +1,43 @@
 #version 120
+#extension GL_ARB_uniform_buffer_object : require
 
-uniform mat4 P;
-uniform mat4 MV;
-uniform mat4 iMV;
+layout(std140) uniform Frame {
+	mat4 P;
+	mat4 V;
+	vec4 lightPos;		// view space
+};
 
 attribute vec3 aPos;
 attribute vec3 aNor;
 
-attribute vec4 position;
+attribute vec4 position;	// xyz and radius, or a QuantizedInstance as 4 normalized shorts
+
+// (lo, 1) and (hi - lo, largest radius) for quantized instances,
+// (0, 0, 0, 0) and (1, 1, 1, 0) for floats
+uniform vec4 decode_offset;
+uniform vec4 decode_scale;
 
 varying vec3 normal;
 varying vec3 pos;
+varying float density;		// 0.5 at the rest density
 
 
 void main(){
-	
-    pos = (MV  * vec4(position.w * aPos + position.xyz, 1.0)).xyz;
+	vec3 center = decode_offset.xyz + decode_scale.xyz * position.xyz;
+	float radius = position.w;
+	density = 0.5;
+	if (decode_offset.w > 0.5) {
+		// radius in the low byte, density in the high one
+		float bits = floor(position.w * 65535.0 + 0.5);
+		float high = floor(bits / 256.0);
+		radius = decode_scale.w * (bits - 256.0 * high) / 255.0;
+		density = high / 255.0;
+	}
+
+    pos = (V * vec4(radius * aPos + center, 1.0)).xyz;
 
     gl_Position = P *  vec4(pos, 1.0);	
     
-	normal = normalize((iMV * vec4(aNor,0.0)).xyz);
+	// V is rigid, so it carries normals as it is
+	normal = normalize((V * vec4(aNor,0.0)).xyz);
 }
\ No newline at end of file
@@ -0,0 +1,41 @@
+#version 120
+#extension GL_ARB_uniform_buffer_object : require
+
+layout(std140) uniform Frame {
+	mat4 P;
+	mat4 V;
+	vec4 lightPos;		// view space
+};
+
+layout(std140) uniform Material {
+	vec4 ka;
+	vec4 kd;
+	vec4 ks;
+	vec4 shine;			// s, a
+};
+
+
+varying vec3 pos;
+varying vec3 center;
+varying float radius;
+
+void main()
+{
+	// the eye ray through this fragment against the sphere, nearest hit
+	vec3 dir = normalize(pos);
+	float b = dot(dir, center);
+	float disc = b * b - dot(center, center) + radius * radius;
+	if (disc < 0.0) discard;
+	vec3 hit = (b - sqrt(disc)) * dir;
+	vec3 n = (hit - center) / radius;
+
+	// the depth of the hit, not of the quad, so spheres intersect correctly
+	vec4 clip = P * vec4(hit, 1.0);
+	gl_FragDepth = 0.5 * (clip.z / clip.w) * (gl_DepthRange.far - gl_DepthRange.near) + 0.5 * (gl_DepthRange.far + gl_DepthRange.near);
+
+	vec3 h1 = normalize((normalize(lightPos.xyz-hit) - (normalize(hit)) ));
+	vec3 cs1 = ks.rgb * pow(max(0.0, dot(h1,n)), shine.x);
+	vec3 cd1 = kd.rgb * max(0.0 , dot(n, normalize(lightPos.xyz-hit)));
+
+	gl_FragColor = vec4(ka.rgb + cd1 + cs1, shine.y);
+}
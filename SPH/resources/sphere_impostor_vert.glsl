@@ -0,0 +1,41 @@
+#version 120
+#extension GL_ARB_uniform_buffer_object : require
+
+layout(std140) uniform Frame {
+	mat4 P;
+	mat4 V;
+	vec4 lightPos;		// view space
+};
+
+attribute vec3 aPos;		// quad corner, xy in [-1, 1]
+
+attribute vec4 position;	// xyz and radius, or a QuantizedInstance, see phong_instanced_vert.glsl
+
+uniform vec4 decode_offset;
+uniform vec4 decode_scale;
+
+varying vec3 pos;			// view space, on the quad
+varying vec3 center;
+varying float radius;
+
+
+void main(){
+	center = (V * vec4(decode_offset.xyz + decode_scale.xyz * position.xyz, 1.0)).xyz;
+	radius = position.w;
+	if (decode_offset.w > 0.5) {
+		float bits = floor(position.w * 65535.0 + 0.5);
+		radius = decode_scale.w * (bits - 256.0 * floor(bits / 256.0)) / 255.0;
+	}
+
+	// the quad faces the eye and is as wide as the cone of rays that touch
+	// the sphere, so perspective never clips its silhouette
+	float d2 = dot(center, center);
+	vec3 w = -center / sqrt(d2);
+	vec3 up = abs(w.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+	vec3 u = normalize(cross(up, w));
+	vec3 v = cross(w, u);
+	float size = radius * sqrt(d2 / max(d2 - radius * radius, 1e-6 * d2));
+
+	pos = center + size * (aPos.x * u + aPos.y * v);
+	gl_Position = P * vec4(pos, 1.0);
+}
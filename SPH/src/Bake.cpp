@@ -0,0 +1,290 @@
+#include "Bake.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "Particles.h"
+
+static const char bake_magic[4] = {'S', 'P', 'H', 'B'};
+static const char index_magic[4] = {'S', 'P', 'H', 'I'};
+
+// float values per particle for a set of channels
+static int components(unsigned channels) {
+    return 3 + (channels & BAKE_VELOCITY ? 3 : 0) + (channels & BAKE_DENSITY ? 1 : 0);
+}
+
+// where each channel sits in a frame's values, how many values a particle
+// has in it and what they are quantized to
+struct Channel {
+    size_t start, count, stride;
+    float quantum;
+};
+
+static int layout(const BakeHeader& header, Channel out[3]) {
+    size_t n = header.particles, at = 0;
+    int c = 0;
+    out[c++] = {at, 3 * n, 3, header.position_quantum};
+    at += 3 * n;
+    if (header.channels & BAKE_VELOCITY) {
+        out[c++] = {at, 3 * n, 3, header.velocity_quantum};
+        at += 3 * n;
+    }
+    if (header.channels & BAKE_DENSITY) out[c++] = {at, n, 1, header.density_quantum};
+    return c;
+}
+
+static int seek(FILE* f, std::uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(f, (long long)offset, SEEK_SET);
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+BakeWriter::BakeWriter(const std::string& path, int particles, unsigned channels) {
+    std::memcpy(header.magic, bake_magic, 4);
+    header.version = 1;
+    header.particles = (std::uint32_t)particles;
+    header.channels = channels;
+    header.keyframe_interval = 32;
+    header.position_quantum = 1e-4f;
+    header.velocity_quantum = 1e-3f;
+    header.density_quantum = 1e-4f;
+
+    file = std::fopen(path.c_str(), "wb");
+    if (file) writer = std::thread(&BakeWriter::loop, this);
+}
+
+BakeWriter::~BakeWriter() {
+    close();
+}
+
+void BakeWriter::write(Particles& particles, float time, float dt) {
+    // frames are laid out by id, and splits hand out ids past the count,
+    // which they keep even once merges bring the count back
+    if (particles.size != (int)header.particles || particles.next_id != header.particles) stopped = true;
+    if (!file || stopped) return;
+
+    std::unique_ptr<Frame> frame;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if ((int)pending.size() >= max_pending) {
+            ++stalls;
+            drained.wait(lock, [&] { return (int)pending.size() < max_pending; });
+        }
+        if (!spare.empty()) {
+            frame = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    if (!frame) frame = std::make_unique<Frame>();
+
+    size_t n = header.particles;
+    bool velocity = header.channels & BAKE_VELOCITY, density = header.channels & BAKE_DENSITY;
+    frame->time = time;
+    frame->dt = dt;
+    frame->values.resize(n * components(header.channels));
+    float* p = frame->values.data();
+    float* v = p + 3 * n;
+    float* d = velocity ? v + 3 * n : v;
+    particles.workers().parallel_for(n, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            size_t k = particles.id[i];
+            p[3*k] = particles.x[i];
+            p[3*k + 1] = particles.y[i];
+            p[3*k + 2] = particles.z[i];
+            if (velocity) {
+                v[3*k] = particles.vx[i];
+                v[3*k + 1] = particles.vy[i];
+                v[3*k + 2] = particles.vz[i];
+            }
+            if (density) d[k] = particles.density[i] / particles.rho;
+        }
+    });
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(frame));
+    }
+    queued.notify_one();
+}
+
+void BakeWriter::loop() {
+    for (;;) {
+        std::unique_ptr<Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [&] { return closing || !pending.empty(); });
+            if (pending.empty()) return;
+            frame = std::move(pending.front());
+            pending.pop_front();
+        }
+        encode(*frame);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            spare.push_back(std::move(frame));
+        }
+        drained.notify_one();
+    }
+}
+
+void BakeWriter::encode(const Frame& frame) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (index.empty()) {
+        std::fwrite(&header, sizeof(header), 1, file);
+        offset = sizeof(header);
+    }
+
+    std::uint32_t f = (std::uint32_t)index.size();
+    bool key = f % std::max<std::uint32_t>(header.keyframe_interval, 1) == 0;
+    previous.resize(frame.values.size());
+
+    // zigzag folds the sign into the low bit, LEB128 then spends one byte
+    // per 7 bits, so the small deltas of a smooth flow take one or two
+    bytes.clear();
+    Channel channels[3];
+    for (int c = 0, count = layout(header, channels); c < count; ++c) {
+        const Channel& ch = channels[c];
+        for (size_t k = ch.start; k < ch.start + ch.count; ++k) {
+            std::int32_t q = (std::int32_t)std::lround(frame.values[k] / ch.quantum);
+            // keyframes: against the same component of the particle before,
+            // which previous already holds for this frame
+            std::int32_t base = !key ? previous[k] : k - ch.start >= ch.stride ? previous[k - ch.stride] : 0;
+            std::uint32_t z = ((std::uint32_t)(q - base) << 1) ^ (std::uint32_t)((q - base) >> 31);
+            while (z >= 0x80) {
+                bytes.push_back((unsigned char)(z | 0x80));
+                z >>= 7;
+            }
+            bytes.push_back((unsigned char)z);
+            previous[k] = q;
+        }
+    }
+
+    std::fwrite(bytes.data(), 1, bytes.size(), file);
+    BakeFrame entry = {offset, (std::uint32_t)bytes.size(), key ? f : index.back().keyframe, frame.time, frame.dt};
+    index.push_back(entry);
+    offset += bytes.size();
+
+    bytes_written += bytes.size();
+    frames = (std::uint32_t)index.size();
+    write_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BakeWriter::close() {
+    if (!file) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    queued.notify_one();
+    writer.join();
+
+    if (index.empty()) {
+        std::fwrite(&header, sizeof(header), 1, file);
+        offset = sizeof(header);
+    }
+    BakeTrailer trailer = {offset, (std::uint32_t)index.size(), {}};
+    std::memcpy(trailer.magic, index_magic, 4);
+    std::fwrite(index.data(), sizeof(BakeFrame), index.size(), file);
+    std::fwrite(&trailer, sizeof(trailer), 1, file);
+    std::fclose(file);
+    file = nullptr;
+}
+
+double BakeWriter::bytes_per_particle_frame() const {
+    return frames ? (double)bytes_written / ((double)frames * header.particles) : 0.0;
+}
+
+double BakeWriter::megabytes_per_second() const {
+    return write_seconds > 0.0 ? bytes_written / write_seconds / 1e6 : 0.0;
+}
+
+BakeReader::~BakeReader() {
+    if (file) std::fclose(file);
+}
+
+bool BakeReader::open(const std::string& path) {
+    if (file) std::fclose(file);
+    index.clear();
+    decoded = -1;
+
+    file = std::fopen(path.c_str(), "rb");
+    if (!file) return false;
+
+    BakeTrailer trailer;
+    bool ok = std::fread(&header, sizeof(header), 1, file) == 1 && !std::memcmp(header.magic, bake_magic, 4)
+        && std::fseek(file, -(long)sizeof(trailer), SEEK_END) == 0
+        && std::fread(&trailer, sizeof(trailer), 1, file) == 1 && !std::memcmp(trailer.magic, index_magic, 4);
+    if (ok) {
+        index.resize(trailer.frames);
+        ok = seek(file, trailer.index) == 0
+            && std::fread(index.data(), sizeof(BakeFrame), index.size(), file) == index.size();
+    }
+    if (!ok) {
+        std::fclose(file);
+        file = nullptr;
+        index.clear();
+    }
+    return ok;
+}
+
+bool BakeReader::read(int f, std::vector<glm::vec3>& positions, std::vector<glm::vec3>* velocities, std::vector<float>* densities) {
+    if (!file || f < 0 || f >= frames()) return false;
+
+    // continue from the frame decoded last when it is in the same chunk
+    int key = (int)index[f].keyframe;
+    int from = decoded >= key && decoded <= f ? decoded + 1 : key;
+    size_t n = header.particles;
+    values.resize(n * components(header.channels));
+
+    Channel channels[3];
+    int count = layout(header, channels);
+    for (int g = from; g <= f; ++g) {
+        chunk.resize(index[g].bytes);
+        if (seek(file, index[g].offset) != 0 || std::fread(chunk.data(), 1, chunk.size(), file) != chunk.size()) {
+            decoded = -1;
+            return false;
+        }
+        bool keyframe = g == (int)index[g].keyframe;
+        const unsigned char* b = chunk.data();
+        const unsigned char* end = b + chunk.size();
+        for (int c = 0; c < count; ++c) {
+            const Channel& ch = channels[c];
+            for (size_t k = ch.start; k < ch.start + ch.count; ++k) {
+                std::uint32_t z = 0;
+                for (int shift = 0; b < end; shift += 7) {
+                    unsigned char byte = *b++;
+                    z |= (std::uint32_t)(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) break;
+                }
+                std::int32_t delta = (std::int32_t)(z >> 1) ^ -(std::int32_t)(z & 1);
+                std::int32_t base = !keyframe ? values[k] : k - ch.start >= ch.stride ? values[k - ch.stride] : 0;
+                values[k] = base + delta;
+            }
+        }
+        decoded = g;
+    }
+
+    positions.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        positions[i] = glm::vec3(values[3*i], values[3*i + 1], values[3*i + 2]) * header.position_quantum;
+    }
+    size_t at = 3 * n;
+    if (header.channels & BAKE_VELOCITY) {
+        if (velocities) {
+            velocities->resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                (*velocities)[i] = glm::vec3(values[at + 3*i], values[at + 3*i + 1], values[at + 3*i + 2]) * header.velocity_quantum;
+            }
+        }
+        at += 3 * n;
+    }
+    if (header.channels & BAKE_DENSITY && densities) {
+        densities->resize(n);
+        for (size_t i = 0; i < n; ++i) (*densities)[i] = values[at + i] * header.density_quantum;
+    }
+    return true;
+}
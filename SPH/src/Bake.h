@@ -0,0 +1,142 @@
+#pragma once
+
+#ifndef BAKE_H
+#define BAKE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glm/glm.hpp>
+
+struct Particles;
+
+// Channels a bake can carry besides positions.
+#define BAKE_VELOCITY 1u
+#define BAKE_DENSITY  2u
+
+// Baked particle sequence, one frame per simulation step.
+//
+//   header    BakeHeader
+//   frames    per channel, n * components zigzag LEB128 integers
+//   index     BakeFrame per frame
+//   trailer   BakeTrailer, the last bytes of the file
+//
+// Values are quantized to integer multiples of the channel's quantum and
+// written in particle id order, so reorders do not show up between frames.
+// A keyframe every keyframe_interval frames stores each particle against the
+// previous particle; every other frame stores it against itself one frame
+// earlier. Any frame decodes from its keyframe, which the index names, so
+// reads are random access at the cost of at most one chunk of frames.
+struct BakeHeader {
+    char magic[4];              // "SPHB"
+    std::uint32_t version;
+    std::uint32_t particles;
+    std::uint32_t channels;     // BAKE_* bits
+    std::uint32_t keyframe_interval;
+    float position_quantum;     // in meters
+    float velocity_quantum;     // in meters per second
+    float density_quantum;      // in units of the rest density
+};
+
+struct BakeFrame {
+    std::uint64_t offset;       // of the frame's first byte
+    std::uint32_t bytes;
+    std::uint32_t keyframe;     // frame to start decoding from
+    float time;                 // simulated seconds at the end of the step
+    float dt;
+};
+
+struct BakeTrailer {
+    std::uint64_t index;        // offset of the first BakeFrame
+    std::uint32_t frames;
+    char magic[4];              // "SPHI"
+};
+
+// Streams frames to a bake file from a thread of its own. write() only
+// copies the particle arrays into a recycled buffer and queues it; the writer
+// quantizes, delta codes and writes. The queue is capped at max_pending
+// frames to bound memory, write() waits when the writer falls that far
+// behind and counts it as a stall. The quanta and keyframe interval in
+// header may be changed until the first write().
+class BakeWriter {
+    public:
+        BakeWriter(const std::string& path, int particles, unsigned channels = 0);
+        ~BakeWriter();
+        BakeWriter(BakeWriter const&) = delete;
+        void operator=(BakeWriter const&) = delete;
+
+        bool ok() const { return file != nullptr; }
+        // Queues a frame of particles, whose ids have to run from 0 to the
+        // count; from the first that adaptivity changed on, none.
+        void write(Particles& particles, float time, float dt);
+        // Drains the queue, writes index and trailer and closes the file.
+        void close();
+
+        BakeHeader header;
+        int max_pending = 8;
+
+        // written by the writer thread, read them after close()
+        std::uint32_t frames = 0;
+        std::uint64_t bytes_written = 0;    // frames only, not header, index or trailer
+        double write_seconds = 0.0;         // writer busy time, encode and fwrite
+        int stalls = 0;                     // write() calls that waited on the writer
+
+        double bytes_per_particle_frame() const;
+        double megabytes_per_second() const;
+
+    private:
+        struct Frame {
+            float time, dt;
+            std::vector<float> values;      // channel after channel, in id order
+        };
+
+        void loop();
+        void encode(const Frame& frame);
+
+        FILE* file = nullptr;
+        bool stopped = false;                   // for good, the count changed
+        std::uint64_t offset = 0;
+        std::vector<BakeFrame> index;
+        std::vector<std::int32_t> previous;     // quantized values of the last frame
+        std::vector<unsigned char> bytes;
+
+        std::thread writer;
+        std::mutex mutex;
+        std::condition_variable queued, drained;
+        std::deque<std::unique_ptr<Frame>> pending, spare;
+        bool closing = false;
+};
+
+// Random access to a bake written by BakeWriter.
+class BakeReader {
+    public:
+        BakeReader() = default;
+        ~BakeReader();
+        BakeReader(BakeReader const&) = delete;
+        void operator=(BakeReader const&) = delete;
+
+        bool open(const std::string& path);
+
+        BakeHeader header;
+        std::vector<BakeFrame> index;
+
+        int frames() const { return (int)index.size(); }
+        // Decodes frame f, in particle id order; velocities and densities
+        // only when the bake has them and the pointers are given.
+        bool read(int f, std::vector<glm::vec3>& positions,
+                  std::vector<glm::vec3>* velocities = nullptr, std::vector<float>* densities = nullptr);
+
+    private:
+        FILE* file = nullptr;
+        std::vector<unsigned char> chunk;
+        std::vector<std::int32_t> values;
+        int decoded = -1;       // frame values currently holds
+};
+
+#endif
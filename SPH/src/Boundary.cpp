@@ -0,0 +1,73 @@
+#include "Boundary.h"
+
+#include <chrono>
+#include <cmath>
+#include <unordered_set>
+
+#include "Kernels.h"
+#include "RadixSort.h"
+
+void Boundary::sample(const std::vector<glm::vec3>& triangles) {
+    // samples closer than a quarter of the spacing count as the same point
+    std::unordered_set<std::uint64_t> seen;
+    for (int i = 0; i < size(); ++i) {
+        seen.insert(Grid::pack(glm::ivec3(glm::round(glm::vec3(x[i], y[i], z[i]) * 4.0f / spacing))));
+    }
+
+    for (size_t t = 0; t + 2 < triangles.size(); t += 3) {
+        glm::vec3 a = triangles[t], b = triangles[t+1], c = triangles[t+2];
+        float edge = glm::max(glm::length(b - a), glm::max(glm::length(c - a), glm::length(c - b)));
+        int n = glm::max(1, (int)std::ceil(edge / spacing));
+        for (int i = 0; i <= n; ++i) {
+            for (int j = 0; i + j <= n; ++j) {
+                glm::vec3 p = a + (b - a) * ((float)i / n) + (c - a) * ((float)j / n);
+                if (!seen.insert(Grid::pack(glm::ivec3(glm::round(p * 4.0f / spacing)))).second) continue;
+                x.push_back(p.x);
+                y.push_back(p.y);
+                z.push_back(p.z);
+            }
+        }
+    }
+}
+
+void Boundary::build(float h, float rho, ThreadPool& pool) {
+    auto start = std::chrono::steady_clock::now();
+    int n = size();
+    psi.assign(n, 0.0f);
+    if (n == 0) return;
+
+    // z-order once, the fluid then walks the walls in cache friendly runs
+    glm::vec3 lo(x[0], y[0], z[0]);
+    for (int i = 0; i < n; ++i) lo = glm::min(lo, glm::vec3(x[i], y[i], z[i]));
+    std::vector<std::uint64_t> keys(n);
+    std::vector<unsigned> order(n);
+    for (int i = 0; i < n; ++i) {
+        glm::uvec3 c = glm::min(glm::uvec3((glm::vec3(x[i], y[i], z[i]) - lo) / h), glm::uvec3(0x1fffff));
+        keys[i] = morton(c.x, c.y, c.z);
+        order[i] = i;
+    }
+    radix_sort(keys, order, pool);
+    for (std::vector<float>* a : {&x, &y, &z}) {
+        std::vector<float> sorted(n);
+        for (int i = 0; i < n; ++i) sorted[i] = (*a)[order[i]];
+        a->swap(sorted);
+    }
+
+    grid.build(x.data(), y.data(), z.data(), n, h, pool);
+
+    Kernels kernels(h);
+    pool.parallel_for(n, 256, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            glm::vec3 p(x[i], y[i], z[i]);
+            float sum = 0.0f;
+            grid.for_each_candidate(p, [&](unsigned j) {
+                glm::vec3 d = p - glm::vec3(x[j], y[j], z[j]);
+                float r2 = glm::dot(d, d);
+                if (r2 < kernels.h2) sum += kernels.poly6(r2);
+            });
+            psi[i] = rho / sum;
+        }
+    });
+
+    build_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef BOUNDARY_H
+#define BOUNDARY_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "Grid.h"
+#include "ThreadPool.h"
+
+// Static walls as one layer of particles (Akinci et al. 2012). Samples are
+// taken from triangle soups such as Mesh::posBuf, then build() sorts them in
+// z-order, hashes them into a grid of their own and gives each the mass it
+// stands for, psi = rho0 / sum_k W(x_b - x_k) over the nearby samples, so
+// uneven sampling does not turn into uneven pressure. Walls never move, so
+// this all happens once; fluid particles only ever query the grid.
+struct Boundary {
+    float spacing = 0.05f;      // distance between samples along a triangle
+    float build_ms = 0.0f;
+
+    std::vector<float> x, y, z;
+    std::vector<float> psi;     // rest density times the volume of each sample
+    Grid grid;                  // cell size is the h given to build
+
+    int size() const { return (int)x.size(); }
+
+    // Adds samples over every triangle, three vertices each, skipping points
+    // that an earlier triangle already placed on a shared edge.
+    void sample(const std::vector<glm::vec3>& triangles);
+    void build(float h, float rho, ThreadPool& pool);
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include "Cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Particles.h"
+
+static const char cache_magic[4] = {'S', 'P', 'H', 'C'};
+
+static std::uint64_t align(std::uint64_t bytes) {
+    return (bytes + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+// payload of a frame of particles in an encoding
+static std::uint64_t frame_bytes(std::uint64_t particles, unsigned encoding) {
+    return particles * (encoding == CACHE_Q16 ? 3 * sizeof(std::uint16_t) : sizeof(glm::vec4));
+}
+
+static int seek(FILE* f, std::uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(f, (long long)offset, SEEK_SET);
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+CacheWriter::CacheWriter(const std::string& path, int particles, float radius, unsigned encoding) {
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, cache_magic, 4);
+    header.version = 1;
+    header.particles = (std::uint32_t)particles;
+    header.encoding = encoding;
+    header.radius = radius;
+    header.frame_bytes = frame_bytes(particles, encoding);
+    header.stride = align(header.frame_bytes);
+    header.index = CACHE_ALIGN;
+
+    file = std::fopen(path.c_str(), "wb");
+    if (file) block.resize(header.stride);
+}
+
+CacheWriter::~CacheWriter() {
+    close();
+}
+
+void CacheWriter::write(Particles& particles, float time) {
+    if (!file || particles.size != (int)header.particles) return;
+    auto start = std::chrono::steady_clock::now();
+
+    size_t n = header.particles;
+    CacheFrame entry = {time, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, 0.0f};
+    ThreadPool& pool = particles.workers();
+    packed.resize(n);
+    particles.pack(packed.data());
+    glm::vec3 lo = pool.parallel_reduce(n, 4096, glm::vec3(packed[0]),
+        [&](size_t begin, size_t end) {
+            glm::vec3 m(packed[begin]);
+            for (size_t i = begin; i < end; ++i) m = glm::min(m, glm::vec3(packed[i]));
+            return m;
+        },
+        [](const glm::vec3& a, const glm::vec3& b) { return glm::min(a, b); });
+    glm::vec3 hi = pool.parallel_reduce(n, 4096, glm::vec3(packed[0]),
+        [&](size_t begin, size_t end) {
+            glm::vec3 m(packed[begin]);
+            for (size_t i = begin; i < end; ++i) m = glm::max(m, glm::vec3(packed[i]));
+            return m;
+        },
+        [](const glm::vec3& a, const glm::vec3& b) { return glm::max(a, b); });
+    for (int c = 0; c < 3; ++c) {
+        entry.lo[c] = lo[c];
+        entry.hi[c] = hi[c];
+    }
+
+    if (header.encoding == CACHE_Q16) {
+        // 65535 steps across the bounds, rounded to the nearest
+        glm::vec3 scale = 65535.0f / glm::max(hi - lo, glm::vec3(1e-30f));
+        std::uint16_t* q = reinterpret_cast<std::uint16_t*>(block.data());
+        pool.parallel_for(n, 4096, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                glm::vec3 t = (glm::vec3(packed[i]) - lo) * scale + 0.5f;
+                q[3*i] = (std::uint16_t)t.x;
+                q[3*i + 1] = (std::uint16_t)t.y;
+                q[3*i + 2] = (std::uint16_t)t.z;
+            }
+        });
+    } else {
+        std::memcpy(block.data(), packed.data(), header.frame_bytes);
+    }
+
+    // the header page is written by close(), once frames is known
+    if (index.empty()) seek(file, CACHE_ALIGN);
+    std::fwrite(block.data(), 1, header.stride, file);
+    index.push_back(entry);
+    header.index += header.stride;
+
+    write_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void CacheWriter::close() {
+    if (!file) return;
+    header.frames = (std::uint32_t)index.size();
+    seek(file, header.index);
+    std::fwrite(index.data(), sizeof(CacheFrame), index.size(), file);
+
+    std::vector<unsigned char> page(CACHE_ALIGN, 0);
+    std::memcpy(page.data(), &header, sizeof(header));
+    seek(file, 0);
+    std::fwrite(page.data(), 1, page.size(), file);
+    std::fclose(file);
+    file = nullptr;
+}
+
+ParticleCache::~ParticleCache() {
+    close();
+}
+
+ParticleCache::ParticleCache(ParticleCache&& other) noexcept {
+    *this = std::move(other);
+}
+
+ParticleCache& ParticleCache::operator=(ParticleCache&& other) noexcept {
+    if (this == &other) return *this;
+    close();
+    header = other.header;
+    pool = other.pool;
+    prefetch_frames = other.prefetch_frames;
+    data = std::exchange(other.data, nullptr);
+    size = std::exchange(other.size, 0);
+    index = std::exchange(other.index, nullptr);
+#ifdef _WIN32
+    mapping = std::exchange(other.mapping, nullptr);
+#endif
+    other.header = {};
+    return *this;
+}
+
+bool ParticleCache::open(const std::string& path) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER length;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+        size = (std::uint64_t)length.QuadPart;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = (std::uint64_t)st.st_size;
+        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) data = (const unsigned char*)p;
+    }
+    // the mapping keeps the file alive
+    ::close(fd);
+#endif
+
+    bool ok = data && size >= CACHE_ALIGN;
+    if (ok) {
+        std::memcpy(&header, data, sizeof(header));
+        ok = !std::memcmp(header.magic, cache_magic, 4)
+            && (header.encoding == CACHE_RAW || header.encoding == CACHE_Q16)
+            // decode fills particles() entries from a whole block
+            && header.frame_bytes == frame_bytes(header.particles, header.encoding)
+            && header.stride >= header.frame_bytes && header.stride % CACHE_ALIGN == 0 && header.stride <= size
+            && header.index == CACHE_ALIGN + (std::uint64_t)header.frames * header.stride
+            && header.index + header.frames * sizeof(CacheFrame) <= size;
+    }
+    if (!ok) {
+        close();
+        return false;
+    }
+    index = reinterpret_cast<const CacheFrame*>(data + header.index);
+    prefetch(-1);
+    return true;
+}
+
+void ParticleCache::close() {
+    if (data) {
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+#else
+        munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+#ifdef _WIN32
+    if (mapping) CloseHandle(mapping);
+    mapping = nullptr;
+#endif
+    data = nullptr;
+    size = 0;
+    index = nullptr;
+    header = {};
+}
+
+void ParticleCache::decode(int f, glm::vec4* out) const {
+    if (!data || f < 0 || f >= frames()) return;
+    size_t n = header.particles;
+
+    if (header.encoding == CACHE_RAW) {
+        std::memcpy(out, block(f), header.frame_bytes);
+        return;
+    }
+
+    const CacheFrame& entry = index[f];
+    glm::vec3 lo(entry.lo[0], entry.lo[1], entry.lo[2]);
+    glm::vec3 step = (glm::vec3(entry.hi[0], entry.hi[1], entry.hi[2]) - lo) / 65535.0f;
+    const std::uint16_t* q = static_cast<const std::uint16_t*>(block(f));
+    float radius = header.radius;
+    auto expand = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            glm::vec3 p = lo + glm::vec3(q[3*i], q[3*i + 1], q[3*i + 2]) * step;
+            out[i] = glm::vec4(p, radius);
+        }
+    };
+    if (pool) pool->parallel_for(n, 16384, expand);
+    else expand(0, n);
+}
+
+void ParticleCache::prefetch(int f) const {
+    if (!data || frames() == 0) return;
+    int count = std::min(prefetch_frames, frames());
+#ifdef _WIN32
+    std::vector<WIN32_MEMORY_RANGE_ENTRY> ranges;
+    for (int k = 1; k <= count; ++k) {
+        WIN32_MEMORY_RANGE_ENTRY range = {(void*)block((f + k) % frames()), (SIZE_T)header.frame_bytes};
+        ranges.push_back(range);
+    }
+    PrefetchVirtualMemory(GetCurrentProcess(), ranges.size(), ranges.data(), 0);
+#else
+    // madvise wants the system page, which may be larger than CACHE_ALIGN
+    static const std::uintptr_t page = (std::uintptr_t)sysconf(_SC_PAGESIZE);
+    for (int k = 1; k <= count; ++k) {
+        std::uintptr_t begin = (std::uintptr_t)block((f + k) % frames());
+        std::uintptr_t end = begin + header.frame_bytes;
+        begin &= ~(page - 1);
+        madvise((void*)begin, end - begin, MADV_WILLNEED);
+    }
+#endif
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "ThreadPool.h"
+
+struct Particles;
+
+// How a playback cache stores the positions of a frame.
+#define CACHE_RAW 0u        // glm::vec4 per particle, xyz and radius: the instance stream as is
+#define CACHE_Q16 1u        // 3 uint16 per particle, relative to the frame's bounds
+
+// Boundary every frame block starts on, a page on every target that has
+// 4 KiB pages; larger system pages are handled when prefetching.
+#define CACHE_ALIGN 4096
+
+// Particle sequence laid out to be mapped and read in place, for playback.
+//
+//   header    CacheHeader, padded to CACHE_ALIGN
+//   blocks    one per frame, frame_bytes each, every one CACHE_ALIGN aligned
+//   index     CacheFrame per frame, at header.index
+//
+// Frame f starts at CACHE_ALIGN + f * stride, the index only adds its time
+// and bounds, so any frame is a pointer into the mapping. Unlike a bake
+// nothing is delta coded: a raw block is the renderer's instance stream and
+// goes to the GPU without being touched, a q16 block costs 6 instead of 16
+// bytes a particle and one pass to expand.
+struct CacheHeader {
+    char magic[4];              // "SPHC"
+    std::uint32_t version;
+    std::uint32_t particles;
+    std::uint32_t frames;
+    std::uint32_t encoding;     // CACHE_RAW or CACHE_Q16
+    float radius;               // instance scale, also the w of raw blocks
+    std::uint64_t frame_bytes;  // payload of a block
+    std::uint64_t stride;       // frame_bytes rounded up to CACHE_ALIGN
+    std::uint64_t index;        // offset of the first CacheFrame
+};
+
+struct CacheFrame {
+    float time;                 // simulated seconds at the end of the step
+    float lo[3], hi[3];         // bounds of the positions, q16 values span them
+    float pad;
+};
+
+// Writes a playback cache one frame at a time. Blocks go out as they come,
+// in the particles' current order, and the index and final header once the
+// frame count is known.
+class CacheWriter {
+    public:
+        CacheWriter(const std::string& path, int particles, float radius, unsigned encoding = CACHE_RAW);
+        ~CacheWriter();
+        CacheWriter(CacheWriter const&) = delete;
+        void operator=(CacheWriter const&) = delete;
+
+        bool ok() const { return file != nullptr; }
+        void write(Particles& particles, float time);
+        // Writes index and header and closes the file.
+        void close();
+
+        CacheHeader header;
+        double write_seconds = 0.0;     // pack, quantize and fwrite
+
+        std::uint64_t bytes() const { return header.index + index.size() * sizeof(CacheFrame); }
+
+    private:
+        FILE* file = nullptr;
+        std::vector<CacheFrame> index;
+        std::vector<glm::vec4> packed;
+        std::vector<unsigned char> block;
+};
+
+// A playback cache mapped read only. Frames are served from the mapping with
+// no parse step: block() is where the bytes already are, decode() expands
+// them straight into a destination such as a mapped instance buffer.
+// prefetch() asks the OS to start reading the frames that come next, so
+// sequential playback and looping find them resident.
+class ParticleCache {
+    public:
+        ParticleCache() = default;
+        ~ParticleCache();
+        ParticleCache(ParticleCache&& other) noexcept;
+        ParticleCache& operator=(ParticleCache&& other) noexcept;
+        ParticleCache(ParticleCache const&) = delete;
+        void operator=(ParticleCache const&) = delete;
+
+        bool open(const std::string& path);
+        void close();
+
+        CacheHeader header = {};
+        ThreadPool* pool = nullptr;     // expands q16 blocks, inline when null
+        int prefetch_frames = 4;        // ahead of the frame served, wrapping to the start
+
+        int frames() const { return (int)header.frames; }
+        int particles() const { return (int)header.particles; }
+        const CacheFrame& frame(int f) const { return index[f]; }
+        const void* block(int f) const { return data + CACHE_ALIGN + (std::uint64_t)f * header.stride; }
+
+        // Frame f as the instance stream, n glm::vec4 written to out.
+        void decode(int f, glm::vec4* out) const;
+        // Starts reading frames f + 1 to f + prefetch_frames in the background.
+        void prefetch(int f) const;
+
+    private:
+        const unsigned char* data = nullptr;
+        std::uint64_t size = 0;
+        const CacheFrame* index = nullptr;
+#ifdef _WIN32
+        void* mapping = nullptr;
+#endif
+};
+
+#endif
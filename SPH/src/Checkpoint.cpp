@@ -0,0 +1,280 @@
+#include "Checkpoint.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+static const char checkpoint_magic[4] = {'S', 'P', 'H', 'K'};
+#define CHECKPOINT_VERSION 2u
+
+// Settings and counters of a Particles, everything a restore needs besides
+// its arrays. Its layout is the file's, so it only grows at the end with a
+// version bump.
+struct ParticleState {
+    std::int32_t size;
+    std::int32_t solver;
+    float gravity[3];
+    float mpp, rho, nu, r, sigma, k, cfl;
+    float density_error, divergence_error;
+    std::int32_t max_iterations, reorder_interval, steps;
+    float max_speed, max_accel;
+    std::int32_t adaptive, max_level, adapt_interval;
+    float focus[4];
+    std::int32_t population[PARTICLE_LEVELS];
+    float h_max;
+    std::int32_t sleeping, sleep_steps, asleep;
+    float sleep_motion, sleep_density;
+    float radius;
+    std::uint32_t next_id;
+    std::int32_t capacity;          // the arrays held, at least the count of construction
+};
+
+// the arrays that last from a step to the next; the rest is rebuilt by it
+static void arrays(const Particles& p, float* const* floats[15], unsigned* const* uints[2]) {
+    float* const* f[15] = {&p.x, &p.y, &p.z, &p.vx, &p.vy, &p.vz, &p.ax, &p.ay, &p.az, &p.pressure, &p.density, &p.h, &p.mass, &p.color, &p.calm_density};
+    std::copy(f, f + 15, floats);
+    uints[0] = &p.id;
+    uints[1] = &p.quiet;
+}
+
+CheckpointOutput::CheckpointOutput() {
+    bytes.resize(sizeof(CheckpointHeader));
+}
+
+void CheckpointOutput::write(const void* data, std::size_t size) {
+    size_t at = bytes.size();
+    bytes.resize(at + size);
+    std::memcpy(bytes.data() + at, data, size);
+}
+
+void CheckpointOutput::write(const std::string& text) {
+    std::uint32_t length = (std::uint32_t)text.size();
+    write(&length, sizeof(length));
+    write(text.data(), length);
+}
+
+void CheckpointOutput::operator()(entt::entity entity, const Tag& tag) {
+    write(&entity, sizeof(entity));
+    write(tag.tag);
+}
+
+void CheckpointOutput::operator()(entt::entity entity, const Particles& p) {
+    write(&entity, sizeof(entity));
+    ParticleState s = {};
+    s.size = p.size - p.ghosts;
+    s.solver = (std::int32_t)p.solver;
+    for (int c = 0; c < 3; ++c) s.gravity[c] = p.gravity[c];
+    s.mpp = p.mpp;
+    s.rho = p.rho;
+    s.nu = p.nu;
+    s.r = p.r;
+    s.sigma = p.sigma;
+    s.k = p.k;
+    s.cfl = p.cfl;
+    s.density_error = p.density_error;
+    s.divergence_error = p.divergence_error;
+    s.max_iterations = p.max_iterations;
+    s.reorder_interval = p.reorder_interval;
+    s.steps = p.steps;
+    s.max_speed = p.max_speed;
+    s.max_accel = p.max_accel;
+    s.adaptive = p.adaptive;
+    s.max_level = p.max_level;
+    s.adapt_interval = p.adapt_interval;
+    for (int c = 0; c < 4; ++c) s.focus[c] = p.focus[c];
+    for (int l = 0; l < PARTICLE_LEVELS; ++l) s.population[l] = p.population[l];
+    s.h_max = p.h_max;
+    s.sleeping = p.sleeping;
+    s.sleep_steps = p.sleep_steps;
+    s.asleep = p.asleep;
+    s.sleep_motion = p.sleep_motion;
+    s.sleep_density = p.sleep_density;
+    s.radius = p.radius;
+    s.next_id = p.next_id;
+    s.capacity = p.capacity;
+    write(&s, sizeof(s));
+
+    float* const* floats[15];
+    unsigned* const* uints[2];
+    arrays(p, floats, uints);
+    // one allocation for all of them, then a copy per array
+    bytes.reserve(bytes.size() + (size_t)s.size * 17 * 4);
+    for (float* const* a : floats) write(*a, s.size * sizeof(float));
+    for (unsigned* const* a : uints) write(*a, s.size * sizeof(unsigned));
+}
+
+void CheckpointOutput::finish(float time) {
+    CheckpointHeader header = {};
+    std::memcpy(header.magic, checkpoint_magic, 4);
+    header.version = CHECKPOINT_VERSION;
+    header.time = time;
+    header.bytes = bytes.size() - sizeof(CheckpointHeader);
+    std::memcpy(bytes.data(), &header, sizeof(header));
+}
+
+CheckpointInput::CheckpointInput(const std::string& path) {
+    file = std::fopen(path.c_str(), "rb");
+    if (!file) return;
+    ok = true;
+    read(&header, sizeof(header));
+    ok = ok && !std::memcmp(header.magic, checkpoint_magic, 4) && header.version == CHECKPOINT_VERSION;
+}
+
+CheckpointInput::~CheckpointInput() {
+    if (file) std::fclose(file);
+}
+
+void CheckpointInput::read(void* data, std::size_t size) {
+    if (!ok) return;
+    ok = std::fread(data, 1, size, file) == size;
+    bytes_read += size;
+}
+
+void CheckpointInput::read(std::string& text) {
+    std::uint32_t length = 0;
+    read(&length, sizeof(length));
+    if (!ok) return;
+    text.resize(length);
+    read(&text[0], length);
+}
+
+void CheckpointInput::operator()(std::underlying_type_t<entt::entity>& count) {
+    count = 0;
+    read(&count, sizeof(count));
+    if (!ok) count = 0;
+}
+
+void CheckpointInput::operator()(entt::entity& entity, Tag& tag) {
+    read(&entity, sizeof(entity));
+    read(tag.tag);
+}
+
+void CheckpointInput::operator()(entt::entity& entity, Particles& p) {
+    read(&entity, sizeof(entity));
+    ParticleState s;
+    read(&s, sizeof(s));
+    if (!ok || s.size < 0 || s.capacity < 0) {
+        ok = false;
+        return;
+    }
+    p.solver = (Solver)s.solver;
+    p.gravity = glm::vec3(s.gravity[0], s.gravity[1], s.gravity[2]);
+    p.mpp = s.mpp;
+    p.rho = s.rho;
+    p.nu = s.nu;
+    p.r = s.r;
+    p.sigma = s.sigma;
+    p.k = s.k;
+    p.cfl = s.cfl;
+    p.density_error = s.density_error;
+    p.divergence_error = s.divergence_error;
+    p.max_iterations = s.max_iterations;
+    p.reorder_interval = s.reorder_interval;
+    p.steps = s.steps;
+    p.max_speed = s.max_speed;
+    p.max_accel = s.max_accel;
+    p.adaptive = s.adaptive;
+    p.max_level = s.max_level;
+    p.adapt_interval = s.adapt_interval;
+    p.focus = glm::vec4(s.focus[0], s.focus[1], s.focus[2], s.focus[3]);
+    for (int l = 0; l < PARTICLE_LEVELS; ++l) p.population[l] = s.population[l];
+    p.h_max = s.h_max;
+    p.sleeping = s.sleeping;
+    p.sleep_steps = s.sleep_steps;
+    p.asleep = s.asleep;
+    p.sleep_motion = s.sleep_motion;
+    p.sleep_density = s.sleep_density;
+    p.radius = s.radius;
+    p.next_id = s.next_id;
+    p.kernels = Kernels(p.r);
+    p.ghosts = 0;
+    p.neighbors_current = false;
+
+    // the loader reuses one instance, which it moved from, for every entity;
+    // the arrays come back as large as they were, so merged particles can
+    // split back to the count of construction in place
+    p.size = 0;
+    p.reserve(std::max(s.size, s.capacity));
+    p.size = s.size;
+    float* const* floats[15];
+    unsigned* const* uints[2];
+    arrays(p, floats, uints);
+    for (float* const* a : floats) read(*a, s.size * sizeof(float));
+    for (unsigned* const* a : uints) read(*a, s.size * sizeof(unsigned));
+    for (int i = 0; i < s.size; ++i) {
+        p.viscosity[i] = p.tension[i] = glm::vec4(0.0f);
+        p.alpha[i] = p.kappa[i] = 0.0f;
+    }
+}
+
+CheckpointWriter::CheckpointWriter() {
+    writer = std::thread([this] { loop(); });
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    queued.notify_one();
+    writer.join();
+}
+
+void CheckpointWriter::write(const std::string& to, std::vector<unsigned char>&& data) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (pending) {
+        ++stalls;
+        drained.wait(lock, [this] { return !pending; });
+    }
+    path = to;
+    bytes = std::move(data);
+    pending = true;
+    lock.unlock();
+    queued.notify_one();
+}
+
+void CheckpointWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [this] { return !pending; });
+}
+
+void CheckpointWriter::loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        queued.wait(lock, [this] { return pending || closing; });
+        if (!pending) return;
+        // the caller only waits on the lock to queue the next one
+        std::string to = path;
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        std::string tmp = to + ".tmp";
+        FILE* file = std::fopen(tmp.c_str(), "wb");
+        bool done = file && std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+        if (file) done = std::fclose(file) == 0 && done;
+#ifdef _WIN32
+        // rename only replaces an existing file on POSIX
+        if (done) std::remove(to.c_str());
+#endif
+        done = done && std::rename(tmp.c_str(), to.c_str()) == 0;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        if (done) {
+            ++written;
+            bytes_written = bytes.size();
+            write_seconds = seconds;
+        } else {
+            ++failed;
+        }
+        bytes.clear();
+        bytes.shrink_to_fit();
+        pending = false;
+        drained.notify_all();
+    }
+}
+
+double CheckpointWriter::megabytes_per_second() const {
+    return write_seconds > 0.0 ? bytes_written / write_seconds / 1e6 : 0.0;
+}
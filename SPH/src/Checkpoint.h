@@ -0,0 +1,156 @@
+#pragma once
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+// entt's snapshot loader keeps an entity only for an assertion, which
+// NDEBUG drops, and GCC warns where the template is written, not where
+// restore instantiates it; so the header has to be read, wherever it is
+// read first, with the warning off
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#endif
+#include <entt/entt.hpp>
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#include "Particles.h"
+#include "Tag.h"
+
+// Registry checkpoint, an entt snapshot behind a header.
+//
+//   header    CheckpointHeader
+//   snapshot  entities, then every component type in the order given
+//
+// Plain components go as their bytes, strings as a length and the
+// characters. A Particles goes as a ParticleState of its settings, then each
+// array's first size entries in one block, so writing is a copy per array
+// and restoring reads every array straight into place with one fread.
+// Pointers, the pool, walls and collider, are not kept: a restore takes
+// them from the component it replaces. Neighbor lists are rebuilt by the
+// first step.
+struct CheckpointHeader {
+    char magic[4];              // "SPHK"
+    std::uint32_t version;
+    float time;                 // simulated seconds
+    std::uint32_t pad;
+    std::uint64_t bytes;        // of the snapshot
+};
+
+// Output archive for entt::snapshot, into memory. Archives of more types
+// derive from it and bring its operator() in.
+class CheckpointOutput {
+    public:
+        CheckpointOutput();
+        std::vector<unsigned char> bytes;
+
+        void operator()(std::underlying_type_t<entt::entity> count) { write(&count, sizeof(count)); }
+        void operator()(entt::entity entity) { write(&entity, sizeof(entity)); }
+        template<typename T>
+        void operator()(entt::entity entity, const T& component) {
+            static_assert(std::is_trivially_copyable_v<T>, "components with pointers need an overload");
+            write(&entity, sizeof(entity));
+            write(&component, sizeof(T));
+        }
+        void operator()(entt::entity entity, const Tag& tag);
+        void operator()(entt::entity entity, const Particles& particles);
+
+        // Fills in the header, once the snapshot is taken.
+        void finish(float time);
+        void write(const void* data, std::size_t size);
+        void write(const std::string& text);
+};
+
+// Input archive for entt::snapshot_loader, from a file. Once a read falls
+// short ok is false and every later count reads as 0, so the loader stops.
+class CheckpointInput {
+    public:
+        explicit CheckpointInput(const std::string& path);
+        ~CheckpointInput();
+        CheckpointInput(CheckpointInput const&) = delete;
+        void operator=(CheckpointInput const&) = delete;
+
+        CheckpointHeader header;
+        bool ok = false;
+        std::uint64_t bytes_read = 0;
+
+        void operator()(std::underlying_type_t<entt::entity>& count);
+        void operator()(entt::entity& entity) { read(&entity, sizeof(entity)); }
+        template<typename T>
+        void operator()(entt::entity& entity, T& component) {
+            static_assert(std::is_trivially_copyable_v<T>, "components with pointers need an overload");
+            read(&entity, sizeof(entity));
+            read(&component, sizeof(T));
+        }
+        void operator()(entt::entity& entity, Tag& tag);
+        void operator()(entt::entity& entity, Particles& particles);
+
+        void read(void* data, std::size_t size);
+        void read(std::string& text);
+
+    private:
+        FILE* file = nullptr;
+};
+
+// Takes a snapshot of Components into out. Only the copy into memory
+// happens here; hand out.bytes to a CheckpointWriter to write it.
+template<typename... Components, typename Output>
+void checkpoint(const entt::registry& registry, float time, Output& out) {
+    entt::snapshot{registry}.entities(out).template component<Components...>(out);
+    out.finish(time);
+}
+
+// Loads Components into registry, which has to be empty, with the entity
+// identifiers they were written with.
+template<typename... Components, typename Input>
+bool restore(entt::registry& registry, Input& in) {
+    if (!in.ok) return false;
+    entt::snapshot_loader{registry}.entities(in).template component<Components...>(in).orphans();
+    return in.ok;
+}
+
+// Writes checkpoints from a thread of its own, to path.tmp and then renamed
+// over path, so a crash mid-write leaves the last checkpoint whole. One
+// write is in flight at a time; write() waits for the one before and counts
+// that as a stall.
+class CheckpointWriter {
+    public:
+        CheckpointWriter();
+        ~CheckpointWriter();
+        CheckpointWriter(CheckpointWriter const&) = delete;
+        void operator=(CheckpointWriter const&) = delete;
+
+        void write(const std::string& path, std::vector<unsigned char>&& bytes);
+        // Returns once the write in flight, if any, is on disk.
+        void wait();
+
+        // written by the writer thread, read them after wait()
+        int written = 0, failed = 0, stalls = 0;
+        std::uint64_t bytes_written = 0;
+        double write_seconds = 0.0;         // of the last write
+
+        double megabytes_per_second() const;
+
+    private:
+        void loop();
+
+        std::string path;
+        std::vector<unsigned char> bytes;
+        bool pending = false, closing = false;
+
+        std::thread writer;
+        std::mutex mutex;
+        std::condition_variable queued, drained;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "Cull.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "Particles.h"
+
+// instances classified, and later scattered, per block
+static const size_t cull_grain = 4096;
+
+bool Frustum::operator==(const Frustum& other) const {
+    return !std::memcmp(this, &other, sizeof(Frustum));
+}
+
+Frustum make_frustum(const glm::mat4& P, const glm::mat4& V, int height) {
+    Frustum frustum;
+    glm::mat4 M = P * V;
+    glm::vec4 row[4];
+    for (int r = 0; r < 4; ++r) row[r] = glm::vec4(M[0][r], M[1][r], M[2][r], M[3][r]);
+    // left, right, bottom, top, near, far
+    for (int a = 0; a < 3; ++a) {
+        frustum.planes[2*a] = row[3] + row[a];
+        frustum.planes[2*a + 1] = row[3] - row[a];
+    }
+    for (glm::vec4& plane : frustum.planes) plane /= glm::length(glm::vec3(plane));
+    frustum.depth = -glm::vec4(V[0][2], V[1][2], V[2][2], V[3][2]);
+    frustum.pixels = P[1][1] * (float)height;
+    return frustum;
+}
+
+// Level of the sphere at (x, y, z) of radius r, CULL_LODS when it is outside.
+// Free of branches, so the loops over it vectorize.
+static inline unsigned char classify(const Frustum& f, float x, float y, float z, float r) {
+    auto distance = [&](const glm::vec4& plane) { return plane.x * x + plane.y * y + plane.z * z + plane.w; };
+    float margin = r;
+    for (int p = 0; p < 6; ++p) {
+        float t = distance(f.planes[p]) + r;
+        margin = t < margin ? t : margin;
+    }
+    // diameter in pixels against the thresholds, multiplied out by the depth
+    float d = distance(f.depth);
+    float size = f.pixels * r;
+    int l = (int)(size < f.detail[0] * d) + (int)(size < f.detail[1] * d);
+    // arithmetic rather than a select, which gcc leaves as a branch
+    int inside = margin >= 0.0f;
+    return (unsigned char)(inside * l + (1 - inside) * CULL_LODS);
+}
+
+template<typename Classify, typename Get, typename Out>
+CullStats Culler::run(int n, Classify&& classify_block, Get&& get, Out* out, ThreadPool* pool) {
+    auto start = std::chrono::steady_clock::now();
+    CullStats stats;
+    size_t blocks = ((size_t)n + cull_grain - 1) / cull_grain;
+    level.resize(n);
+    offsets.assign(blocks * CULL_LODS, 0);
+
+    auto each_block = [&](auto&& fn) {
+        if (pool) pool->parallel_for(n, cull_grain, fn);
+        else for (size_t begin = 0; begin < (size_t)n; begin += cull_grain) fn(begin, std::min((size_t)n, begin + cull_grain));
+    };
+
+    each_block([&](size_t begin, size_t end) {
+        classify_block(begin, end, level.data());
+        int* counts = &offsets[begin / cull_grain * CULL_LODS];
+        for (size_t i = begin; i < end; ++i) {
+            if (level[i] < CULL_LODS) ++counts[level[i]];
+        }
+    });
+
+    // block counts become where each block writes its share of a level
+    int base = 0;
+    for (int l = 0; l < CULL_LODS; ++l) {
+        for (size_t b = 0; b < blocks; ++b) {
+            int count = offsets[b * CULL_LODS + l];
+            offsets[b * CULL_LODS + l] = base;
+            stats.counts[l] += count;
+            base += count;
+        }
+    }
+    stats.visible = base;
+    stats.culled = n - base;
+
+    each_block([&](size_t begin, size_t end) {
+        int next[CULL_LODS];
+        for (int l = 0; l < CULL_LODS; ++l) next[l] = offsets[begin / cull_grain * CULL_LODS + l];
+        for (size_t i = begin; i < end; ++i) {
+            if (level[i] < CULL_LODS) out[next[level[i]]++] = get(i);
+        }
+    });
+
+    stats.ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+CullStats Culler::cull(Particles& particles, const Frustum& frustum, glm::vec4* out) {
+    const float* x = particles.x;
+    const float* y = particles.y;
+    const float* z = particles.z;
+    const float* h = particles.h;
+    // spacing grows with the support of adaptive particles
+    float scale = particles.radius / particles.r;
+    auto classify_block = [&](size_t begin, size_t end, unsigned char* l) {
+        // copies the byte stores cannot alias, or they are reloaded every
+        // particle and the loop stays scalar
+        const Frustum f = frustum;
+        const float* px = x, * py = y, * pz = z, * ph = h;
+        const float s = scale;
+        for (size_t i = begin; i < end; ++i) l[i] = classify(f, px[i], py[i], pz[i], s * ph[i]);
+    };
+    auto get = [&](size_t i) { return glm::vec4(x[i], y[i], z[i], scale * h[i]); };
+    return run(particles.size, classify_block, get, out, &particles.workers());
+}
+
+CullStats Culler::cull(const glm::vec4* instances, int n, const Frustum& frustum, glm::vec4* out, ThreadPool* pool) {
+    auto classify_block = [&](size_t begin, size_t end, unsigned char* l) {
+        const Frustum f = frustum;
+        const glm::vec4* s = instances;
+        for (size_t i = begin; i < end; ++i) l[i] = classify(f, s[i].x, s[i].y, s[i].z, s[i].w);
+    };
+    auto get = [&](size_t i) { return instances[i]; };
+    return run(n, classify_block, get, out, pool);
+}
+
+CullStats Culler::cull(const QuantizedInstance* instances, int n, const Quantization& quantization, const Frustum& frustum,
+                       QuantizedInstance* out, ThreadPool* pool) {
+    auto classify_block = [&](size_t begin, size_t end, unsigned char* l) {
+        const Frustum f = frustum;
+        const QuantizedInstance* s = instances;
+        const glm::vec3 lo = quantization.lo, step = (quantization.hi - quantization.lo) / 65535.0f;
+        const float rs = quantization.radius / 255.0f;
+        for (size_t i = begin; i < end; ++i) {
+            l[i] = classify(f, lo.x + step.x * s[i].x, lo.y + step.y * s[i].y, lo.z + step.z * s[i].z, rs * s[i].radius);
+        }
+    };
+    auto get = [&](size_t i) { return instances[i]; };
+    return run(n, classify_block, get, out, pool);
+}
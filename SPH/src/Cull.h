@@ -0,0 +1,63 @@
+#pragma once
+
+#ifndef CULL_H
+#define CULL_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "Quantize.h"
+#include "ThreadPool.h"
+
+struct Particles;
+
+// Detail levels of an instanced sphere, 0 the finest.
+#define CULL_LODS 3
+
+// A camera's view volume as the culling pass tests it.
+struct Frustum {
+    glm::vec4 planes[6];    // normalized, pointing in: a sphere is outside once dot(xyz, c) + w < -r for one
+    glm::vec4 depth;        // dot(depth, (c, 1)) is how far c lies in front of the camera
+    float pixels = 0.0f;    // projected diameter, in pixels, of a unit radius at unit depth
+    // diameters, in pixels, from which a sphere gets level 0, then level 1;
+    // anything smaller gets the last level
+    float detail[CULL_LODS - 1] = {24.0f, 6.0f};
+
+    bool operator==(const Frustum& other) const;
+};
+
+// From the projection and view matrices and the viewport's height in pixels.
+Frustum make_frustum(const glm::mat4& P, const glm::mat4& V, int height);
+
+struct CullStats {
+    int counts[CULL_LODS] = {};     // visible instances per level
+    int visible = 0, culled = 0;
+    float ms = 0.0f;
+};
+
+// Frustum culls instanced spheres and writes the visible ones, grouped by
+// level and in their original order within a level, so each level is one
+// contiguous range of the output starting at the sum of the counts before
+// it. Spheres are classified per block of the pool with branch free loops
+// over the position arrays, then every block scatters its survivors to
+// offsets found by a prefix sum over the block counts, which keeps the
+// output independent of the thread count.
+class Culler {
+    public:
+        // Particles of a fluid, all of them the same radius.
+        CullStats cull(Particles& particles, const Frustum& frustum, glm::vec4* out);
+        // An instance stream, xyz and radius each.
+        CullStats cull(const glm::vec4* instances, int n, const Frustum& frustum, glm::vec4* out, ThreadPool* pool);
+        // A compact one, classified as decoded and written as it came.
+        CullStats cull(const QuantizedInstance* instances, int n, const Quantization& quantization, const Frustum& frustum,
+                       QuantizedInstance* out, ThreadPool* pool);
+
+    private:
+        template<typename Classify, typename Get, typename Out>
+        CullStats run(int n, Classify&& classify, Get&& get, Out* out, ThreadPool* pool);
+
+        std::vector<unsigned char> level;   // per instance, CULL_LODS when culled
+        std::vector<int> offsets;           // per block and level
+};
+
+#endif
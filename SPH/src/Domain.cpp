@@ -0,0 +1,311 @@
+#include "Domain.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+// Bins of the particle count along x that borders are placed from.
+#define DOMAIN_BINS 1024
+
+// what travels of a particle: the 15 arrays that last from a step to the
+// next, then id and quiet; viscosity, tension, alpha and kappa are rebuilt
+#define DOMAIN_FLOATS 15
+#define DOMAIN_RECORD (DOMAIN_FLOATS * sizeof(float) + 2 * sizeof(unsigned))
+
+static void fields(Particles& p, float* out[DOMAIN_FLOATS]) {
+    float* a[DOMAIN_FLOATS] = {p.x, p.y, p.z, p.vx, p.vy, p.vz, p.ax, p.ay, p.az, p.pressure, p.density, p.h, p.mass, p.color, p.calm_density};
+    std::copy(a, a + DOMAIN_FLOATS, out);
+}
+
+static std::vector<double> histogram(const Particles& p, float lo, float hi) {
+    std::vector<double> bins(DOMAIN_BINS, 0.0);
+    float scale = DOMAIN_BINS / std::max(hi - lo, 1e-6f);
+    for (int i = 0; i < p.size - p.ghosts; ++i) {
+        int b = (int)((p.x[i] - lo) * scale);
+        bins[std::min(std::max(b, 0), DOMAIN_BINS - 1)] += 1.0;
+    }
+    return bins;
+}
+
+Domain::Domain(Transport& transport, Particles& particles)
+    : transport(transport), particles(particles), rank(transport.rank), ranks(transport.ranks) {
+    particles.adaptive = false;
+    particles.solver = Solver::EOS;
+    particles.ghosts = 0;
+
+    // the borders come from every rank's share, then each particle goes to its slab
+    ok = agree_cuts() && migrate(true);
+    migrated = 0;
+    halo_bytes = 0;
+    particles.reserve(particles.size + particles.size / 4);
+}
+
+void Domain::place_cuts(const std::vector<double>& bins, float lo, float hi) {
+    cuts.assign(ranks + 1, 0.0f);
+    cuts[0] = -INFINITY;
+    cuts[ranks] = INFINITY;
+    double total = 0.0;
+    for (double b : bins) total += b;
+    float width = std::max(hi - lo, 1e-6f) / DOMAIN_BINS;
+    double below = 0.0;
+    int r = 1;
+    for (int b = 0; b < DOMAIN_BINS && r < ranks; ++b) {
+        below += bins[b];
+        while (r < ranks && below >= total * r / ranks) cuts[r++] = lo + (b + 1) * width;
+    }
+    while (r < ranks) cuts[r++] = hi + width;
+
+    // a slab narrower than the halo would need ghosts from beyond its neighbors
+    float w = halo * particles.h_max;
+    for (r = 2; r < ranks; ++r) cuts[r] = std::max(cuts[r], cuts[r - 1] + w);
+}
+
+bool Domain::step(float dt) {
+    auto start = std::chrono::steady_clock::now();
+    halo_bytes = 0;
+    migrated = 0;
+    bool done = migrate(false);
+    if (done && rebalance_interval > 0 && particles.steps % rebalance_interval == 0) done = rebalance();
+    done = done && copy_ghosts();
+    if (!done) {
+        ok = false;
+        return false;
+    }
+    auto middle = std::chrono::steady_clock::now();
+
+    // an empty slab still counts its steps, the ranks check their counts by them
+    if (particles.size > 0) particles.update(dt);
+    else ++particles.steps;
+    particles.size -= particles.ghosts;
+    particles.ghosts = 0;
+    particles.neighbors_current = false;
+
+    auto end = std::chrono::steady_clock::now();
+    step_ms = std::chrono::duration<float, std::milli>(end - start).count();
+    exchange_ms = std::chrono::duration<float, std::milli>(middle - start).count();
+    return true;
+}
+
+float Domain::stable_dt() {
+    std::vector<double> dt = {-(double)particles.stable_dt()};
+    if (!max(dt)) ok = false;
+    return (float)-dt[0];
+}
+
+// Hands particles that left the slab to the neighbor on that side. Within a
+// step they cross at most one border; after the borders moved they may have
+// to cross several, so settle repeats until none is left to send.
+bool Domain::migrate(bool settle) {
+    for (;;) {
+        left_out.clear();
+        right_out.clear();
+        leaving.assign(particles.size, 0);
+        int sent = 0;
+        for (int i = 0; i < particles.size; ++i) {
+            float x = particles.x[i];
+            if (x < cuts[rank]) pack(i, left_out);
+            else if (x >= cuts[rank + 1]) pack(i, right_out);
+            else continue;
+            leaving[i] = 1;
+            ++sent;
+        }
+        migrated += sent;
+        keep();
+        if (!swap(left_out, right_out)) return false;
+        unpack(left_out);
+        unpack(right_out);
+        if (!settle) return true;
+        std::vector<double> moved = {(double)sent};
+        if (!sum(moved)) return false;
+        if (moved[0] == 0.0) return true;
+    }
+}
+
+bool Domain::copy_ghosts() {
+    float w = halo * particles.h_max;
+    left_out.clear();
+    right_out.clear();
+    for (int i = 0; i < particles.size; ++i) {
+        float x = particles.x[i];
+        if (rank > 0 && x < cuts[rank] + w) pack(i, left_out);
+        if (rank + 1 < ranks && x >= cuts[rank + 1] - w) pack(i, right_out);
+    }
+    if (!swap(left_out, right_out)) return false;
+    int owned = particles.size;
+    unpack(left_out);
+    unpack(right_out);
+    particles.ghosts = particles.size - owned;
+    return true;
+}
+
+bool Domain::rebalance() {
+    std::vector<double> counts(ranks, 0.0);
+    counts[rank] = particles.size;
+    if (!sum(counts)) return false;
+    double total = 0.0, largest = 0.0;
+    for (double c : counts) {
+        total += c;
+        largest = std::max(largest, c);
+    }
+    imbalance = total > 0.0 ? (float)(largest * ranks / total - 1.0) : 0.0f;
+    if (imbalance <= rebalance_threshold) return true;
+    if (!agree_cuts()) return false;
+    ++rebalances;
+    return migrate(true);
+}
+
+// Places the borders at even counts of the particles of every rank.
+bool Domain::agree_cuts() {
+    // the smallest x is the largest of its negation
+    std::vector<double> bounds = {-INFINITY, -INFINITY};
+    for (int i = 0; i < particles.size; ++i) {
+        bounds[0] = std::max(bounds[0], -(double)particles.x[i]);
+        bounds[1] = std::max(bounds[1], (double)particles.x[i]);
+    }
+    if (!max(bounds)) return false;
+    float lo = (float)-bounds[0], hi = (float)bounds[1];
+    if (lo > hi) lo = hi = 0.0f;
+    std::vector<double> bins = histogram(particles, lo, hi);
+    if (!sum(bins)) return false;
+    place_cuts(bins, lo, hi);
+    return true;
+}
+
+bool Domain::swap(std::vector<char>& left, std::vector<char>& right) {
+    halo_bytes += left.size() + right.size();
+    std::vector<char> in;
+    for (int phase = 0; phase < 2; ++phase) {
+        if (rank % 2 == phase && rank + 1 < ranks) {
+            if (!transport.exchange(rank + 1, right, in)) return false;
+            right.swap(in);
+        } else if (rank > 0 && (rank - 1) % 2 == phase) {
+            if (!transport.exchange(rank - 1, left, in)) return false;
+            left.swap(in);
+        }
+    }
+    return true;
+}
+
+void Domain::keep() {
+    float* a[DOMAIN_FLOATS];
+    fields(particles, a);
+    int kept = 0;
+    for (int i = 0; i < particles.size; ++i) {
+        if (leaving[i]) continue;
+        if (kept != i) {
+            for (float* f : a) f[kept] = f[i];
+            particles.id[kept] = particles.id[i];
+            particles.quiet[kept] = particles.quiet[i];
+        }
+        ++kept;
+    }
+    particles.size = kept;
+    particles.neighbors_current = false;
+}
+
+void Domain::pack(int i, std::vector<char>& out) {
+    float* a[DOMAIN_FLOATS];
+    fields(particles, a);
+    size_t at = out.size();
+    out.resize(at + DOMAIN_RECORD);
+    char* p = out.data() + at;
+    for (float* f : a) {
+        std::memcpy(p, &f[i], sizeof(float));
+        p += sizeof(float);
+    }
+    std::memcpy(p, &particles.id[i], sizeof(unsigned));
+    std::memcpy(p + sizeof(unsigned), &particles.quiet[i], sizeof(unsigned));
+}
+
+void Domain::unpack(const std::vector<char>& in) {
+    int count = (int)(in.size() / DOMAIN_RECORD);
+    if (count == 0) return;
+    int size = particles.size;
+    if (size + count > particles.capacity) particles.reserve((size + count) + (size + count) / 4);
+    float* a[DOMAIN_FLOATS];
+    fields(particles, a);
+    const char* p = in.data();
+    for (int i = size; i < size + count; ++i) {
+        for (float* f : a) {
+            std::memcpy(&f[i], p, sizeof(float));
+            p += sizeof(float);
+        }
+        std::memcpy(&particles.id[i], p, sizeof(unsigned));
+        std::memcpy(&particles.quiet[i], p + sizeof(unsigned), sizeof(unsigned));
+        p += 2 * sizeof(unsigned);
+    }
+    particles.size = size + count;
+    particles.neighbors_current = false;
+}
+
+bool Domain::gather(const std::vector<char>& mine, std::vector<std::vector<char>>& all) {
+    std::vector<char> none;
+    if (rank != 0) return transport.exchange(0, mine, none);
+    all.assign(ranks, none);
+    all[0] = mine;
+    for (int r = 1; r < ranks; ++r) {
+        if (!transport.exchange(r, none, all[r])) return false;
+    }
+    return true;
+}
+
+bool Domain::broadcast(std::vector<char>& data) {
+    std::vector<char> none;
+    if (rank != 0) return transport.exchange(0, none, data);
+    for (int r = 1; r < ranks; ++r) {
+        if (!transport.exchange(r, data, none)) return false;
+    }
+    return true;
+}
+
+bool Domain::reduce(std::vector<double>& values, bool largest) {
+    std::vector<char> mine(values.size() * sizeof(double));
+    std::memcpy(mine.data(), values.data(), mine.size());
+    std::vector<std::vector<char>> all;
+    if (!gather(mine, all)) return false;
+    if (rank == 0) {
+        for (int r = 1; r < ranks; ++r) {
+            if (all[r].size() != mine.size()) return false;
+            const double* v = reinterpret_cast<const double*>(all[r].data());
+            for (size_t k = 0; k < values.size(); ++k) values[k] = largest ? std::max(values[k], v[k]) : values[k] + v[k];
+        }
+        std::memcpy(mine.data(), values.data(), mine.size());
+    }
+    if (!broadcast(mine)) return false;
+    std::memcpy(values.data(), mine.data(), mine.size());
+    return true;
+}
+
+bool Domain::sum(std::vector<double>& values) {
+    return reduce(values, false);
+}
+
+bool Domain::max(std::vector<double>& values) {
+    return reduce(values, true);
+}
+
+bool Domain::gather_positions(int count, std::vector<glm::vec3>& out) {
+    std::vector<char> mine(particles.size * (sizeof(unsigned) + 3 * sizeof(float)));
+    char* p = mine.data();
+    for (int i = 0; i < particles.size; ++i) {
+        float xyz[3] = {particles.x[i], particles.y[i], particles.z[i]};
+        std::memcpy(p, &particles.id[i], sizeof(unsigned));
+        std::memcpy(p + sizeof(unsigned), xyz, sizeof(xyz));
+        p += sizeof(unsigned) + sizeof(xyz);
+    }
+    std::vector<std::vector<char>> all;
+    if (!gather(mine, all)) return false;
+    if (rank != 0) return true;
+    out.assign(count, glm::vec3(NAN));
+    for (const auto& message : all) {
+        for (const char* q = message.data(); q < message.data() + message.size(); q += sizeof(unsigned) + 3 * sizeof(float)) {
+            unsigned id;
+            float xyz[3];
+            std::memcpy(&id, q, sizeof(unsigned));
+            std::memcpy(xyz, q + sizeof(unsigned), sizeof(xyz));
+            if (id < (unsigned)count) out[id] = glm::vec3(xyz[0], xyz[1], xyz[2]);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#ifndef DOMAIN_H
+#define DOMAIN_H
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "Particles.h"
+#include "Transport.h"
+
+// Splits one fluid into slabs along x, a rank each, every rank a process
+// stepping its slab with its own Particles, which never hold the whole
+// fluid. Before each step particles that
+// left a slab move to the rank that owns them now, then every rank copies
+// the particles within halo supports of its borders to the neighbor across
+// as ghosts. With two supports the ghosts nearest the border see all their
+// neighbors, so their densities, and the forces on the owned particles, are
+// those of one process stepping the whole fluid, up to the order of the sums.
+// That holds for the EOS solver only: DFSPH would iterate on its ghosts
+// without hearing back from their owners, drifting off a whole unit within
+// tens of steps, so the slabs are stepped with EOS whatever the solver.
+// Every rebalance_interval steps the ranks compare their counts, and move
+// the borders to even them out once the largest is off the mean by more
+// than rebalance_threshold. Adaptive particles are turned off too: their ids
+// are only unique within a rank.
+class Domain {
+    public:
+        // particles holds this rank's share of the fluid, any share, such as
+        // Particles(n, rank, ranks) makes; every rank has to construct its
+        // Domain together. The borders go at even counts of all the shares,
+        // and each particle moves to the rank of its slab; ok is false when
+        // a peer is gone.
+        Domain(Transport& transport, Particles& particles);
+
+        // Steps every slab by dt, false once a peer is gone.
+        bool step(float dt);
+        // Smallest Particles::stable_dt over the ranks.
+        float stable_dt();
+        // Rank 0 gets the position of every particle by id, the others
+        // nothing; ids must run from 0 to count.
+        bool gather_positions(int count, std::vector<glm::vec3>& out);
+
+        // The collectives every rank has to call together. gather leaves
+        // every rank's message on rank 0, broadcast rank 0's everywhere.
+        bool gather(const std::vector<char>& mine, std::vector<std::vector<char>>& all);
+        bool broadcast(std::vector<char>& data);
+        bool sum(std::vector<double>& values);
+        bool max(std::vector<double>& values);
+
+        Transport& transport;
+        Particles& particles;
+        int rank, ranks;
+        std::vector<float> cuts;            // ranks + 1 slab borders along x, the outer two infinite
+
+        float halo = 2.0f;                  // ghost layer width, in supports
+        int rebalance_interval = 16;        // steps between count checks, 0 disables
+        float rebalance_threshold = 0.1f;
+
+        // of the last step on this rank
+        float step_ms = 0.0f;               // wall time, exchanges included
+        float exchange_ms = 0.0f;           // of which migrating, copying ghosts and agreeing
+        std::uint64_t halo_bytes = 0;       // ghosts and migrants sent
+        int migrated = 0;                   // particles handed to other ranks
+        // as of the last count check
+        float imbalance = 0.0f;             // largest slab over the mean, less one
+        int rebalances = 0;
+        bool ok = true;
+
+    private:
+        bool migrate(bool settle);
+        bool copy_ghosts();
+        bool rebalance();
+        bool agree_cuts();
+        // swaps a message with each neighbor, the even borders first
+        bool swap(std::vector<char>& left, std::vector<char>& right);
+        void place_cuts(const std::vector<double>& histogram, float lo, float hi);
+        bool reduce(std::vector<double>& values, bool largest);
+
+        // keep drops the particles marked leaving, closing the gaps in order;
+        // pack appends particle i to a message, unpack every particle of one
+        void keep();
+        void pack(int i, std::vector<char>& out);
+        void unpack(const std::vector<char>& in);
+
+        std::vector<char> left_out, right_out;
+        std::vector<unsigned char> leaving;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#include "Grid.h"
+
+void Grid::build(const float* x, const float* y, const float* z, int n, float h, ThreadPool& pool) {
+    cell = h;
+
+    // table holds at least two buckets per particle to keep collisions rare
+    unsigned table = 64;
+    while (table < 2u * (unsigned)n) table <<= 1;
+    mask = table - 1;
+
+    start.assign(table + 1, 0);
+    index.resize(n);
+    key.resize(n);
+    bucket.resize(n);
+
+    pool.parallel_for(n, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            bucket[i] = hash(cell_of(glm::vec3(x[i], y[i], z[i]))) & mask;
+        }
+    });
+
+    // counting sort of particle ids by bucket
+    for (int i = 0; i < n; ++i) {
+        ++start[bucket[i] + 1];
+    }
+    for (unsigned b = 0; b < table; ++b) {
+        start[b+1] += start[b];
+    }
+    std::vector<unsigned> fill(start.begin(), start.end() - 1);
+    for (int i = 0; i < n; ++i) {
+        unsigned s = fill[bucket[i]]++;
+        index[s] = i;
+        key[s] = pack(cell_of(glm::vec3(x[i], y[i], z[i])));
+    }
+}
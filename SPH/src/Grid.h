@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef GRID_H
+#define GRID_H
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "ThreadPool.h"
+
+// Uniform grid over an unbounded domain. Cells of edge `cell` are hashed into
+// a power of two table of buckets and particle ids are counting sorted by
+// bucket, so the particles of one cell sit contiguously in `index`. Each slot
+// also keeps the packed cell it came from, which lets queries skip particles
+// of other cells that collided into the same bucket.
+struct Grid {
+    float cell = 0.1f;
+    unsigned mask = 0;
+
+    std::vector<unsigned> start;        // bucket -> first slot, mask + 2 entries
+    std::vector<unsigned> index;        // slot -> particle id
+    std::vector<std::uint64_t> key;     // slot -> packed cell of that particle
+    std::vector<unsigned> bucket;       // particle id -> bucket, scratch for build
+
+    void build(const float* x, const float* y, const float* z, int n, float h, ThreadPool& pool);
+
+    // Calls fn(j) for every particle j in the 27 cells around p.
+    template<typename F>
+    void for_each_candidate(const glm::vec3& p, F&& fn) const {
+        if (index.empty()) return;
+        glm::ivec3 c = cell_of(p);
+        for (int dz = -1; dz <= 1; ++dz)
+        for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx) {
+            glm::ivec3 nc = c + glm::ivec3(dx, dy, dz);
+            std::uint64_t k = pack(nc);
+            unsigned b = hash(nc) & mask;
+            for (unsigned s = start[b]; s < start[b+1]; ++s) {
+                if (key[s] == k) fn(index[s]);
+            }
+        }
+    }
+
+    glm::ivec3 cell_of(const glm::vec3& p) const {
+        return glm::ivec3(glm::floor(p / cell));
+    }
+
+    static std::uint64_t pack(const glm::ivec3& c) {
+        const std::uint64_t bias = 1u << 20, bits = (1u << 21) - 1;
+        return (((std::uint64_t)(c.x + bias) & bits) << 42) |
+               (((std::uint64_t)(c.y + bias) & bits) << 21) |
+                ((std::uint64_t)(c.z + bias) & bits);
+    }
+
+    // murmur3 finalizer over the packed cell, the mask keeps only low bits
+    static unsigned hash(const glm::ivec3& c) {
+        std::uint64_t k = pack(c);
+        k = (k ^ (k >> 33)) * 0xff51afd7ed558ccdull;
+        k = (k ^ (k >> 33)) * 0xc4ceb9fe1a85ec53ull;
+        return (unsigned)(k ^ (k >> 33));
+    }
+};
+
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Hands whole states from one producer thread to one consumer thread without
+// either ever waiting. Of three slots the producer owns one, the consumer
+// another, and the third sits between them holding the newest state, with a
+// bit telling whether the consumer has seen it. publish swaps the
+// producer's slot with the middle one, acquire swaps the consumer's with it
+// when it is fresh; states the consumer was too slow for are overwritten.
+// Slots are reused, so T keeps its allocations from one state to the next.
+template<typename T>
+class TripleBuffer {
+    public:
+        // the producer's slot, to fill before publish
+        T& back() { return slots[writing]; }
+        void publish() {
+            writing = middle.exchange(writing | fresh, std::memory_order_acq_rel) & index;
+        }
+
+        // Takes the newest published state, if it has not already; front
+        // keeps the one taken last until the next.
+        bool acquire() {
+            if (!(middle.load(std::memory_order_relaxed) & fresh)) return false;
+            reading = middle.exchange(reading, std::memory_order_acq_rel) & index;
+            return true;
+        }
+        T& front() { return slots[reading]; }
+        const T& front() const { return slots[reading]; }
+
+    private:
+        static const int index = 3, fresh = 4;
+        std::array<T, 3> slots;
+        int writing = 0, reading = 1;
+        std::atomic<int> middle{2};
+};
+
+// Bounded queue from one producer thread to one consumer thread. Each side
+// only stores its own index, so neither waits on the other; push fails when
+// the queue is full rather than blocking. N is a power of two.
+template<typename T, std::size_t N>
+class SpscQueue {
+    static_assert(N > 1 && (N & (N - 1)) == 0, "N is a power of two");
+
+    public:
+        bool push(const T& item) {
+            std::size_t tail = back.load(std::memory_order_relaxed);
+            if (tail - front.load(std::memory_order_acquire) == N) return false;
+            ring[tail & (N - 1)] = item;
+            back.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& item) {
+            std::size_t head = front.load(std::memory_order_relaxed);
+            if (head == back.load(std::memory_order_acquire)) return false;
+            item = ring[head & (N - 1)];
+            front.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        std::array<T, N> ring;
+        // apart, so the two sides do not share a cache line
+        alignas(64) std::atomic<std::size_t> front{0};
+        alignas(64) std::atomic<std::size_t> back{0};
+};
+
+#endif
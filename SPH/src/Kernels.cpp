@@ -0,0 +1,122 @@
+#include "Kernels.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#define SPH_SIMD
+#endif
+
+#define pi 3.141592653589f
+
+Kernels::Kernels(float h) : h(h), h2(h*h) {
+    float h3 = h*h*h, h6 = h3*h3, h9 = h6*h3;
+    poly6_c = 315.0f / (64.0f * pi * h9);
+    poly6_grad_c = -945.0f / (32.0f * pi * h9);
+    spiky_grad_c = -45.0f / (pi * h6);
+    visc_lap_c = 45.0f / (pi * h6);
+}
+
+#if defined(__AVX512F__)
+// GCC 12 takes the _mm512_undefined_ps() that max and sqrt pass through
+// their unused mask lanes for an uninitialized read once they inline
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#define SPH_AVX512_DIAGNOSTICS
+#endif
+typedef __m512 vfloat;
+static inline vfloat vset(float a) { return _mm512_set1_ps(a); }
+static inline vfloat vload(const float* p) { return _mm512_loadu_ps(p); }
+static inline void vstore(float* p, vfloat a) { _mm512_storeu_ps(p, a); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+static inline vfloat vdiv(vfloat a, vfloat b) { return _mm512_div_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm512_max_ps(a, b); }
+static inline vfloat vsqrt(vfloat a) { return _mm512_sqrt_ps(a); }
+// a where r2 > 0, zero elsewhere
+static inline vfloat vpositive(vfloat r2, vfloat a) {
+    return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(r2, _mm512_setzero_ps(), _CMP_GT_OQ), a);
+}
+#elif defined(__AVX2__)
+typedef __m256 vfloat;
+static inline vfloat vset(float a) { return _mm256_set1_ps(a); }
+static inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+static inline void vstore(float* p, vfloat a) { _mm256_storeu_ps(p, a); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+static inline vfloat vdiv(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+static inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a); }
+static inline vfloat vpositive(vfloat r2, vfloat a) {
+    return _mm256_and_ps(_mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_GT_OQ), a);
+}
+#endif
+
+void Kernels::poly6(const float* r2, float* out, int n) const {
+    int i = 0;
+#ifdef SPH_SIMD
+    vfloat c = vset(poly6_c), hh = vset(h2), zero = vset(0.0f);
+    for (; i + SPH_LANES <= n; i += SPH_LANES) {
+        vfloat q = vmax(vsub(hh, vload(r2 + i)), zero);
+        vstore(out + i, vmul(c, vmul(vmul(q, q), q)));
+    }
+#endif
+    for (; i < n; ++i) out[i] = poly6(r2[i]);
+}
+
+void Kernels::poly6_grad(const float* r2, float* out, int n) const {
+    int i = 0;
+#ifdef SPH_SIMD
+    vfloat c = vset(poly6_grad_c), hh = vset(h2), zero = vset(0.0f);
+    for (; i + SPH_LANES <= n; i += SPH_LANES) {
+        vfloat q = vmax(vsub(hh, vload(r2 + i)), zero);
+        vstore(out + i, vmul(c, vmul(q, q)));
+    }
+#endif
+    for (; i < n; ++i) out[i] = poly6_grad(r2[i]);
+}
+
+void Kernels::poly6_lap(const float* r2, float* out, int n) const {
+    int i = 0;
+#ifdef SPH_SIMD
+    vfloat c = vset(poly6_grad_c), hh = vset(h2), zero = vset(0.0f);
+    vfloat hh3 = vset(3.0f*h2), seven = vset(7.0f);
+    for (; i + SPH_LANES <= n; i += SPH_LANES) {
+        vfloat d = vload(r2 + i);
+        vfloat q = vmax(vsub(hh, d), zero);
+        vstore(out + i, vmul(vmul(c, q), vsub(hh3, vmul(seven, d))));
+    }
+#endif
+    for (; i < n; ++i) out[i] = poly6_lap(r2[i]);
+}
+
+void Kernels::spiky_grad(const float* r2, float* out, int n) const {
+    int i = 0;
+#ifdef SPH_SIMD
+    vfloat c = vset(spiky_grad_c), hv = vset(h), zero = vset(0.0f);
+    for (; i + SPH_LANES <= n; i += SPH_LANES) {
+        vfloat d = vload(r2 + i);
+        vfloat r = vsqrt(d);
+        vfloat q = vmax(vsub(hv, r), zero);
+        vstore(out + i, vpositive(d, vdiv(vmul(c, vmul(q, q)), r)));
+    }
+#endif
+    for (; i < n; ++i) out[i] = spiky_grad(r2[i]);
+}
+
+void Kernels::visc_lap(const float* r2, float* out, int n) const {
+    int i = 0;
+#ifdef SPH_SIMD
+    vfloat c = vset(visc_lap_c), hv = vset(h), zero = vset(0.0f);
+    for (; i + SPH_LANES <= n; i += SPH_LANES) {
+        vfloat q = vmax(vsub(hv, vsqrt(vload(r2 + i))), zero);
+        vstore(out + i, vmul(c, q));
+    }
+#endif
+    for (; i < n; ++i) out[i] = visc_lap(r2[i]);
+}
+
+#ifdef SPH_AVX512_DIAGNOSTICS
+#pragma GCC diagnostic pop
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <algorithm>
+#include <cmath>
+
+// Widest float vector the build targets. Batched kernels take any count but
+// callers that gather neighbors in blocks of SPH_LANES never hit a scalar tail.
+#if defined(__AVX512F__)
+#define SPH_LANES 16
+#elif defined(__AVX2__)
+#define SPH_LANES 8
+#else
+#define SPH_LANES 8
+#endif
+
+// Smoothing kernels of Muller et al. 2003 written against the squared
+// distance r2 = |xi - xj|^2, so poly6 never needs a square root. Constants
+// depend only on the support h and are computed once. The *_grad forms
+// return the factor g with grad W = g * (xi - xj), and the *_lap forms the
+// laplacian. All of them vanish for r2 >= h2.
+struct Kernels {
+    Kernels() : Kernels(0.1f) {}
+    Kernels(float h);
+
+    float h, h2;
+    float poly6_c, poly6_grad_c, spiky_grad_c, visc_lap_c;
+
+    float poly6(float r2) const {
+        float q = std::max(h2 - r2, 0.0f);
+        return poly6_c * (q*q*q);
+    }
+    float poly6_grad(float r2) const {
+        float q = std::max(h2 - r2, 0.0f);
+        return poly6_grad_c * (q*q);
+    }
+    float poly6_lap(float r2) const {
+        float q = std::max(h2 - r2, 0.0f);
+        return poly6_grad_c * q * (3.0f*h2 - 7.0f*r2);
+    }
+    // zero at r = 0, where the direction is undefined
+    float spiky_grad(float r2) const {
+        if (r2 <= 0.0f) return 0.0f;
+        float r = std::sqrt(r2);
+        float q = std::max(h - r, 0.0f);
+        return spiky_grad_c * (q*q) / r;
+    }
+    float visc_lap(float r2) const {
+        return visc_lap_c * std::max(h - std::sqrt(r2), 0.0f);
+    }
+
+    // out[i] = kernel(r2[i]) for i in [0, n), SPH_LANES at a time
+    void poly6(const float* r2, float* out, int n) const;
+    void poly6_grad(const float* r2, float* out, int n) const;
+    void poly6_lap(const float* r2, float* out, int n) const;
+    void spiky_grad(const float* r2, float* out, int n) const;
+    void visc_lap(const float* r2, float* out, int n) const;
+};
+
+#endif
@@ -3,6 +3,8 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <cstdint>
+#include <cstring>
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 
@@ -11,6 +13,18 @@ struct Material {
     Material(glm::vec3 ka) : ka(ka), kd(0.5f), ks(0.5f), s(10.0f), a(1.0f) {};
     glm::vec3 ka,kd,ks;
     float s,a;
+
+    bool operator==(const Material& o) const { return ka == o.ka && kd == o.kd && ks == o.ks && s == o.s && a == o.a; }
 };
 
+// FNV-1a over the material's values, equal materials hash alike
+inline std::uint32_t hash(const Material& m) {
+    float values[11] = {m.ka.x, m.ka.y, m.ka.z, m.kd.x, m.kd.y, m.kd.z, m.ks.x, m.ks.y, m.ks.z, m.s, m.a};
+    unsigned char bytes[sizeof(values)];
+    std::memcpy(bytes, values, sizeof(values));
+    std::uint32_t h = 2166136261u;
+    for (unsigned char b : bytes) h = (h ^ b) * 16777619u;
+    return h;
+}
+
 #endif
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include "Mesh.h"
+#include <algorithm>
+#include <array>
 #include <iostream>
+#include <map>
+#include <set>
 
 #include "GLSL.h"
 
@@ -15,6 +19,7 @@ Mesh::Mesh() :
 }
 
 Mesh::Mesh(std::string meshFile) :
+	asset(meshFile),
 	posBufID(0),
 	norBufID(0),
 	texBufID(0),
@@ -87,6 +92,56 @@ void fitToUnitBox(Mesh& mesh){
 	}
 }
 
+Mesh simplify(const Mesh& mesh, int cells) {
+	Mesh result;
+	if (mesh.posBuf.empty() || cells < 1) return result;
+
+	glm::vec3 vmin = mesh.posBuf[0];
+	glm::vec3 vmax = mesh.posBuf[0];
+	for (const glm::vec3& v : mesh.posBuf) {
+		vmin = glm::min(vmin, v);
+		vmax = glm::max(vmax, v);
+	}
+	glm::vec3 size = glm::max((vmax - vmin) / (float)cells, glm::vec3(1e-12f));
+	auto cell_of = [&](const glm::vec3& v) {
+		glm::ivec3 c = glm::clamp(glm::ivec3((v - vmin) / size), glm::ivec3(0), glm::ivec3(cells - 1));
+		return (c.x * cells + c.y) * cells + c.z;
+	};
+
+	// every cell's mean, then the vertex closest to it stands for the cell
+	std::map<int, std::pair<glm::vec3, int>> sums;
+	for (const glm::vec3& v : mesh.posBuf) {
+		auto& sum = sums[cell_of(v)];
+		sum.first += v;
+		++sum.second;
+	}
+	std::map<int, glm::vec3> rep;
+	for (const glm::vec3& v : mesh.posBuf) {
+		int c = cell_of(v);
+		glm::vec3 mean = sums[c].first / (float)sums[c].second;
+		auto found = rep.find(c);
+		if (found == rep.end() || glm::length(v - mean) < glm::length(found->second - mean)) rep[c] = v;
+	}
+
+	std::set<std::array<int, 3>> seen;
+	for (size_t t = 0; t + 2 < mesh.posBuf.size(); t += 3) {
+		std::array<int, 3> c = {cell_of(mesh.posBuf[t]), cell_of(mesh.posBuf[t + 1]), cell_of(mesh.posBuf[t + 2])};
+		if (c[0] == c[1] || c[1] == c[2] || c[0] == c[2]) continue;
+		// the same corners in any rotation are the same triangle
+		std::array<int, 3> key = c;
+		std::rotate(key.begin(), std::min_element(key.begin(), key.end()), key.end());
+		if (!seen.insert(key).second) continue;
+
+		glm::vec3 a = rep[c[0]], b = rep[c[1]], d = rep[c[2]];
+		glm::vec3 n = glm::cross(b - a, d - a);
+		if (glm::length(n) == 0.0f) continue;
+		n = glm::normalize(n);
+		result.posBuf.insert(result.posBuf.end(), {a, b, d});
+		result.norBuf.insert(result.norBuf.end(), {n, n, n});
+	}
+	return result;
+}
+
 void init(Mesh& mesh)
 {
 	// Send the position array to the GPU
@@ -120,6 +175,25 @@ void init(Mesh& mesh)
 	GLSL::checkError(GET_FILE_LINE);
 }
 
+void update(Mesh& mesh)
+{
+	if (mesh.posBufID == 0) {
+		if (!mesh.posBuf.empty()) init(mesh);
+		return;
+	}
+	auto resend = [](GLenum target, unsigned& id, size_t bytes, const void* data) {
+		if (id == 0) glGenBuffers(1, &id);
+		glBindBuffer(target, id);
+		glBufferData(target, bytes, bytes ? data : nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(target, 0);
+	};
+	resend(GL_ARRAY_BUFFER, mesh.posBufID, mesh.posBuf.size()*sizeof(glm::vec3), mesh.posBuf.data());
+	if (!mesh.norBuf.empty() || mesh.norBufID) resend(GL_ARRAY_BUFFER, mesh.norBufID, mesh.norBuf.size()*sizeof(glm::vec3), mesh.norBuf.data());
+	if (!mesh.indBuf.empty() || mesh.indBufID) resend(GL_ELEMENT_ARRAY_BUFFER, mesh.indBufID, mesh.indBuf.size()*sizeof(unsigned int), mesh.indBuf.data());
+
+	GLSL::checkError(GET_FILE_LINE);
+}
+
 void draw(const Program& prog, const Mesh& mesh) {
 	// Bind position buffer
 	int h_pos = prog.getAttribute("aPos");
@@ -20,6 +20,7 @@ struct Mesh {
     std::vector<glm::vec3> norBuf;
     std::vector<glm::vec2> texBuf;
     std::vector<unsigned int> indBuf;
+    std::string asset;      // file it was loaded from, empty when built in code
     unsigned posBufID;
     unsigned norBufID;
     unsigned texBufID;
@@ -27,9 +28,16 @@ struct Mesh {
 };
 
 void init(Mesh& mesh);
+// Sends changed arrays to the buffers init made, keeping their names.
+void update(Mesh& mesh);
 void draw(const Program& prog, const Mesh& mesh);
 void loadMesh(const std::string &meshName, Mesh& mesh);
 void fitToUnitBox(Mesh& mesh);
+// Coarser copy of a triangle soup by vertex clustering: vertices falling in
+// one of cells^3 cells of the bounds become the one nearest their mean, and
+// triangles left with fewer than three corners, or repeated, are dropped.
+// Normals are per face. The result is not sent to the GPU.
+Mesh simplify(const Mesh& mesh, int cells);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include "ParticleBuffer.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "GLSL.h"
+
+ParticleBuffer::ParticleBuffer() :
+    current(0),
+    capacity(0),
+    instances(0),
+    uploaded_step(-1),
+    persistent(false),
+    culled(false),
+    compact(false),
+    triangles(0),
+    bytes_uploaded(0),
+    upload_ms(0.0f)
+{
+    for (int l = 0; l < CULL_LODS; ++l) levels[l] = 0;
+    for (int i = 0; i < PARTICLE_RING; ++i) {
+        posSSbo[i] = 0;
+        fences[i] = 0;
+        mapped[i] = nullptr;
+    }
+}
+
+// (Re)creates every slot for n particles. Immutable storage cannot grow, so
+// a larger fluid gets fresh buffers.
+static void allocate(ParticleBuffer& buffer, int n) {
+    for (int i = 0; i < PARTICLE_RING; ++i) {
+        if (buffer.fences[i]) glDeleteSync(buffer.fences[i]);
+        buffer.fences[i] = 0;
+    }
+    if (buffer.posSSbo[0]) glDeleteBuffers(PARTICLE_RING, buffer.posSSbo);
+    glGenBuffers(PARTICLE_RING, buffer.posSSbo);
+
+    GLsizeiptr bytes = n * sizeof(glm::vec4);
+    for (int i = 0; i < PARTICLE_RING; ++i) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.posSSbo[i]);
+        if (buffer.persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+            buffer.mapped[i] = (glm::vec4 *) glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+            buffer.mapped[i] = nullptr;
+        }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    buffer.capacity = n;
+    buffer.current = 0;
+    buffer.uploaded_step = -1;
+    GLSL::checkError(GET_FILE_LINE);
+}
+
+ParticleBuffer::ParticleBuffer(const Particles& particles) : ParticleBuffer(particles.size) {}
+
+ParticleBuffer::ParticleBuffer(int particles) : ParticleBuffer() {
+    persistent = GLEW_ARB_buffer_storage;
+    allocate(*this, particles);
+}
+
+// The slot after the one on screen, once the GPU is done reading it.
+static int next_slot(ParticleBuffer& buffer, int n) {
+    if (n > buffer.capacity) allocate(buffer, n);
+
+    int slot = (buffer.current + 1) % PARTICLE_RING;
+    if (buffer.fences[slot]) {
+        while (glClientWaitSync(buffer.fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(buffer.fences[slot]);
+        buffer.fences[slot] = 0;
+    }
+    return slot;
+}
+
+// Orphans the slot and fills it from data.
+static void refill(ParticleBuffer& buffer, int slot, GLsizeiptr bytes, const void* data) {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer.posSSbo[slot]);
+    glBufferData(GL_ARRAY_BUFFER, buffer.capacity * sizeof(glm::vec4), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Whether the current slot already holds this step, seen through this
+// frustum, in this format. Clears the counters of the last upload, finish
+// sets them again if this one goes ahead.
+static bool current(ParticleBuffer& buffer, int step, const Frustum* frustum, bool compact = false) {
+    buffer.bytes_uploaded = 0;
+    buffer.upload_ms = 0.0f;
+    if (step != buffer.uploaded_step || compact != buffer.compact) return false;
+    return frustum ? buffer.culled && buffer.frustum == *frustum : !buffer.culled;
+}
+
+static void finish(ParticleBuffer& buffer, int slot, int n, int step, const Frustum* frustum, std::chrono::steady_clock::time_point start,
+                   const Quantization* quantization = nullptr) {
+    buffer.current = slot;
+    buffer.compact = quantization != nullptr;
+    if (quantization) buffer.quantization = *quantization;
+    buffer.uploaded_step = step;
+    buffer.culled = frustum != nullptr;
+    if (frustum) {
+        buffer.frustum = *frustum;
+        n = buffer.cull_stats.visible;
+        for (int l = 0; l < CULL_LODS; ++l) buffer.levels[l] = buffer.cull_stats.counts[l];
+    } else {
+        buffer.levels[0] = n;
+        for (int l = 1; l < CULL_LODS; ++l) buffer.levels[l] = 0;
+    }
+    buffer.instances = n;
+    buffer.bytes_uploaded = n * (buffer.compact ? sizeof(QuantizedInstance) : sizeof(glm::vec4));
+    buffer.upload_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void upload(ParticleBuffer& buffer, Particles& particles, const Frustum* frustum) {
+    if (current(buffer, particles.steps, frustum) && particles.size <= buffer.capacity) return;
+    auto start = std::chrono::steady_clock::now();
+
+    int slot = next_slot(buffer, particles.size);
+    glm::vec4* out = buffer.mapped[slot];
+    if (!buffer.persistent) {
+        buffer.staging.resize(particles.size);
+        out = buffer.staging.data();
+    }
+    int n = particles.size;
+    if (frustum) {
+        buffer.cull_stats = buffer.culler.cull(particles, *frustum, out);
+        n = buffer.cull_stats.visible;
+    } else {
+        particles.pack(out);
+    }
+    if (!buffer.persistent) refill(buffer, slot, n * sizeof(glm::vec4), out);
+    finish(buffer, slot, particles.size, particles.steps, frustum, start);
+}
+
+void upload(ParticleBuffer& buffer, const glm::vec4* instances, int n, int step, const Frustum* frustum, ThreadPool* pool) {
+    if (current(buffer, step, frustum) && n <= buffer.capacity) return;
+    auto start = std::chrono::steady_clock::now();
+
+    int slot = next_slot(buffer, n);
+    if (frustum) {
+        glm::vec4* out = buffer.mapped[slot];
+        if (!buffer.persistent) {
+            buffer.staging.resize(n);
+            out = buffer.staging.data();
+        }
+        buffer.cull_stats = buffer.culler.cull(instances, n, *frustum, out, pool);
+        if (!buffer.persistent) refill(buffer, slot, buffer.cull_stats.visible * sizeof(glm::vec4), out);
+    } else if (buffer.persistent) {
+        std::copy(instances, instances + n, buffer.mapped[slot]);
+    } else {
+        refill(buffer, slot, n * sizeof(glm::vec4), instances);
+    }
+    finish(buffer, slot, n, step, frustum, start);
+}
+
+void upload(ParticleBuffer& buffer, const QuantizedInstance* instances, int n, int step, const Quantization& quantization,
+            const Frustum* frustum, ThreadPool* pool) {
+    if (current(buffer, step, frustum, true) && n <= buffer.capacity) return;
+    auto start = std::chrono::steady_clock::now();
+
+    // slots are sized for n float instances, compact ones fill the first half
+    int slot = next_slot(buffer, n);
+    QuantizedInstance* mapped = reinterpret_cast<QuantizedInstance*>(buffer.mapped[slot]);
+    if (frustum) {
+        QuantizedInstance* out = mapped;
+        if (!buffer.persistent) {
+            buffer.packed.resize(n);
+            out = buffer.packed.data();
+        }
+        buffer.cull_stats = buffer.culler.cull(instances, n, quantization, *frustum, out, pool);
+        if (!buffer.persistent) refill(buffer, slot, buffer.cull_stats.visible * sizeof(QuantizedInstance), out);
+    } else if (buffer.persistent) {
+        std::copy(instances, instances + n, mapped);
+    } else {
+        refill(buffer, slot, n * sizeof(QuantizedInstance), instances);
+    }
+    finish(buffer, slot, n, step, frustum, start, &quantization);
+}
+
+void upload(ParticleBuffer& buffer, const ParticleCache& cache, int f, const Frustum* frustum) {
+    if (current(buffer, f, frustum) || f < 0 || f >= cache.frames()) return;
+    auto start = std::chrono::steady_clock::now();
+
+    int n = cache.particles();
+    int slot = next_slot(buffer, n);
+    if (frustum) {
+        // raw frames are culled in place, q16 ones once expanded
+        const glm::vec4* frame = static_cast<const glm::vec4*>(cache.block(f));
+        if (cache.header.encoding != CACHE_RAW) {
+            buffer.decoded.resize(n);
+            cache.decode(f, buffer.decoded.data());
+            frame = buffer.decoded.data();
+        }
+        glm::vec4* out = buffer.mapped[slot];
+        if (!buffer.persistent) {
+            buffer.staging.resize(n);
+            out = buffer.staging.data();
+        }
+        buffer.cull_stats = buffer.culler.cull(frame, n, *frustum, out, cache.pool);
+        if (!buffer.persistent) refill(buffer, slot, buffer.cull_stats.visible * sizeof(glm::vec4), out);
+    } else if (buffer.persistent) {
+        cache.decode(f, buffer.mapped[slot]);
+    } else if (cache.header.encoding == CACHE_RAW) {
+        refill(buffer, slot, n * sizeof(glm::vec4), cache.block(f));
+    } else {
+        buffer.staging.resize(n);
+        cache.decode(f, buffer.staging.data());
+        refill(buffer, slot, n * sizeof(glm::vec4), buffer.staging.data());
+    }
+    cache.prefetch(f);
+    finish(buffer, slot, n, f, frustum, start);
+}
+
+int draw(const Program& prog, ParticleBuffer& buffer, const std::vector<Mesh>& spheres){
+    if (spheres.empty()) return 0;
+	int h_pos = prog.getAttribute("aPos");
+	int h_nor = prog.getAttribute("aNor");
+    int positionsID = prog.getAttribute("position");
+    glVertexAttribDivisor(h_pos, 0); 
+    if (h_nor != -1) glVertexAttribDivisor(h_nor, 0); 
+    glVertexAttribDivisor(positionsID, 1);
+
+    // decode uniforms, floats go through as they are
+    GLint offset = prog.getUniform("decode_offset");
+    GLint scale = prog.getUniform("decode_scale");
+    const Quantization& q = buffer.quantization;
+    if (buffer.compact) {
+        glUniform4f(offset, q.lo.x, q.lo.y, q.lo.z, 1.0f);
+        glUniform4f(scale, q.hi.x - q.lo.x, q.hi.y - q.lo.y, q.hi.z - q.lo.z, q.radius);
+    } else {
+        glUniform4f(offset, 0.0f, 0.0f, 0.0f, 0.0f);
+        glUniform4f(scale, 1.0f, 1.0f, 1.0f, 0.0f);
+    }
+
+    int draws = 0;
+    buffer.triangles = 0;
+    for (int l = 0, first = 0, count; l < CULL_LODS; first += count) {
+        // levels sharing a mesh go out together
+        size_t mesh = std::min<size_t>(l, spheres.size() - 1);
+        count = 0;
+        do count += buffer.levels[l++];
+        while (l < CULL_LODS && std::min<size_t>(l, spheres.size() - 1) == mesh);
+        if (count == 0) continue;
+        const Mesh& sphere = spheres[mesh];
+
+        // Bind position buffer
+        glEnableVertexAttribArray(h_pos);
+        glBindBuffer(GL_ARRAY_BUFFER, sphere.posBufID);
+        glVertexAttribPointer(h_pos, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
+
+        // Bind normal buffer
+        if(h_nor != -1 && sphere.norBufID != 0) {
+            glEnableVertexAttribArray(h_nor);
+            glBindBuffer(GL_ARRAY_BUFFER, sphere.norBufID);
+            glVertexAttribPointer(h_nor, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
+        }
+
+        // this level's range of the slot
+        glEnableVertexAttribArray(positionsID);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.posSSbo[buffer.current]);
+        if (buffer.compact) glVertexAttribPointer(positionsID, 4, GL_UNSIGNED_SHORT, GL_TRUE, 0, (void*)(first * sizeof(QuantizedInstance)));
+        else glVertexAttribPointer(positionsID, 4, GL_FLOAT, GL_FALSE, 0, (void*)(first * sizeof(glm::vec4)));
+
+        glDrawArraysInstanced(GL_TRIANGLES, 0, sphere.posBuf.size(), count);
+        buffer.triangles += (long long)count * (sphere.posBuf.size() / 3);
+        ++draws;
+    }
+    if (GLEW_ARB_sync) {
+        if (buffer.fences[buffer.current]) glDeleteSync(buffer.fences[buffer.current]);
+        buffer.fences[buffer.current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    glDisableVertexAttribArray(h_pos);
+    if (h_nor != -1) glDisableVertexAttribArray(h_nor);
+    glDisableVertexAttribArray(positionsID);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return draws;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef PARTICLEBUFFER_H
+#define PARTICLEBUFFER_H
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "Cache.h"
+#include "Cull.h"
+#include "Mesh.h"
+#include "Particles.h"
+#include "Program.h"
+
+// Instance buffers in flight. The frame being drawn, the one queued behind it
+// and the one being written never share storage.
+#define PARTICLE_RING 3
+
+// GL side of a Particles component. Packed positions go to a ring of
+// instance buffers, one slot per rendered frame, each guarded by a fence set
+// after the draw that reads it. With ARB_buffer_storage the slots stay
+// persistently mapped and the solver packs straight into them, otherwise
+// the slot is orphaned and refilled with glBufferSubData. A playback cache
+// fills the slots the same way, from its mapping instead of the solver.
+// Given a frustum, only the visible particles are written, grouped by level
+// of detail, and each level is drawn with its own sphere. A slot holds
+// either floats or QuantizedInstances, half the bytes, as its last upload
+// brought; draw sets the shaders' decode uniforms to match.
+struct ParticleBuffer {
+    ParticleBuffer();
+    ParticleBuffer(const Particles& particles);
+    explicit ParticleBuffer(int particles);
+
+    unsigned posSSbo[PARTICLE_RING];
+    GLsync fences[PARTICLE_RING];
+    glm::vec4 * mapped[PARTICLE_RING];
+    std::vector<glm::vec4> staging;     // only used without persistent mapping
+    std::vector<QuantizedInstance> packed;  // the same, for compact instances
+    int current;                        // slot the next draw reads
+    int capacity;                       // particles each slot holds
+    int instances;                      // particles in the current slot
+    int levels[CULL_LODS];              // of which, per level of detail, in level order
+    int uploaded_step;                  // Particles::steps, or cache frame, of the data in the current slot
+    bool persistent;
+    bool culled;                        // whether the current slot was culled, and against frustum
+    bool compact;                       // whether the current slot holds compact instances
+    Quantization quantization;          // and how they decode
+    Frustum frustum;
+    Culler culler;
+    std::vector<glm::vec4> decoded;     // q16 cache frames before culling
+
+    CullStats cull_stats;               // of the last upload that culled
+    long long triangles;                // submitted by the last draw
+
+    size_t bytes_uploaded;              // by the last upload call, 0 when it found the slot current
+    float upload_ms;                    // and its wall time, fence waits included
+};
+
+// Without a frustum every particle is uploaded, as level 0.
+void upload(ParticleBuffer& buffer, Particles& particles, const Frustum* frustum = nullptr);
+// An instance stream, xyz and radius each, as Particles::pack writes it;
+// step tells one stream from the next, like Particles::steps.
+void upload(ParticleBuffer& buffer, const glm::vec4* instances, int n, int step, const Frustum* frustum = nullptr, ThreadPool* pool = nullptr);
+// A compact stream, QuantizedInstances against quantization.
+void upload(ParticleBuffer& buffer, const QuantizedInstance* instances, int n, int step, const Quantization& quantization,
+            const Frustum* frustum = nullptr, ThreadPool* pool = nullptr);
+// Frame f of the cache; raw frames are read, or without culling and
+// persistent mapping handed to GL, straight from the file mapping.
+void upload(ParticleBuffer& buffer, const ParticleCache& cache, int f, const Frustum* frustum = nullptr);
+// Level k is drawn with spheres[k], or the last sphere when there are fewer,
+// one instanced draw for each run of levels sharing a mesh. Returns the
+// draws issued.
+int draw(const Program& prog, ParticleBuffer& buffer, const std::vector<Mesh>& spheres);
+
+#endif
@@ -1,113 +1,895 @@
 #include "Particles.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "Profile.h"
+#include "RadixSort.h"
 // a = -(u * del) u + dp + nu * dd + rho * g
 
-Particles::~Particles(){
-    delete[] state;
-    delete[] dstate;
+void Particles::reserve(int n) {
+    n = std::max(n, size);
+    // 4 bytes a particle rounded up to whole cache lines, vec4 arrays take 4
+    size_t stride = ((size_t)n * 4 + 63) & ~(size_t)63;
+    std::unique_ptr<unsigned char[], Release> fresh(static_cast<unsigned char*>(::operator new[](27 * stride, std::align_val_t(64))));
+    unsigned char* next = fresh.get();
+    // every array moves to its slice of the new storage with its first size entries
+    auto take = [&](auto*& a, size_t strides) {
+        using T = std::remove_reference_t<decltype(*a)>;
+        T* p = reinterpret_cast<T*>(next);
+        if (storage) std::copy(a, a + size, p);
+        a = p;
+        next += strides * stride;
+    };
+    for (float** a : {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &pressure, &density}) take(*a, 1);
+    take(viscosity, 4);
+    take(tension, 4);
+    take(id, 1);
+    take(alpha, 1);
+    take(kappa, 1);
+    for (float** a : {&h, &mass, &color}) take(*a, 1);
+    take(quiet, 1);
+    take(calm_density, 1);
+    storage = std::move(fresh);
+    capacity = n;
 }
 
+void Particles::init(int part, int parts) {
+    // particles start at rest spacing in a cube centered on the origin; a
+    // share keeps the columns of x it covers
+    int n = size;
+    int l = (int) std::ceil(std::cbrt((float) n));
+    auto kept = [&](int j) { return (long long)(j % l) * parts / l == part; };
+    if (parts > 1) {
+        size = 0;
+        for (int j = 0; j < n; ++j) size += kept(j);
+    }
 
-void Particles::init() {
-    float scale = 0.3f;
-    state = new glm::vec4[size*2];
-    dstate = new glm::vec4[size*2];
+    reserve(size);
+    kernels = Kernels(r);
+    h_max = r;
+    next_id = n;
+    population[0] = size;
 
-    int l = (int) std::sqrt(size);
-    float wall = 5.0f;
-    float x_inc = wall / (float)l;
-    float y_inc = wall / (float)l;
+    radius = std::cbrt(mpp / rho);
+    float offset = 0.5f * radius * (float)(l - 1);
 
-    for (int i = 0; i < size*2; ++i) {
-        state[i] = glm::vec4(0.1f);
-        dstate[i] = glm::vec4(0.0f);
+    for (int i = 0, j = 0; i < size; ++i, ++j) {
+        while (parts > 1 && !kept(j)) ++j;
+        x[i] = (float)(j % l) * radius - offset;
+        y[i] = (float)((j / l) % l) * radius - offset;
+        z[i] = (float)(j / (l*l)) * radius - offset;
+        vx[i] = vy[i] = vz[i] = 0.0f;
+        ax[i] = ay[i] = az[i] = 0.0f;
+        pressure[i] = 0.0f;
+        density[i] = rho;
+        viscosity[i] = tension[i] = glm::vec4(0.0f);
+        id[i] = j;
+        alpha[i] = kappa[i] = 0.0f;
+        h[i] = r;
+        mass[i] = mpp;
+        color[i] = 0.0f;
+        quiet[i] = 0;
+        calm_density[i] = rho;
+    }
+}
+
+void Particles::update(float dt){
+    if (kernels.h != r) {
+        // coarse particles keep their support relative to r
+        for (int i = 0; i < size; ++i) h[i] *= r / kernels.h;
+        h_max *= r / kernels.h;
+        kernels = Kernels(r);
     }
+    // adapt reads the neighborhoods of the last step, which reorder invalidates
+    if (adaptive && adapt_interval > 0 && steps % adapt_interval == 0) adapt();
+    if (!sleeping && asleep > 0) {
+        std::fill(quiet, quiet + size, 0u);
+        asleep = 0;
+    }
+    if (reorder_interval > 0 && steps % reorder_interval == 0) reorder();
+    ++steps;
+
+    // DFSPH corrects the velocities from the last step to be divergence free
+    // on the new neighborhoods, then solves for rest density once the
+    // non-pressure forces are applied; its pressure work counts as forces
+    bool dfsph = solver == Solver::DFSPH;
 
-    for (int i = 0; i < l; ++i) {
-        for (int j = 0; j < l; ++j) {
-            int idx = i*l + j;
-            float x = (float) i * x_inc;
-            float y = (float) j * y_inc;
-            state[idx] = glm::vec4(x, 0.0f, y, scale);
-            state[idx+size] = glm::vec4(0.0f);
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        PROFILE_SCOPE(Phase::Neighbors);
+        find_neighbors();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    {
+        PROFILE_SCOPE(Phase::Density);
+        compute_density();
+        if (sleeping) wake(dt);
+        if (dfsph) compute_alpha();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    {
+        PROFILE_SCOPE(Phase::Forces);
+        if (dfsph) {
+            divergence_iterations = solve_divergence(dt);
+            compute_forces();
+            predict(dt);
+            density_iterations = solve_density(dt);
+        } else {
+            compute_forces();
         }
     }
+    auto t3 = std::chrono::steady_clock::now();
+    {
+        PROFILE_SCOPE(Phase::Integrate);
+        if (dfsph) advect(dt);
+        else integrate(dt);
+    }
+    {
+        PROFILE_SCOPE(Phase::Boundary);
+        collide();
+    }
+    if (sleeping) settle(dt);
+    auto t4 = std::chrono::steady_clock::now();
 
-    glGenBuffers( 1, &posSSbo);
-    glBindBuffer( GL_ARRAY_BUFFER, posSSbo );
-    glBufferData( GL_ARRAY_BUFFER, size * sizeof(glm::vec4), &state[0], GL_DYNAMIC_DRAW );
+    neighbors_ms = std::chrono::duration<float, std::milli>(t1 - t0).count();
+    density_ms = std::chrono::duration<float, std::milli>(t2 - t1).count();
+    forces_ms = std::chrono::duration<float, std::milli>(t3 - t2).count();
+    integrate_ms = std::chrono::duration<float, std::milli>(t4 - t3).count();
 }
 
-void Particles::update(float dt){
+// Particles per block of work. Fixed, so results never depend on the thread count.
+#define GRAIN 256
+
+ThreadPool& Particles::workers() {
+    static ThreadPool serial(1);
+    return pool ? *pool : serial;
+}
+
+template<typename T>
+static void permute(ThreadPool& pool, T* data, const std::vector<unsigned>& order) {
+    std::vector<T> sorted(order.size());
+    pool.parallel_for(order.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) sorted[i] = data[order[i]];
+    });
+    std::copy(sorted.begin(), sorted.end(), data);
+}
+
+void Particles::reorder() {
+    auto start = std::chrono::steady_clock::now();
+
+    ThreadPool& pool = workers();
+    // ghosts stay at the end, where their owner put them
+    int owned = size - ghosts;
+    if (owned == 0) return;
+
+    glm::vec3 lo = pool.parallel_reduce(owned, 4096, glm::vec3(x[0], y[0], z[0]),
+        [&](size_t begin, size_t end) {
+            glm::vec3 m(x[begin], y[begin], z[begin]);
+            for (size_t i = begin; i < end; ++i) m = glm::min(m, glm::vec3(x[i], y[i], z[i]));
+            return m;
+        },
+        [](const glm::vec3& a, const glm::vec3& b) { return glm::min(a, b); });
+
+    // z-order of grid cells, so particles sharing a neighborhood share cache lines
+    order_keys.resize(owned);
+    order.resize(owned);
+    pool.parallel_for(owned, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            glm::uvec3 c = glm::min(glm::uvec3((glm::vec3(x[i], y[i], z[i]) - lo) / r), glm::uvec3(0x1fffff));
+            order_keys[i] = morton(c.x, c.y, c.z);
+            order[i] = i;
+        }
+    });
+    radix_sort(order_keys, order, pool);
+
+    for (float* a : {x, y, z, vx, vy, vz, ax, ay, az, pressure, density, h, mass, color, calm_density}) permute(pool, a, order);
+    permute(pool, viscosity, order);
+    permute(pool, tension, order);
+    permute(pool, id, order);
+    permute(pool, quiet, order);
+    neighbors_current = false;
+
+    reorder_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Axis a particle splits along, spread over the sphere by its id so
+// neighbors split in different directions and no lattice forms.
+static glm::vec3 split_axis(unsigned id) {
+    float u = (float)((id * 2654435761u) >> 8) * (1.0f / 16777216.0f);
+    float z = 1.0f - 2.0f * u;
+    float phi = 2.39996323f * (float)(id % 65536u);
+    float s = std::sqrt(std::max(1.0f - z*z, 0.0f));
+    return glm::vec3(s * std::cos(phi), s * std::sin(phi), z);
+}
+
+// Levels come from the neighborhoods of the last step. A particle must be
+// fine at the free surface, within its support of a wall or of the collider,
+// or within focus; one neighborhood further out it may be a level coarser,
+// and so on. Particles more than a level finer than allowed merge with their
+// nearest neighbor of the same level, if that one picked them too; particles
+// coarser than allowed split. The gap of a level between the two keeps the
+// particles at a border from flickering between them.
+void Particles::adapt() {
+    splits = merges = 0;
+    if (neighbor_start.size() != (size_t)size + 1) return;
+    auto start = std::chrono::steady_clock::now();
+    ThreadPool& pool = workers();
+
+    int top = std::min(max_level, PARTICLE_LEVELS - 1);
+    float support[PARTICLE_LEVELS];
+    for (int l = 0; l < PARTICLE_LEVELS; ++l) support[l] = r * std::cbrt((float)(1 << l));
+
+    level.resize(size);
+    coarsest.resize(size);
+    scratch.resize(size);
+    pool.parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            level[i] = (unsigned char)std::ilogb(mass[i] / mpp);
+            glm::vec3 p(x[i], y[i], z[i]), normal;
+            bool fine = color[i] > 0.6f || boundary_start[i+1] > boundary_start[i];
+            if (collider) fine = fine || collider->sample(p, normal) < 2.0f * h[i];
+            if (focus.w > 0.0f) fine = fine || glm::length(p - glm::vec3(focus)) < focus.w;
+            coarsest[i] = fine ? 0 : (unsigned char)(top + 1);
+        }
+    });
+    for (int pass = 0; pass < top + 1; ++pass) {
+        pool.parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                unsigned char c = coarsest[i];
+                for (unsigned n = neighbor_start[i]; n < neighbor_start[i+1]; ++n) c = std::min<unsigned char>(c, coarsest[neighbors[n]] + 1);
+                scratch[i] = c;
+            }
+        });
+        coarsest.swap(scratch);
+    }
+
+    // every candidate picks its nearest candidate of the same level
+    auto mergeable = [&](size_t i) { return (int)level[i] < top && level[i] + 2 <= coarsest[i]; };
+    partner.resize(size);
+    pool.parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            partner[i] = -1;
+            if (!mergeable(i)) continue;
+            float best = INFINITY;
+            for (unsigned n = neighbor_start[i]; n < neighbor_start[i+1]; ++n) {
+                unsigned j = neighbors[n];
+                if (level[j] != level[i] || !mergeable(j)) continue;
+                float dx = x[i] - x[j], dy = y[i] - y[j], dz = z[i] - z[j];
+                float d2 = dx*dx + dy*dy + dz*dz;
+                if (d2 < best || (d2 == best && (int)j < partner[i])) {
+                    best = d2;
+                    partner[i] = (int)j;
+                }
+            }
+        }
+    });
+
+    // the lower of a mutual pair becomes its center of mass, the upper goes;
+    // picks are only read here, so pairs never overlap
+    scratch.assign(size, 1);
+    pool.parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            int j = partner[i];
+            if (j >= 0 && partner[j] == (int)i) {
+                scratch[i] = (int)i < j ? 1 : 0;
+            } else if (level[i] > coarsest[i]) {
+                scratch[i] = 2;
+            }
+        }
+    });
+    pool.parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            int j = partner[i];
+            if (j < 0 || partner[j] != (int)i || (int)i > j) continue;
+            float mi = mass[i], mj = mass[j], m = mi + mj;
+            for (float* a : {x, y, z, vx, vy, vz}) a[i] = (mi * a[i] + mj * a[j]) / m;
+            mass[i] = m;
+            h[i] = support[level[i] + 1];
+            quiet[i] = 0;
+        }
+    });
 
+    order.clear();
     for (int i = 0; i < size; ++i) {
-        dstate[i] = glm::vec4(glm::vec3(state[i + size]), 0.0f);
+        for (int c = 0; c < scratch[i]; ++c) order.push_back(i);
+        splits += scratch[i] == 2;
+        merges += scratch[i] == 0;
     }
-    for (int i = size; i < size*2; ++i) {
-        dstate[i] = glm::vec4(0.0f, -1.0f, 0.0f, 0.0f);
+    if (splits == 0 && merges == 0) {
+        adapt_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return;
+    }
+    // a restored fluid holds only the particles it had, splits may outgrow it
+    if ((int)order.size() > capacity) reserve((int)order.size());
+    for (float* a : {x, y, z, vx, vy, vz, ax, ay, az, pressure, density, h, mass, color, calm_density}) permute(pool, a, order);
+    permute(pool, viscosity, order);
+    permute(pool, tension, order);
+    permute(pool, id, order);
+    permute(pool, quiet, order);
+    size = (int)order.size();
+    neighbors_current = false;
+
+    // both halves of a split move apart along its axis by half their spacing
+    for (int k = 0; k + 1 < size; ++k) {
+        if (order[k] != order[k+1]) continue;
+        int l = std::ilogb(mass[k] / mpp) - 1;
+        glm::vec3 offset = 0.5f * radius * std::cbrt((float)(1 << l)) * split_axis(id[k]);
+        for (int half = 0; half < 2; ++half) {
+            float sign = half ? 1.0f : -1.0f;
+            x[k + half] += sign * offset.x;
+            y[k + half] += sign * offset.y;
+            z[k + half] += sign * offset.z;
+            mass[k + half] *= 0.5f;
+            h[k + half] = support[l];
+            quiet[k + half] = 0;
+        }
+        id[k + 1] = next_id++;
+        ++k;
     }
 
-    for (int i = 0; i < size * 2; ++i) {
-        state[i] += dstate[i] * dt;
+    h_max = r;
+    for (int l = 0; l < PARTICLE_LEVELS; ++l) population[l] = 0;
+    for (int i = 0; i < size; ++i) {
+        h_max = std::max(h_max, h[i]);
+        ++population[std::ilogb(mass[i] / mpp)];
+    }
+    adapt_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Lays per block lists end to end; start comes in holding the count of each
+// particle one slot late and leaves holding offsets into out.
+static void concatenate(ThreadPool& pool, const std::vector<std::vector<unsigned>>& lists,
+                        std::vector<unsigned>& start, std::vector<unsigned>& out) {
+    size_t n = start.size() - 1;
+    for (size_t i = 0; i < n; ++i) start[i+1] += start[i];
+
+    out.resize(start[n]);
+    pool.parallel_for(lists.size(), 1, [&](size_t b, size_t) {
+        std::copy(lists[b].begin(), lists[b].end(), out.begin() + start[b * GRAIN]);
+    });
+}
+
+void Particles::find_neighbors() {
+    ThreadPool& pool = workers();
+    grid.build(x, y, z, size, h_max, pool);
+
+    // every block fills its own list, the blocks are then laid end to end;
+    // wall samples come from their own grid, built once with the boundary.
+    // A pair interacts within the mean of both supports, so lists stay
+    // symmetric; walls always within r
+    float h2 = r * r;
+    size_t blocks = (size + GRAIN - 1) / GRAIN;
+    block_neighbors.resize(blocks);
+    block_boundary.resize(blocks);
+
+    // sleepers with nothing awake in the 27 cells around them keep their
+    // lists, and their density, from the last step: nothing in reach has
+    // moved, nor come in. Awake particles are marked per bucket, which a
+    // collision only makes more cautious
+    bool carry = sleeping && asleep > 0 && neighbors_current;
+    if (carry) {
+        previous_start.swap(neighbor_start);
+        previous_neighbors.swap(neighbors);
+        previous_boundary_start.swap(boundary_start);
+        previous_boundary.swap(boundary_neighbors);
+        stirred.resize(grid.mask + 1);
+        pool.parallel_for(grid.mask + 1, 4096, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; ++b) {
+                unsigned char awake = 0;
+                for (unsigned s = grid.start[b]; s < grid.start[b+1]; ++s) awake |= !resting(grid.index[s]);
+                stirred[b] = awake;
+            }
+        });
+    }
+    still.assign(sleeping ? size : 0, 0);
+
+    neighbor_start.resize(size + 1);
+    neighbor_start[0] = 0;
+    boundary_start.assign(size + 1, 0);
+    pool.parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        std::vector<unsigned>& list = block_neighbors[begin / GRAIN];
+        std::vector<unsigned>& walls = block_boundary[begin / GRAIN];
+        list.clear();
+        walls.clear();
+        for (size_t i = begin; i < end; ++i) {
+            if (carry && resting(i)) {
+                const unsigned* old = previous_neighbors.data() + previous_start[i];
+                unsigned count = previous_start[i+1] - previous_start[i];
+                bool settled = true;
+                glm::ivec3 c = grid.cell_of(glm::vec3(x[i], y[i], z[i]));
+                for (int dz = -1; dz <= 1 && settled; ++dz)
+                for (int dy = -1; dy <= 1 && settled; ++dy)
+                for (int dx = -1; dx <= 1 && settled; ++dx) settled = !stirred[Grid::hash(c + glm::ivec3(dx, dy, dz)) & grid.mask];
+                if (settled) {
+                    still[i] = 1;
+                    list.insert(list.end(), old, old + count);
+                    neighbor_start[i+1] = count;
+                    walls.insert(walls.end(), previous_boundary.begin() + previous_boundary_start[i],
+                                 previous_boundary.begin() + previous_boundary_start[i+1]);
+                    boundary_start[i+1] = previous_boundary_start[i+1] - previous_boundary_start[i];
+                    continue;
+                }
+            }
+            size_t first = list.size();
+            float xi = x[i], yi = y[i], zi = z[i], hi = h[i];
+            grid.for_each_candidate(glm::vec3(xi, yi, zi), [&](unsigned j) {
+                float dx = xi - x[j], dy = yi - y[j], dz = zi - z[j];
+                float hij = 0.5f * (hi + h[j]);
+                if (j != i && dx*dx + dy*dy + dz*dz < hij*hij) list.push_back(j);
+            });
+            neighbor_start[i+1] = list.size() - first;
+
+            if (!boundary) continue;
+            first = walls.size();
+            boundary->grid.for_each_candidate(glm::vec3(xi, yi, zi), [&](unsigned b) {
+                float dx = xi - boundary->x[b], dy = yi - boundary->y[b], dz = zi - boundary->z[b];
+                if (dx*dx + dy*dy + dz*dz < h2) walls.push_back(b);
+            });
+            boundary_start[i+1] = walls.size() - first;
+        }
+    });
+
+    concatenate(pool, block_neighbors, neighbor_start, neighbors);
+    concatenate(pool, block_boundary, boundary_start, boundary_neighbors);
+    neighbors_current = true;
+}
+
+// Neighbors are gathered SPH_LANES at a time into these blocks so every kernel
+// runs as one batch; slots past the last neighbor sit at r2 = h2, where all
+// kernels are zero. A pair of another support h evaluates the kernels of r at
+// r2 * (r/h)^2, then scales them by (r/h)^3, or (r/h)^5 for gradients and
+// laplacians; both are 1 between particles of support r.
+void Particles::compute_density() {
+    float self = kernels.poly6(0.0f);
+
+    workers().parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        alignas(64) float r2[SPH_LANES], w[SPH_LANES], scale[SPH_LANES];
+        for (size_t i = begin; i < end; ++i) {
+            if (!still.empty() && still[i]) continue;
+            float xi = x[i], yi = y[i], zi = z[i], hi = h[i];
+            float si = r / hi;
+            float sum = mass[i] * self * si*si*si;
+            for (unsigned base = neighbor_start[i]; base < neighbor_start[i+1]; base += SPH_LANES) {
+                int m = std::min<unsigned>(SPH_LANES, neighbor_start[i+1] - base);
+                for (int t = 0; t < m; ++t) {
+                    unsigned j = neighbors[base + t];
+                    float dx = xi - x[j], dy = yi - y[j], dz = zi - z[j];
+                    float sj = r / (0.5f * (hi + h[j]));
+                    r2[t] = (dx*dx + dy*dy + dz*dz) * sj*sj;
+                    scale[t] = mass[j] * sj*sj*sj;
+                }
+                std::fill(r2 + m, r2 + SPH_LANES, kernels.h2);
+                kernels.poly6(r2, w, SPH_LANES);
+                for (int t = 0; t < m; ++t) sum += scale[t] * w[t];
+            }
+            density[i] = sum;
+
+            // walls add their psi like neighbors add their mass
+            for (unsigned base = boundary_start[i]; base < boundary_start[i+1]; base += SPH_LANES) {
+                int m = std::min<unsigned>(SPH_LANES, boundary_start[i+1] - base);
+                for (int t = 0; t < m; ++t) {
+                    unsigned b = boundary_neighbors[base + t];
+                    float dx = xi - boundary->x[b], dy = yi - boundary->y[b], dz = zi - boundary->z[b];
+                    r2[t] = dx*dx + dy*dy + dz*dz;
+                }
+                std::fill(r2 + m, r2 + SPH_LANES, kernels.h2);
+                kernels.poly6(r2, w, SPH_LANES);
+                for (int t = 0; t < m; ++t) density[i] += boundary->psi[boundary_neighbors[base + t]] * w[t];
+            }
+
+            // no suction below rest density, it only clumps the free surface;
+            // DFSPH has no state equation, its pressure comes from the solves
+            pressure[i] = solver == Solver::EOS ? k * glm::max(density[i] - rho, 0.0f) : 0.0f;
+        }
+    });
+}
+
+// Calls fn(j, grad) for the count entries j of list, grad being the spiky
+// kernel gradient at p - x_j, evaluated SPH_LANES entries at a time. With
+// supports h, a pair's is the mean of hi and h[j], otherwise r.
+template<typename F>
+static void gradients(const Kernels& kernels, const glm::vec3& p, const unsigned* list, unsigned count,
+                      const float* x, const float* y, const float* z, const float* h, float hi, F&& fn) {
+    alignas(64) float dx[SPH_LANES], dy[SPH_LANES], dz[SPH_LANES], r2[SPH_LANES], g[SPH_LANES], scale[SPH_LANES];
+    for (unsigned base = 0; base < count; base += SPH_LANES) {
+        int m = std::min<unsigned>(SPH_LANES, count - base);
+        for (int t = 0; t < m; ++t) {
+            unsigned j = list[base + t];
+            float s = h ? kernels.h / (0.5f * (hi + h[j])) : 1.0f;
+            dx[t] = p.x - x[j];
+            dy[t] = p.y - y[j];
+            dz[t] = p.z - z[j];
+            r2[t] = (dx[t]*dx[t] + dy[t]*dy[t] + dz[t]*dz[t]) * s*s;
+            scale[t] = s*s*s*s*s;
+        }
+        std::fill(r2 + m, r2 + SPH_LANES, kernels.h2);
+        kernels.spiky_grad(r2, g, SPH_LANES);
+        for (int t = 0; t < m; ++t) fn(list[base + t], scale[t] * g[t] * glm::vec3(dx[t], dy[t], dz[t]));
     }
+}
 
+template<typename F>
+void Particles::for_each_gradient(size_t i, F&& fn) {
+    gradients(kernels, glm::vec3(x[i], y[i], z[i]), neighbors.data() + neighbor_start[i],
+              neighbor_start[i+1] - neighbor_start[i], x, y, z, h, h[i], fn);
+}
 
-    glBindBuffer( GL_ARRAY_BUFFER, posSSbo );
-    glBufferData( GL_ARRAY_BUFFER, size * sizeof(glm::vec4), &state[0], GL_DYNAMIC_DRAW );
+template<typename F>
+void Particles::for_each_boundary_gradient(size_t i, F&& fn) {
+    if (!boundary) return;
+    gradients(kernels, glm::vec3(x[i], y[i], z[i]), boundary_neighbors.data() + boundary_start[i],
+              boundary_start[i+1] - boundary_start[i], boundary->x.data(), boundary->y.data(), boundary->z.data(), nullptr, r, fn);
 }
 
-void Particles::render(const Program& prog, const Mesh& sphere){
-    // Bind position buffer
-	int h_pos = prog.getAttribute("aPos");
-	glEnableVertexAttribArray(h_pos);
-	glBindBuffer(GL_ARRAY_BUFFER, sphere.posBufID);
-	glVertexAttribPointer(h_pos, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
-	
-	// Bind normal buffer
-	int h_nor = prog.getAttribute("aNor");
-	if(h_nor != -1 && sphere.norBufID != 0) {
-		glEnableVertexAttribArray(h_nor);
-		glBindBuffer(GL_ARRAY_BUFFER, sphere.norBufID);
-		glVertexAttribPointer(h_nor, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
-	}
+void Particles::compute_forces() {
+    // color field gradients shorter than this are interior noise, not surface
+    float surface = 0.3f / r;
+    float lap_self = kernels.poly6_lap(0.0f);
+
+    workers().parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        alignas(64) float dx[SPH_LANES], dy[SPH_LANES], dz[SPH_LANES], r2[SPH_LANES];
+        alignas(64) float g_pressure[SPH_LANES], g_color[SPH_LANES], l_color[SPH_LANES], l_visc[SPH_LANES], scale[SPH_LANES];
+        for (size_t i = begin; i < end; ++i) {
+            if (resting(i)) continue;
+            float xi = x[i], yi = y[i], zi = z[i], hi = h[i];
+            float si = r / hi;
+            glm::vec3 vi(vx[i], vy[i], vz[i]);
+            glm::vec3 f_pressure(0.0f), f_visc(0.0f), normal(0.0f);
+            float lap = mass[i] / density[i] * lap_self * si*si*si*si*si;
+
+            for (unsigned base = neighbor_start[i]; base < neighbor_start[i+1]; base += SPH_LANES) {
+                int m = std::min<unsigned>(SPH_LANES, neighbor_start[i+1] - base);
+                for (int t = 0; t < m; ++t) {
+                    unsigned j = neighbors[base + t];
+                    float sj = r / (0.5f * (hi + h[j]));
+                    dx[t] = xi - x[j];
+                    dy[t] = yi - y[j];
+                    dz[t] = zi - z[j];
+                    r2[t] = (dx[t]*dx[t] + dy[t]*dy[t] + dz[t]*dz[t]) * sj*sj;
+                    scale[t] = sj*sj*sj*sj*sj;
+                }
+                std::fill(r2 + m, r2 + SPH_LANES, kernels.h2);
+                kernels.spiky_grad(r2, g_pressure, SPH_LANES);
+                kernels.poly6_grad(r2, g_color, SPH_LANES);
+                kernels.poly6_lap(r2, l_color, SPH_LANES);
+                kernels.visc_lap(r2, l_visc, SPH_LANES);
 
-    int positionsID = prog.getAttribute("position");
-    glEnableVertexAttribArray(positionsID);
-    glBindBuffer(GL_ARRAY_BUFFER, posSSbo);
-    glVertexAttribPointer(positionsID, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+                for (int t = 0; t < m; ++t) {
+                    unsigned j = neighbors[base + t];
+                    float vol = scale[t] * mass[j] / density[j];
+                    glm::vec3 d(dx[t], dy[t], dz[t]);
+                    f_pressure -= vol * 0.5f * (pressure[i] + pressure[j]) * g_pressure[t] * d;
+                    normal += vol * g_color[t] * d;
+                    f_visc += vol * l_visc[t] * (glm::vec3(vx[j], vy[j], vz[j]) - vi);
+                    lap += vol * l_color[t];
+                }
+            }
 
-    glVertexAttribDivisor(h_pos, 0); 
-    glVertexAttribDivisor(h_nor, 0); 
-    glVertexAttribDivisor(positionsID, 1);
-    
-    glDrawArraysInstanced(GL_TRIANGLES, 0, sphere.posBuf.size() / 3, size);
+            // walls mirror the particle's own pressure back at it
+            for_each_boundary_gradient(i, [&](unsigned b, const glm::vec3& grad) {
+                f_pressure -= boundary->psi[b] / density[i] * pressure[i] * grad;
+            });
 
-    glDisableVertexAttribArray(h_pos);
-    glDisableVertexAttribArray(h_nor);
-    glDisableVertexAttribArray(positionsID);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glm::vec3 f_tension(0.0f);
+            float len = glm::length(normal);
+            if (len > surface) f_tension = -sigma * lap * normal / len;
+            color[i] = len * r;
+
+            viscosity[i] = glm::vec4(nu * f_visc, 0.0f);
+            tension[i] = glm::vec4(f_tension / density[i], 0.0f);
+
+            glm::vec3 a = f_pressure / density[i] + gravity + glm::vec3(viscosity[i]) + glm::vec3(tension[i]);
+            ax[i] = a.x;
+            ay[i] = a.y;
+            az[i] = a.z;
+        }
+    });
 }
 
-// check if these are actually derivatives
-float Particles::W_poly6(float dist, float rad) {
-    if(dist >= 0.0f && dist <= rad){
-        double c = 315.0f/(64.0f * 3.14159f * std::pow(rad,9));
-        return c * std::pow(std::pow(rad,2)-std::pow(dist,2),3);
+// alpha_i = rho_i / (|sum m grad W_ij|^2 + sum |m grad W_ij|^2), the factor
+// that turns a density error into the stiffness that removes it
+void Particles::compute_alpha() {
+    workers().parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (resting(i)) continue;
+            glm::vec3 sum(0.0f);
+            float sum2 = 0.0f;
+            for_each_gradient(i, [&](unsigned j, const glm::vec3& grad) {
+                glm::vec3 g = mass[j] * grad;
+                sum += g;
+                sum2 += glm::dot(g, g);
+            });
+            // walls push back but never move, so they only add to the sum
+            for_each_boundary_gradient(i, [&](unsigned b, const glm::vec3& grad) {
+                sum += boundary->psi[b] * grad;
+            });
+            float denom = glm::dot(sum, sum) + sum2;
+            // a particle without neighbors has nothing to push against
+            alpha[i] = denom > 1e-6f ? density[i] / denom : 0.0f;
+        }
+    });
+}
+
+// v_i -= dt sum m (kappa_i / rho_i + kappa_j / rho_j) grad W_ij, walls take
+// psi for m and hold no stiffness of their own
+void Particles::correct_velocity(float dt) {
+    workers().parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (resting(i)) continue;
+            float ki = kappa[i] / density[i];
+            glm::vec3 dv(0.0f);
+            for_each_gradient(i, [&](unsigned j, const glm::vec3& grad) {
+                dv += mass[j] * (ki + kappa[j] / density[j]) * grad;
+            });
+            for_each_boundary_gradient(i, [&](unsigned b, const glm::vec3& grad) {
+                dv += boundary->psi[b] * ki * grad;
+            });
+            vx[i] -= dt * dv.x;
+            vy[i] -= dt * dv.y;
+            vz[i] -= dt * dv.z;
+        }
+    });
+}
+
+// D rho_i / Dt = sum m (v_i - v_j) . grad W_ij, walls at rest
+float Particles::density_rate(size_t i) {
+    glm::vec3 vi(vx[i], vy[i], vz[i]);
+    float rate = 0.0f;
+    for_each_gradient(i, [&](unsigned j, const glm::vec3& grad) {
+        rate += mass[j] * glm::dot(vi - glm::vec3(vx[j], vy[j], vz[j]), grad);
+    });
+    for_each_boundary_gradient(i, [&](unsigned b, const glm::vec3& grad) {
+        rate += boundary->psi[b] * glm::dot(vi, grad);
+    });
+    return rate;
+}
+
+// Both solves are Jacobi iterations: every stiffness is computed from the
+// same velocities before any of them move, so the result does not depend on
+// the thread count. Only compression is corrected, the free surface may expand.
+int Particles::solve_divergence(float dt) {
+    int iterations = 0;
+    for (;;) {
+        float error = workers().parallel_reduce(size, GRAIN, 0.0f,
+            [&](size_t begin, size_t end) {
+                float e = 0.0f;
+                for (size_t i = begin; i < end; ++i) {
+                    kappa[i] = 0.0f;
+                    if (resting(i)) continue;
+                    float rate = glm::max(density_rate(i), 0.0f);
+                    kappa[i] = rate * alpha[i] / dt;
+                    e += rate;
+                }
+                return e;
+            },
+            [](float a, float b) { return a + b; });
+
+        divergence_residual = error / (size * rho);
+        if (divergence_residual <= divergence_error || iterations >= max_iterations) break;
+        correct_velocity(dt);
+        ++iterations;
     }
-    return 0.0f;
+    return iterations;
 }
 
-float Particles::W_spiky(float dist, float rad) {
-    if(dist >= 0.0f && dist <= rad){
-        double c = 15.0f/(3.14159f * std::pow(rad,6));
-        return c * std::pow(rad-dist,3);
+int Particles::solve_density(float dt) {
+    int iterations = 0;
+    for (;;) {
+        float error = workers().parallel_reduce(size, GRAIN, 0.0f,
+            [&](size_t begin, size_t end) {
+                float e = 0.0f;
+                for (size_t i = begin; i < end; ++i) {
+                    kappa[i] = 0.0f;
+                    if (resting(i)) continue;
+                    // density after moving dt with the current velocities
+                    float compression = glm::max(density[i] + dt * density_rate(i) - rho, 0.0f);
+                    kappa[i] = compression * alpha[i] / (dt * dt);
+                    e += compression;
+                }
+                return e;
+            },
+            [](float a, float b) { return a + b; });
+
+        density_residual = error / (size * rho);
+        if (density_residual <= density_error || iterations >= max_iterations) break;
+        correct_velocity(dt);
+        ++iterations;
     }
-    return 0.0f;
+    return iterations;
 }
 
-float Particles::W_visc(float dist, float rad) {
-    if(dist >= 0.0f && dist <= rad){
-        double c = 45.0f/(3.14159f * std::pow(rad,6));
-        return c * (rad - dist);
+// semi-implicit euler, split so DFSPH can correct the velocities in between;
+// advect keeps the largest speed and acceleration for stable_dt
+void Particles::integrate(float dt) {
+    predict(dt);
+    advect(dt);
+}
+
+void Particles::predict(float dt) {
+    workers().parallel_for(size, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (resting(i)) continue;
+            vx[i] += ax[i] * dt;
+            vy[i] += ay[i] * dt;
+            vz[i] += az[i] * dt;
+        }
+    });
+}
+
+void Particles::advect(float dt) {
+    // ghosts move along, but their neighborhoods are cut off at the halo's
+    // edge, so their speeds would give the step a dt of their own
+    size_t owned = size - ghosts;
+    glm::vec2 peak = workers().parallel_reduce(size, 4096, glm::vec2(0.0f),
+        [&](size_t begin, size_t end) {
+            glm::vec2 m(0.0f);
+            for (size_t i = begin; i < end; ++i) {
+                x[i] += vx[i] * dt;
+                y[i] += vy[i] * dt;
+                z[i] += vz[i] * dt;
+            }
+            for (size_t i = begin; i < std::min(end, owned); ++i) {
+                m.x = glm::max(m.x, vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]);
+                m.y = glm::max(m.y, ax[i]*ax[i] + ay[i]*ay[i] + az[i]*az[i]);
+            }
+            return m;
+        },
+        [](const glm::vec2& a, const glm::vec2& b) { return glm::max(a, b); });
+
+    max_speed = std::sqrt(peak.x);
+    max_accel = std::sqrt(peak.y);
+}
+
+// Particles closer to the obstacle than half their spacing, or inside it,
+// move out along its normal and lose the velocity that carried them in.
+void Particles::collide() {
+    if (!collider) return;
+    float margin = 0.5f * radius;
+
+    workers().parallel_for(size, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (resting(i)) continue;
+            glm::vec3 normal;
+            float d = collider->sample(glm::vec3(x[i], y[i], z[i]), normal);
+            if (d >= margin) continue;
+
+            x[i] += (margin - d) * normal.x;
+            y[i] += (margin - d) * normal.y;
+            z[i] += (margin - d) * normal.z;
+            float vn = vx[i] * normal.x + vy[i] * normal.y + vz[i] * normal.z;
+            if (vn < 0.0f) {
+                vx[i] -= vn * normal.x;
+                vy[i] -= vn * normal.y;
+                vz[i] -= vn * normal.z;
+            }
+        }
+    });
+}
+
+// Sleepers wake on their density and their neighbors' velocities as of the
+// last step; only awake particles move, so no sleeper reads another's wake.
+// Motion is compared per step, against the spacing of the finest particles.
+void Particles::wake(float dt) {
+    float fast = 4.0f * sleep_motion * radius / dt;
+    fast *= fast;
+    float drift = 2.0f * sleep_density * rho;
+    workers().parallel_for(size, GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (!resting(i)) continue;
+            bool disturbed = std::abs(density[i] - calm_density[i]) > drift;
+            for (unsigned n = neighbor_start[i]; n < neighbor_start[i+1] && !disturbed; ++n) {
+                unsigned j = neighbors[n];
+                disturbed = vx[j]*vx[j] + vy[j]*vy[j] + vz[j]*vz[j] > fast;
+            }
+            if (disturbed) quiet[i] = 0;
+        }
+    });
+}
+
+// Counts the quiet steps of awake particles; the ones that reach
+// sleep_steps stop where they are.
+void Particles::settle(float dt) {
+    float slow = sleep_motion * radius / dt;
+    slow *= slow;
+    float drift = sleep_density * rho;
+    asleep = workers().parallel_reduce(size, 4096, 0,
+        [&](size_t begin, size_t end) {
+            int count = 0;
+            for (size_t i = begin; i < end; ++i) {
+                if (resting(i)) {
+                    ++count;
+                    continue;
+                }
+                bool calm = vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i] < slow && std::abs(density[i] - calm_density[i]) < drift;
+                quiet[i] = calm ? quiet[i] + 1 : 0;
+                calm_density[i] = density[i];
+                if (!resting(i)) continue;
+                vx[i] = vy[i] = vz[i] = 0.0f;
+                ax[i] = ay[i] = az[i] = 0.0f;
+                ++count;
+            }
+            return count;
+        },
+        [](int a, int b) { return a + b; });
+}
+
+// Largest step the explicit solver can take: nothing, including a pressure
+// wave at the sound speed sqrt(k), may cross more than cfl * h, forces get
+// the usual sqrt(h / a) bound and viscosity its diffusion limit h^2 / nu.
+// DFSPH has no pressure waves and no pressure in a, so only the flow speed,
+// or the speed gained falling through it, is held to cfl times the particle
+// spacing; a step across more of h lets splashes run through the walls.
+float Particles::stable_dt() {
+    if (solver == Solver::DFSPH) {
+        float a = std::max(max_accel, glm::length(gravity));
+        float dt = cfl * radius / std::max(max_speed, std::sqrt(a * radius));
+        if (nu > 0.0f) dt = std::min(dt, 0.125f * r * r / nu);
+        return dt;
     }
-    return 0.0f;
-}
\ No newline at end of file
+    float c = std::max(max_speed, std::sqrt(k));
+    float dt = cfl * r / c;
+    if (max_accel > 0.0f) dt = std::min(dt, 0.25f * std::sqrt(r / max_accel));
+    if (nu > 0.0f) dt = std::min(dt, 0.125f * r * r / nu);
+    return dt;
+}
+
+void Particles::pack(glm::vec4* out) {
+    workers().parallel_for(size, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            out[i] = glm::vec4(x[i], y[i], z[i], radius * h[i] / r);
+        }
+    });
+}
+
+Quantization Particles::quantization(bool density) {
+    Quantization q;
+    q.density = density;
+    q.radius = radius * h_max / r;
+    if (size == 0) return q;
+    using Bounds = std::pair<glm::vec3, glm::vec3>;
+    glm::vec3 first(x[0], y[0], z[0]);
+    Bounds bounds = workers().parallel_reduce(size, 4096, Bounds(first, first),
+        [&](size_t begin, size_t end) {
+            Bounds b(glm::vec3(x[begin], y[begin], z[begin]), glm::vec3(x[begin], y[begin], z[begin]));
+            for (size_t i = begin; i < end; ++i) {
+                glm::vec3 p(x[i], y[i], z[i]);
+                b.first = glm::min(b.first, p);
+                b.second = glm::max(b.second, p);
+            }
+            return b;
+        },
+        [](const Bounds& a, const Bounds& b) { return Bounds(glm::min(a.first, b.first), glm::max(a.second, b.second)); });
+    q.lo = bounds.first;
+    q.hi = bounds.second;
+    return q;
+}
+
+// One pass straight from the arrays, in place of pack and a quantizing pass
+// over its output. Each value rounds to the nearest step.
+void Particles::pack(QuantizedInstance* out, const Quantization& q) {
+    workers().parallel_for(size, 4096, [&](size_t begin, size_t end) {
+        // copies the stores cannot alias, or they are reloaded every
+        // particle and the loop stays scalar
+        const float* px = x, * py = y, * pz = z, * ph = h, * pd = density;
+        const glm::vec3 lo = q.lo, scale = 65535.0f / glm::max(q.hi - q.lo, glm::vec3(1e-30f));
+        const float rs = 255.0f * radius / r / std::max(q.radius, 1e-30f);
+        const float ds = q.density ? 127.0f / (q.density_span * rho) : 0.0f, d0 = rho;
+        // an instance is one little endian word, which stores as a vector
+        // where five narrow fields would not
+        QuantizedInstance* o = out;
+        for (size_t i = begin; i < end; ++i) {
+            std::uint64_t tx = (std::uint32_t)((px[i] - lo.x) * scale.x + 0.5f);
+            std::uint64_t ty = (std::uint32_t)((py[i] - lo.y) * scale.y + 0.5f);
+            std::uint64_t tz = (std::uint32_t)((pz[i] - lo.z) * scale.z + 0.5f);
+            std::uint64_t tr = (std::uint32_t)std::min(ph[i] * rs + 0.5f, 255.0f);
+            std::uint64_t td = (std::uint32_t)std::min(std::max((pd[i] - d0) * ds + 128.5f, 0.0f), 255.0f);
+            std::uint64_t word = tx | ty << 16 | tz << 32 | tr << 48 | td << 56;
+            std::memcpy(&o[i], &word, sizeof(word));
+        }
+    });
+}
@@ -3,41 +3,178 @@
 #ifndef PARTICLES_H
 #define PARTICLES_H
 
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
 #include <glm/glm.hpp>
-#include "Mesh.h"
-#include "Program.h"
+#include "Boundary.h"
+#include "Grid.h"
+#include "Kernels.h"
+#include "Quantize.h"
+#include "SDF.h"
+#include "ThreadPool.h"
+
+// EOS is the explicit step, pressure from a stiffness k and the density.
+// DFSPH (Bender & Koschier 2015) solves pressure implicitly: one iteration
+// keeps the velocity field divergence free, another the predicted density at
+// rest, so the step is bounded by the CFL condition alone instead of k.
+enum class Solver { EOS, DFSPH };
+
+// Resolution levels of adaptive particles. A particle of level l carries
+// 2^l times mpp and a support of r * cbrt(2^l), so its spacing grows with h.
+#define PARTICLE_LEVELS 4
 
 struct Particles {
     Particles(): size(500) { init(); };
     Particles(int n): size(n) { init(); };
-    ~Particles();
+    // Share part of parts of the n particle cube, cut along x between its
+    // columns, with the ids they have in the whole; for Domain ranks, which
+    // then never hold all of it.
+    Particles(int n, int part, int parts): size(n) { init(part, parts); };
 
     int size;
     glm::vec3 gravity = glm::vec3(0.0f, -10.0f, 0.0f);
-    float mpp = 0.1f;
-    float rho = 1.0f;
-    float nu = 0.01f;
-    float r = 0.1f;
-    float sigma = 1.0f;
-    float k = 0.03f;
+    float mpp = 0.000125f;  // mass per particle, rest spacing is cbrt(mpp/rho)
+    float rho = 1.0f;       // rest density
+    float nu = 0.01f;       // kinematic viscosity
+    float r = 0.1f;         // smoothing radius, of the finest particles
+    float sigma = 0.0001f;  // surface tension
+    float k = 3.0f;         // pressure stiffness
+    float cfl = 0.4f;       // fraction of h a particle, or a pressure wave, may cross per step
+
+    Solver solver = Solver::EOS;
+    float density_error = 0.001f;   // DFSPH: mean compression (rho - rho0) / rho0 left after a step
+    float divergence_error = 0.1f;  // DFSPH: mean relative density change per second left after a step
+    int max_iterations = 100;       // DFSPH: cap of each of the two solves
+
+    int reorder_interval = 64;  // steps between z-order sorts of the particle arrays, 0 disables
+    float reorder_ms = 0.0f;    // cost of the last reorder
+    int steps = 0;
+
+    float max_speed = 0.0f, max_accel = 0.0f;  // over the owned particles, as of the last step
+
+    // DFSPH iterations and remaining errors of the last step
+    int density_iterations = 0, divergence_iterations = 0;
+    float density_residual = 0.0f, divergence_residual = 0.0f;
+
+    // Adaptive resolution: every adapt_interval steps particles merge in
+    // pairs, a level up, where the fluid is deep, and split back down, into
+    // two halves either side of where they were, near the free surface, the
+    // walls, the collider or focus. Both keep mass, momentum and the center of
+    // mass. The count then changes, and cache files, which hold a fixed one,
+    // skip the steps it differs on. Bake files, which lay particles out by
+    // id, stop for good at the first: splits hand out ids past the count.
+    // Splits grow the arrays when they run out.
+    bool adaptive = false;
+    int max_level = PARTICLE_LEVELS - 1;
+    int adapt_interval = 8;
+    glm::vec4 focus = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);     // particles within w of xyz stay fine, none when w <= 0
+    int splits = 0, merges = 0;             // by the last adapt
+    int population[PARTICLE_LEVELS] = {};   // particles at each level, as of the last adapt
+    float adapt_ms = 0.0f;
+    float h_max;                            // largest support, the grid cell size
+
+    // Sleeping: particles that move less than sleep_motion of their spacing,
+    // and whose density changes by less than sleep_density of rho, a step for
+    // sleep_steps steps in a row stop. They skip forces, the pressure solves,
+    // integration and collision, while still lending their density and
+    // pressure to their neighbors; sleepers whose neighbors all sleep also
+    // keep their neighbor lists and density. A sleeper wakes when a neighbor
+    // moves four times as far a step, or its density drifts by twice
+    // sleep_density from the one it fell asleep with.
+    bool sleeping = false;
+    float sleep_motion = 0.01f;
+    float sleep_density = 0.002f;
+    int sleep_steps = 16;
+    int asleep = 0;                         // particles asleep after the last step
 
-    glm::vec4 * state;
-    glm::vec4 * dstate; 
+    // The last ghosts particles are copies of ones another Domain rank owns,
+    // there for their density and pressure; reorder leaves them at the end.
+    int ghosts = 0;
 
+    // wall time of each phase of the last step
+    float neighbors_ms = 0.0f, density_ms = 0.0f, forces_ms = 0.0f, integrate_ms = 0.0f;
+
+    float radius;           // rest spacing of the finest particles, their render scale
+
+    // structure of arrays, each one 64 byte aligned, all of them slices of
+    // storage so a Particles moves, e.g. within a registry, by handing it over
+    struct Release { void operator()(unsigned char* p) const { ::operator delete[](p, std::align_val_t(64)); } };
+    std::unique_ptr<unsigned char[], Release> storage;
+    int capacity = 0;           // particles the arrays hold, size of them in use
+    float * x, * y, * z;        // positions
+    float * vx, * vy, * vz;     // velocities
+    float * ax, * ay, * az;     // accelerations of the last step
     float * pressure;
     float * density;
     glm::vec4 * viscosity;
     glm::vec4 * tension;
+    unsigned * id;              // index at init, follows each particle through reorders
+    float * alpha;              // DFSPH scratch, rebuilt every step: stiffness factor
+    float * kappa;              // and stiffness of the current iteration
+    float * h;                  // support, r unless adaptive
+    float * mass;               // mpp unless adaptive
+    float * color;              // color field gradient of the last step times r, near 1 at the free surface
+    unsigned next_id;           // id of the next particle a split makes
+    unsigned * quiet;           // steps in a row below the sleep thresholds
+    float * calm_density;       // density of the last step, or the one a sleeper fell asleep with
 
-    void init();
-    void update(float dt);
-    void render(const Program& prog, const Mesh& sphere);
+    ThreadPool * pool = nullptr;    // workers for every phase of the step, inline when null
+    const Boundary * boundary = nullptr;    // static walls, built with h >= r; none when null
+    const SDF * collider = nullptr;         // static obstacle particles are pushed out of
+
+    Kernels kernels;
+    Grid grid;
+    std::vector<unsigned> neighbor_start;   // particle -> first entry in neighbors, size + 1 entries
+    std::vector<unsigned> neighbors;
+    std::vector<std::vector<unsigned>> block_neighbors;
+    std::vector<unsigned> boundary_start;   // the same for wall samples in range
+    std::vector<unsigned> boundary_neighbors;
+    std::vector<std::vector<unsigned>> block_boundary;
 
-    float W_poly6(float r, float h);
-    float W_spiky(float r, float h);
-    float W_visc(float r, float h);
+    // sleeping: the lists of the last step, and the sleepers they carry over for
+    bool neighbors_current = false;         // lists match the particle order
+    std::vector<unsigned> previous_start, previous_neighbors, previous_boundary_start, previous_boundary;
+    std::vector<unsigned char> still;
+    std::vector<unsigned char> stirred;     // grid bucket -> holds an awake particle
+
+    std::vector<std::uint64_t> order_keys;
+    std::vector<unsigned> order;
+    std::vector<unsigned char> level, coarsest, scratch;   // adapt: level, and the coarsest one allowed
+    std::vector<int> partner;
+
+    void init(int part = 0, int parts = 1);
+    // Reallocates the arrays to hold n particles, at least size, keeping them.
+    void reserve(int n);
+    void update(float dt);
 
-    unsigned int posSSbo;
+    void reorder();
+    void adapt();
+    void find_neighbors();
+    void compute_density();
+    void compute_forces();
+    void integrate(float dt);
+    void compute_alpha();
+    float density_rate(size_t i);
+    void correct_velocity(float dt);
+    int solve_divergence(float dt);
+    int solve_density(float dt);
+    void predict(float dt);
+    void advect(float dt);
+    void collide();
+    void wake(float dt);
+    void settle(float dt);
+    bool resting(size_t i) const { return quiet[i] >= (unsigned)sleep_steps; }
+    template<typename F> void for_each_gradient(size_t i, F&& fn);
+    template<typename F> void for_each_boundary_gradient(size_t i, F&& fn);
+    float stable_dt();
+    void pack(glm::vec4* out);  // xyz + spacing per particle, the renderer's instance stream
+    // The compact instance stream: bounds and largest radius of the
+    // particles, then every particle packed against them.
+    Quantization quantization(bool density);
+    void pack(QuantizedInstance* out, const Quantization& quantization);
+    ThreadPool& workers();
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,87 @@
+#include "Profile.h"
+
+const char* phase_name(Phase phase) {
+    static const char* names[] = {"neighbors", "density", "forces", "integrate", "boundary", "upload", "render"};
+    return names[(int)phase];
+}
+
+#ifdef SPH_PROFILE
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+Profiler& Profiler::get() {
+    static Profiler profiler;
+    return profiler;
+}
+
+void Profiler::add(Phase phase, std::chrono::steady_clock::duration time) {
+    ns[(int)phase].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(), std::memory_order_relaxed);
+    calls[(int)phase].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Profiler::frame() {
+    Frame& f = ring[head];
+    for (int p = 0; p < phases; ++p) {
+        f.ms[p] = (float)(ns[p].exchange(0, std::memory_order_relaxed) * 1e-6);
+        f.calls[p] = calls[p].exchange(0, std::memory_order_relaxed);
+    }
+    head = (head + 1) % PROFILE_FRAMES;
+    filled = std::min(filled + 1, PROFILE_FRAMES);
+}
+
+void Profiler::reset() {
+    for (int p = 0; p < phases; ++p) {
+        ns[p] = 0;
+        calls[p] = 0;
+    }
+    head = filled = 0;
+}
+
+Profiler::Summary Profiler::summary(Phase phase) const {
+    Summary s;
+    if (filled == 0) return s;
+    std::vector<float> ms(filled);
+    for (int f = 0; f < filled; ++f) {
+        ms[f] = ring[f].ms[(int)phase];
+        s.mean += ms[f];
+        s.calls += ring[f].calls[(int)phase];
+    }
+    s.mean /= filled;
+    s.calls /= filled;
+    std::sort(ms.begin(), ms.end());
+    s.min = ms.front();
+    s.max = ms.back();
+    // nearest rank
+    s.p95 = ms[std::max(0, (int)(0.95 * filled + 0.999999) - 1)];
+    return s;
+}
+
+bool Profiler::write_csv(const std::string& path) const {
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) return false;
+    std::fprintf(file, "phase,frames,calls_per_frame,min_ms,mean_ms,p95_ms,max_ms\n");
+    for (int p = 0; p < phases; ++p) {
+        Summary s = summary((Phase)p);
+        std::fprintf(file, "%s,%d,%g,%g,%g,%g,%g\n", phase_name((Phase)p), filled, s.calls, s.min, s.mean, s.p95, s.max);
+    }
+    std::fclose(file);
+    return true;
+}
+
+bool Profiler::write_json(const std::string& path) const {
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) return false;
+    std::fprintf(file, "{\"frames\": %d, \"phases\": {", filled);
+    for (int p = 0; p < phases; ++p) {
+        Summary s = summary((Phase)p);
+        std::fprintf(file, "%s\n  \"%s\": {\"calls_per_frame\": %g, \"min_ms\": %g, \"mean_ms\": %g, \"p95_ms\": %g, \"max_ms\": %g}",
+            p ? "," : "", phase_name((Phase)p), s.calls, s.min, s.mean, s.p95, s.max);
+    }
+    std::fprintf(file, "\n}}\n");
+    std::fclose(file);
+    return true;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Parts of a frame the profiler keeps apart. Render covers all of
+// Simulation::render_scene, upload included.
+enum class Phase { Neighbors, Density, Forces, Integrate, Boundary, Upload, Render, Count };
+
+// Frames the profiler keeps, the oldest overwritten first.
+#define PROFILE_FRAMES 1024
+
+#ifdef SPH_PROFILE
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Wall time and calls per phase, summed over a frame from any thread, then
+// kept in a ring of the last PROFILE_FRAMES frames. Statistics run over the
+// frames in the ring. Built only with SPH_PROFILE, otherwise the macros
+// below expand to nothing and their arguments are never evaluated.
+class Profiler {
+    public:
+        struct Summary {
+            double min = 0.0, mean = 0.0, p95 = 0.0, max = 0.0;     // ms per frame
+            double calls = 0.0;                                     // per frame
+        };
+
+        static Profiler& get();
+
+        void add(Phase phase, std::chrono::steady_clock::duration time);
+        // Closes the frame being summed into the ring and starts the next.
+        void frame();
+        // Forgets every frame, and the one being summed.
+        void reset();
+
+        int frames() const { return filled; }
+        Summary summary(Phase phase) const;
+        bool write_csv(const std::string& path) const;
+        bool write_json(const std::string& path) const;
+
+    private:
+        static const int phases = (int)Phase::Count;
+
+        struct Frame {
+            float ms[phases];
+            int calls[phases];
+        };
+
+        std::atomic<long long> ns[phases] = {};
+        std::atomic<int> calls[phases] = {};
+        std::array<Frame, PROFILE_FRAMES> ring;
+        int head = 0, filled = 0;
+};
+
+// Adds the time from its construction to its destruction to a phase.
+class ProfileScope {
+    public:
+        explicit ProfileScope(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+        ~ProfileScope() { Profiler::get().add(phase, std::chrono::steady_clock::now() - start); }
+
+    private:
+        Phase phase;
+        std::chrono::steady_clock::time_point start;
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_JOIN(profile_scope_, __LINE__)(phase)
+#define PROFILE_FRAME() Profiler::get().frame()
+
+#else
+
+#define PROFILE_SCOPE(phase) ((void)0)
+#define PROFILE_FRAME() ((void)0)
+
+#endif
+
+const char* phase_name(Phase phase);
+
+#endif
@@ -151,6 +151,17 @@ void Program::addUniforms(const vector<string>& names) {
 	}
 }
 
+void Program::bindUniformBlocks(const map<string, GLuint>& bindings) {
+	for (auto& binding : bindings) {
+		GLuint index = glGetUniformBlockIndex(pid, binding.first.c_str());
+		if (index == GL_INVALID_INDEX) {
+			cout << binding.first << " is not a uniform block" << endl;
+			continue;
+		}
+		glUniformBlockBinding(pid, index, binding.second);
+	}
+}
+
 GLint Program::getAttribute(const string &name) const
 {
 	map<string,GLint>::const_iterator attribute = attributes.find(name.c_str());
@@ -30,6 +30,9 @@ class Program {
 
 		void addAttributes(const std::vector<std::string> &names);
 		void addUniforms(const std::vector<std::string> &names);
+		// Points each named uniform block at a binding, where the buffer
+		// bound by UniformBlocks is shared by every program using it.
+		void bindUniformBlocks(const std::map<std::string, GLuint> &bindings);
 		GLint getAttribute(const std::string &name) const;
 		GLint getUniform(const std::string &name) const;
 		
@@ -0,0 +1,35 @@
+#pragma once
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Compact instance, 8 bytes against the 16 of xyz + radius in floats. The
+// position is 16 bits an axis across the fluid's bounds of the frame, the
+// radius 8 bits of the largest one, and the density 8 bits around the rest
+// density. The shaders read it as four normalized shorts: xyz, then radius +
+// 256 * density in w.
+struct QuantizedInstance {
+    std::uint16_t x, y, z;
+    std::uint8_t radius, density;
+};
+static_assert(sizeof(QuantizedInstance) == 8, "instances are read by the shaders as 4 shorts");
+
+// How a frame's instances map to and from their bits. The decode uniforms
+// are offset = (lo, 1) and scale = (hi - lo, largest radius).
+struct Quantization {
+    glm::vec3 lo = glm::vec3(0.0f), hi = glm::vec3(0.0f);
+    float radius = 0.0f;            // largest radius, 255 decodes to it
+    float density_span = 0.1f;      // rest density times 1 -+ span spans the density byte
+    bool density = false;           // false packs the rest density, 128, for every particle
+
+    // Largest distance of a decoded position from the packed one: half a
+    // step on every axis.
+    float position_error() const { return 0.5f * glm::length((hi - lo) / 65535.0f); }
+    // And of a decoded radius, half a step of 255.
+    float radius_error() const { return 0.5f * radius / 255.0f; }
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include "RadixSort.h"
+
+#include <algorithm>
+
+// spreads the low 21 bits of v so that two zero bits follow each of them
+static std::uint64_t spread(std::uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8)  & 0x100f00f00f00f00full;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2)  & 0x1249249249249249ull;
+    return v;
+}
+
+std::uint64_t morton(unsigned x, unsigned y, unsigned z) {
+    return spread(x) | spread(y) << 1 | spread(z) << 2;
+}
+
+void radix_sort(std::vector<std::uint64_t>& keys, std::vector<unsigned>& values, ThreadPool& pool) {
+    size_t n = keys.size();
+    // small inputs are not worth waking the workers for
+    int threads = n < 65536 ? 1 : pool.size();
+    size_t chunk = (n + threads - 1) / threads;
+
+    auto run = [&](auto&& fn) {
+        pool.parallel_for(threads, 1, [&](size_t t, size_t) { fn((int)t); });
+    };
+
+    std::uint64_t used = 0;
+    for (auto k : keys) used |= k;
+
+    std::vector<std::uint64_t> tmp_keys(n);
+    std::vector<unsigned> tmp_values(n);
+    std::vector<size_t> offset(threads * 256);
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        if (((used >> shift) & 0xff) == 0) continue;
+
+        std::fill(offset.begin(), offset.end(), 0);
+        run([&](int t) {
+            size_t lo = std::min(n, t * chunk), hi = std::min(n, lo + chunk);
+            size_t* count = &offset[t * 256];
+            for (size_t i = lo; i < hi; ++i) ++count[(keys[i] >> shift) & 0xff];
+        });
+
+        // digit major, chunk minor scan keeps equal digits in input order
+        size_t sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            for (int t = 0; t < threads; ++t) {
+                size_t c = offset[t * 256 + d];
+                offset[t * 256 + d] = sum;
+                sum += c;
+            }
+        }
+
+        run([&](int t) {
+            size_t lo = std::min(n, t * chunk), hi = std::min(n, lo + chunk);
+            size_t* next = &offset[t * 256];
+            for (size_t i = lo; i < hi; ++i) {
+                size_t s = next[(keys[i] >> shift) & 0xff]++;
+                tmp_keys[s] = keys[i];
+                tmp_values[s] = values[i];
+            }
+        });
+
+        keys.swap(tmp_keys);
+        values.swap(tmp_values);
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <cstdint>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Stable LSD radix sort of (key, value) pairs, 8 bits per pass. Every pass
+// splits the input in contiguous chunks, histograms them on the pool and
+// scatters with per chunk offsets; a stable sort has one answer, so the result
+// does not depend on the number of threads. Passes over digits that are zero
+// in every key are skipped.
+void radix_sort(std::vector<std::uint64_t>& keys, std::vector<unsigned>& values, ThreadPool& pool);
+
+// Interleaves the low 21 bits of x, y and z into a 63 bit z-order key.
+std::uint64_t morton(unsigned x, unsigned y, unsigned z);
+
+#endif
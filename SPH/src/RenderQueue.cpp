@@ -0,0 +1,140 @@
+#include "RenderQueue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+#include "GLSL.h"
+
+// Per instance attributes: name, columns, floats per column, where in Instance.
+struct Stream {
+    const char* name;
+    int columns, size;
+    size_t offset;
+};
+
+void RenderQueue::submit(Program& program, const Mesh& mesh, const Material& material, const glm::mat4& model) {
+    auto found = std::find(programs.begin(), programs.end(), &program);
+    std::uint64_t p = found - programs.begin();
+    if (found == programs.end()) programs.push_back(&program);
+
+    // program, then mesh, then material, equal ones together; meshes copied
+    // from one another share their buffers and so their batch
+    std::uint64_t key = p << 56 | (std::uint64_t)(mesh.posBufID & 0xffffff) << 32 | hash(material);
+    items.push_back({key, &program, &mesh, &material, model});
+}
+
+void RenderQueue::flush(RenderStats& stats) {
+    auto start = std::chrono::steady_clock::now();
+    stats.items += (int)items.size();
+    if (items.empty()) return;
+
+    std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.key < b.key; });
+
+    instances.resize(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        const Item& item = items[i];
+        Instance& instance = instances[i];
+        instance.model = item.model;
+        instance.normal = glm::transpose(glm::inverse(glm::mat3(item.model)));
+        instance.ka = item.material->ka;
+        instance.kd = item.material->kd;
+        instance.ks = item.material->ks;
+        instance.shine = glm::vec2(item.material->s, item.material->a);
+    }
+
+    // the whole frame in one upload; the buffer is orphaned, not waited on
+    if (!buffer) glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    if (instances.size() > capacity) {
+        capacity = instances.size();
+        glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(Instance), instances.data(), GL_STREAM_DRAW);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(Instance), instances.data());
+    }
+
+    static const Stream streams[] = {
+        {"model", 4, 4, offsetof(Instance, model)},
+        {"normalMat", 3, 3, offsetof(Instance, normal)},
+        {"ka", 1, 3, offsetof(Instance, ka)},
+        {"kd", 1, 3, offsetof(Instance, kd)},
+        {"ks", 1, 3, offsetof(Instance, ks)},
+        {"shine", 1, 2, offsetof(Instance, shine)},
+    };
+
+    Program* program = nullptr;
+    int h_pos = -1, h_nor = -1;
+    GLint locations[6];
+    // divisors stick to the locations, later programs expect them at 0
+    auto release = [&]() {
+        for (int s = 0; s < 6; ++s) {
+            if (locations[s] == -1) continue;
+            for (int c = 0; c < streams[s].columns; ++c) {
+                glVertexAttribDivisor(locations[s] + c, 0);
+                glDisableVertexAttribArray(locations[s] + c);
+            }
+        }
+        if (h_nor != -1) glDisableVertexAttribArray(h_nor);
+        glDisableVertexAttribArray(h_pos);
+    };
+    for (size_t begin = 0, end; begin < items.size(); begin = end) {
+        const Item& first = items[begin];
+        for (end = begin + 1; end < items.size() && items[end].program == first.program && items[end].mesh->posBufID == first.mesh->posBufID; ++end) {}
+
+        if (first.program != program) {
+            if (program) release();
+            program = first.program;
+            program->bind();
+            h_pos = program->getAttribute("aPos");
+            h_nor = program->getAttribute("aNor");
+            for (int s = 0; s < 6; ++s) locations[s] = program->getAttribute(streams[s].name);
+            ++stats.state_changes;
+        }
+
+        // the mesh's vertices
+        const Mesh& mesh = *first.mesh;
+        glEnableVertexAttribArray(h_pos);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.posBufID);
+        glVertexAttribPointer(h_pos, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
+        if (h_nor != -1 && mesh.norBufID != 0) {
+            glEnableVertexAttribArray(h_nor);
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.norBufID);
+            glVertexAttribPointer(h_nor, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
+        }
+
+        // and this run's slice of the instance stream
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        size_t base = begin * sizeof(Instance);
+        for (int s = 0; s < 6; ++s) {
+            if (locations[s] == -1) continue;
+            for (int c = 0; c < streams[s].columns; ++c) {
+                GLuint location = locations[s] + c;
+                glEnableVertexAttribArray(location);
+                glVertexAttribPointer(location, streams[s].size, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                    (const void *)(base + streams[s].offset + c * streams[s].size * sizeof(float)));
+                glVertexAttribDivisor(location, 1);
+            }
+        }
+        ++stats.state_changes;
+
+        GLsizei count = (GLsizei)(end - begin);
+        if (mesh.indBuf.empty()) {
+            glDrawArraysInstanced(GL_TRIANGLES, 0, mesh.posBuf.size(), count);
+        } else {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indBufID);
+            glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)mesh.indBuf.size(), GL_UNSIGNED_INT, (void *)0, count);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
+        ++stats.draws;
+        stats.triangles += (long long)count * (mesh.indBuf.empty() ? mesh.posBuf.size() : mesh.indBuf.size()) / 3;
+    }
+
+    release();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    program->unbind();
+    GLSL::checkError(GET_FILE_LINE);
+
+    items.clear();
+    stats.cpu_ms += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
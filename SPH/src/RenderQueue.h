@@ -0,0 +1,74 @@
+#pragma once
+
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include "Material.h"
+#include "Mesh.h"
+#include "Program.h"
+
+// What a frame's draws cost on the CPU side.
+struct RenderStats {
+    int items = 0;              // meshes submitted
+    int draws = 0;              // draw calls issued
+    int state_changes = 0;      // program binds and vertex stream switches
+    int uniform_calls = 0;      // GL calls that set uniforms or bind and fill their buffers
+    size_t uniform_bytes = 0;   // sent to uniforms and uniform buffers
+    int visible = 0;            // fluid particles drawn
+    int culled = 0;             // and left out, outside the frustum
+    long long triangles = 0;    // in every instance drawn
+    size_t upload_bytes = 0;    // of fluid instances sent to the GPU
+    float upload_ms = 0.0f;     // sending them, fence waits included
+    float surface_ms = 0.0f;    // extracting fluid surfaces, when they are drawn
+    size_t surface_bytes = 0;   // held by their extraction
+    float cpu_ms = 0.0f;        // wall time of submission, not of the GPU work
+};
+
+// One frame's mesh draws. Items are sorted by program, mesh and material,
+// and each run sharing a program and a mesh goes out as one instanced draw.
+// Transforms and materials become per instance attributes, streamed for the
+// whole frame through one buffer, so a scene of thousands of props costs a
+// draw per distinct mesh. Programs must declare the attributes model,
+// normalMat, ka, kd, ks and shine and read the camera from the Frame block.
+class RenderQueue {
+    public:
+        RenderQueue() = default;
+        RenderQueue(RenderQueue const&) = delete;
+        void operator=(RenderQueue const&) = delete;
+
+        void submit(Program& program, const Mesh& mesh, const Material& material, const glm::mat4& model);
+        // Draws everything submitted since the last flush and adds its counts
+        // to stats.
+        void flush(RenderStats& stats);
+
+    private:
+        struct Item {
+            std::uint64_t key;
+            Program* program;
+            const Mesh* mesh;
+            const Material* material;
+            glm::mat4 model;
+        };
+
+        // as the attributes read it, 36 floats
+        struct Instance {
+            glm::mat4 model;
+            glm::mat3 normal;
+            glm::vec3 ka, kd, ks;
+            glm::vec2 shine;
+        };
+
+        std::vector<Item> items;
+        std::vector<Instance> instances;
+        std::vector<Program*> programs;     // the key's program bits index this
+        unsigned buffer = 0;
+        size_t capacity = 0;                // instances the buffer holds
+};
+
+#endif
@@ -0,0 +1,295 @@
+#include "SDF.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+// Closest point to p on triangle abc, by the voronoi region p falls in
+// (Ericson, Real-Time Collision Detection 5.1.5).
+static glm::vec3 closest_point(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) return b;
+
+    float vc = d1*d4 - d3*d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) return c;
+
+    float vb = d5*d2 - d1*d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+    float va = d3*d6 - d5*d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+std::uint64_t SDF::fingerprint(const std::vector<glm::vec3>& triangles, int resolution, float padding) {
+    // FNV-1a over the raw bytes
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    auto mix = [&](const void* data, size_t n) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < n; ++i) h = (h ^ bytes[i]) * 0x100000001b3ull;
+    };
+    mix(triangles.data(), triangles.size() * sizeof(glm::vec3));
+    mix(&resolution, sizeof(resolution));
+    mix(&padding, sizeof(padding));
+    return h;
+}
+
+void SDF::bake(const std::vector<glm::vec3>& triangles, ThreadPool& pool) {
+    auto start = std::chrono::steady_clock::now();
+    key = fingerprint(triangles, resolution, padding);
+    cached = false;
+
+    size_t count = triangles.size() / 3;
+    if (count == 0) return;
+
+    glm::vec3 lo = triangles[0], hi = triangles[0];
+    for (const glm::vec3& v : triangles) {
+        lo = glm::min(lo, v);
+        hi = glm::max(hi, v);
+    }
+    float side = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+    lo -= glm::vec3(padding * side);
+    hi += glm::vec3(padding * side);
+
+    int res = std::max(resolution, 2);
+    cell = (1.0f + 2.0f * padding) * side / (res - 1);
+    origin = lo;
+    dims = glm::max(glm::ivec3(glm::ceil((hi - lo) / cell)) + 1, glm::ivec3(2));
+    nodes.assign((size_t)dims.x * dims.y * dims.z, glm::vec4(0.0f));
+
+    auto node = [&](int x, int y, int z) { return ((size_t)z * dims.y + y) * dims.x + x; };
+
+    // triangles listed in every bucket of 4^3 cells their bounds touch
+    float bsize = 4.0f * cell;
+    glm::ivec3 bdims = glm::ivec3((hi - lo) / bsize) + 1;
+    auto bucket_of = [&](const glm::vec3& p) {
+        return glm::clamp(glm::ivec3(glm::floor((p - origin) / bsize)), glm::ivec3(0), bdims - 1);
+    };
+    auto bucket = [&](const glm::ivec3& b) { return ((size_t)b.z * bdims.y + b.y) * bdims.x + b.x; };
+
+    std::vector<unsigned> bstart((size_t)bdims.x * bdims.y * bdims.z + 1, 0), items;
+    for (int pass = 0; pass < 2; ++pass) {
+        std::vector<unsigned> fill(bstart.begin(), bstart.end() - 1);
+        for (size_t t = 0; t < count; ++t) {
+            const glm::vec3* v = &triangles[3 * t];
+            glm::ivec3 b0 = bucket_of(glm::min(v[0], glm::min(v[1], v[2])));
+            glm::ivec3 b1 = bucket_of(glm::max(v[0], glm::max(v[1], v[2])));
+            for (int z = b0.z; z <= b1.z; ++z)
+            for (int y = b0.y; y <= b1.y; ++y)
+            for (int x = b0.x; x <= b1.x; ++x) {
+                size_t b = bucket(glm::ivec3(x, y, z));
+                if (pass == 0) ++bstart[b + 1];
+                else items[fill[b]++] = (unsigned)t;
+            }
+        }
+        if (pass == 0) {
+            for (size_t b = 0; b + 1 < bstart.size(); ++b) bstart[b + 1] += bstart[b];
+            items.resize(bstart.back());
+        }
+    }
+
+    auto distance2 = [&](const glm::vec3& p, unsigned t) {
+        const glm::vec3* v = &triangles[3 * t];
+        glm::vec3 d = p - closest_point(p, v[0], v[1], v[2]);
+        return glm::dot(d, d);
+    };
+
+    // Unsigned distance. After ring r of buckets around the node's own, any
+    // triangle not seen yet is at least r buckets away. The node before in
+    // the row bounds the answer by its distance plus a cell, which lets whole
+    // buckets be skipped by their box alone.
+    pool.parallel_for(nodes.size(), 1024, [&](size_t begin, size_t end) {
+        float previous = std::numeric_limits<float>::max();
+        for (size_t i = begin; i < end; ++i) {
+            glm::ivec3 n((int)(i % dims.x), (int)(i / dims.x % dims.y), (int)(i / ((size_t)dims.x * dims.y)));
+            glm::vec3 p = origin + glm::vec3(n) * cell;
+            glm::ivec3 c = bucket_of(p);
+            float bound = n.x > 0 && i > begin ? previous + cell : std::numeric_limits<float>::max();
+            float best = bound < std::numeric_limits<float>::max() ? bound * bound * 1.0001f : bound;
+            for (int r = 0; ; ++r) {
+                bool inside = false;
+                for (int dz = -r; dz <= r; ++dz)
+                for (int dy = -r; dy <= r; ++dy) {
+                    // only the shell: whole rows on its faces, two ends elsewhere
+                    bool face = dz == -r || dz == r || dy == -r || dy == r;
+                    for (int dx = -r; dx <= r; dx += face ? 1 : 2 * std::max(r, 1)) {
+                        glm::ivec3 b = c + glm::ivec3(dx, dy, dz);
+                        if (glm::any(glm::lessThan(b, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(b, bdims))) continue;
+                        inside = true;
+                        glm::vec3 blo = origin + glm::vec3(b) * bsize;
+                        glm::vec3 gap = glm::max(glm::max(blo - p, p - blo - bsize), glm::vec3(0.0f));
+                        if (glm::dot(gap, gap) >= best) continue;
+                        size_t k = bucket(b);
+                        for (unsigned s = bstart[k]; s < bstart[k + 1]; ++s) best = std::min(best, distance2(p, items[s]));
+                    }
+                }
+                float reach = r * bsize;
+                if (!inside || best <= reach * reach) break;
+            }
+            previous = std::sqrt(best);
+            nodes[i].x = previous;
+        }
+    });
+
+    // Sign by majority over rays along x, y and z: a node is inside when an
+    // odd number of crossings lie below it on a ray.
+    std::vector<unsigned char> votes(nodes.size(), 0);
+    for (int a = 0; a < 3; ++a) {
+        int u = (a + 1) % 3, v = (a + 2) % 3;
+        size_t rows = (size_t)dims[u] * dims[v];
+        pool.parallel_for(rows, 64, [&](size_t begin, size_t end) {
+            std::vector<unsigned> seen;
+            std::vector<float> hits;
+            for (size_t row = begin; row < end; ++row) {
+                glm::ivec3 n(0);
+                n[u] = (int)(row % dims[u]);
+                n[v] = (int)(row / dims[u]);
+                glm::vec3 p = origin + glm::vec3(n) * cell;
+
+                // triangles of the column of buckets the ray runs through
+                seen.clear();
+                glm::ivec3 b = bucket_of(p);
+                for (b[a] = 0; b[a] < bdims[a]; ++b[a]) {
+                    size_t k = bucket(b);
+                    seen.insert(seen.end(), items.begin() + bstart[k], items.begin() + bstart[k + 1]);
+                }
+                std::sort(seen.begin(), seen.end());
+                seen.erase(std::unique(seen.begin(), seen.end()), seen.end());
+
+                hits.clear();
+                for (unsigned t : seen) {
+                    const glm::vec3* q = &triangles[3 * t];
+                    // barycentric coordinates of the ray in the u, v plane
+                    glm::vec2 p0(q[0][u], q[0][v]), p1(q[1][u], q[1][v]), p2(q[2][u], q[2][v]), r(p[u], p[v]);
+                    float area = (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+                    if (area == 0.0f) continue;
+                    float w1 = ((r.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (r.y - p0.y)) / area;
+                    float w2 = ((p1.x - p0.x) * (r.y - p0.y) - (r.x - p0.x) * (p1.y - p0.y)) / area;
+                    if (w1 < 0.0f || w2 < 0.0f || w1 + w2 > 1.0f) continue;
+                    hits.push_back(q[0][a] + w1 * (q[1][a] - q[0][a]) + w2 * (q[2][a] - q[0][a]));
+                }
+                std::sort(hits.begin(), hits.end());
+                // a ray through a shared edge hits both triangles at once
+                hits.erase(std::unique(hits.begin(), hits.end(), [&](float x, float y) { return y - x < 1e-6f * cell; }), hits.end());
+
+                size_t crossed = 0;
+                for (int s = 0; s < dims[a]; ++s) {
+                    n[a] = s;
+                    float pos = origin[a] + s * cell;
+                    while (crossed < hits.size() && hits[crossed] < pos) ++crossed;
+                    if (crossed & 1) ++votes[node(n.x, n.y, n.z)];
+                }
+            }
+        });
+    }
+
+    pool.parallel_for(nodes.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (votes[i] >= 2) nodes[i].x = -nodes[i].x;
+        }
+    });
+
+    // central differences, one sided on the faces of the grid
+    pool.parallel_for(nodes.size(), 1024, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            glm::ivec3 n((int)(i % dims.x), (int)(i / dims.x % dims.y), (int)(i / ((size_t)dims.x * dims.y)));
+            for (int a = 0; a < 3; ++a) {
+                glm::ivec3 lo = n, hi = n;
+                lo[a] = std::max(n[a] - 1, 0);
+                hi[a] = std::min(n[a] + 1, dims[a] - 1);
+                nodes[i][a + 1] = (nodes[node(hi.x, hi.y, hi.z)].x - nodes[node(lo.x, lo.y, lo.z)].x) / ((hi[a] - lo[a]) * cell);
+            }
+        }
+    });
+
+    bake_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void SDF::bake(const std::vector<glm::vec3>& triangles, const std::string& path, ThreadPool& pool) {
+    auto start = std::chrono::steady_clock::now();
+    if (load(path, fingerprint(triangles, resolution, padding))) {
+        bake_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return;
+    }
+    bake(triangles, pool);
+    save(path);
+}
+
+// File layout: magic, key, dims, origin, cell, then the nodes as stored.
+static const char sdf_magic[4] = {'S', 'D', 'F', '1'};
+
+bool SDF::save(const std::string& path) const {
+    FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) return false;
+    bool ok = std::fwrite(sdf_magic, 4, 1, f) == 1
+        && std::fwrite(&key, sizeof(key), 1, f) == 1
+        && std::fwrite(&dims, sizeof(dims), 1, f) == 1
+        && std::fwrite(&origin, sizeof(origin), 1, f) == 1
+        && std::fwrite(&cell, sizeof(cell), 1, f) == 1
+        && std::fwrite(nodes.data(), sizeof(glm::vec4), nodes.size(), f) == nodes.size();
+    return std::fclose(f) == 0 && ok;
+}
+
+bool SDF::load(const std::string& path, std::uint64_t expected) {
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) return false;
+
+    char magic[4];
+    std::uint64_t stored;
+    glm::ivec3 d;
+    bool ok = std::fread(magic, 4, 1, f) == 1 && !std::memcmp(magic, sdf_magic, 4)
+        && std::fread(&stored, sizeof(stored), 1, f) == 1 && stored == expected
+        && std::fread(&d, sizeof(d), 1, f) == 1 && glm::all(glm::greaterThanEqual(d, glm::ivec3(2)));
+    if (ok) {
+        std::vector<glm::vec4> data((size_t)d.x * d.y * d.z);
+        ok = std::fread(&origin, sizeof(origin), 1, f) == 1
+            && std::fread(&cell, sizeof(cell), 1, f) == 1
+            && std::fread(data.data(), sizeof(glm::vec4), data.size(), f) == data.size();
+        if (ok) {
+            nodes.swap(data);
+            dims = d;
+            key = stored;
+            cached = true;
+        }
+    }
+    std::fclose(f);
+    return ok;
+}
+
+float SDF::sample(const glm::vec3& p, glm::vec3& normal) const {
+    glm::vec3 g = (p - origin) / cell;
+    if (nodes.empty() || glm::any(glm::lessThan(g, glm::vec3(0.0f))) || glm::any(glm::greaterThan(g, glm::vec3(dims - 1)))) {
+        normal = glm::vec3(0.0f);
+        return std::numeric_limits<float>::max();
+    }
+
+    glm::ivec3 i = glm::min(glm::ivec3(g), dims - 2);
+    glm::vec3 f = g - glm::vec3(i);
+    size_t base = ((size_t)i.z * dims.y + i.y) * dims.x + i.x;
+    size_t sy = dims.x, sz = (size_t)dims.x * dims.y;
+
+    glm::vec4 x00 = glm::mix(nodes[base],           nodes[base + 1],           f.x);
+    glm::vec4 x10 = glm::mix(nodes[base + sy],      nodes[base + sy + 1],      f.x);
+    glm::vec4 x01 = glm::mix(nodes[base + sz],      nodes[base + sz + 1],      f.x);
+    glm::vec4 x11 = glm::mix(nodes[base + sy + sz], nodes[base + sy + sz + 1], f.x);
+    glm::vec4 s = glm::mix(glm::mix(x00, x10, f.y), glm::mix(x01, x11, f.y), f.z);
+
+    glm::vec3 grad(s.y, s.z, s.w);
+    float len = glm::length(grad);
+    normal = len > 0.0f ? grad / len : glm::vec3(0.0f);
+    return s.x;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#ifndef SDF_H
+#define SDF_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "ThreadPool.h"
+
+// Signed distance to a static triangle soup, negative inside, baked on a
+// regular grid of nodes with its gradient next to it. Collision then costs
+// one trilinear lookup of 8 nodes per particle, whatever the triangle count.
+// Distances are exact: triangles are bucketed in a coarse grid and each node
+// searches rings of buckets outward until no closer triangle can remain.
+// Signs come from the parity of crossings along rays in x, y and z, by
+// majority, which tolerates the small holes scanned meshes tend to have.
+struct SDF {
+    int resolution = 64;        // nodes along the longest side of the bounds
+    float padding = 0.1f;       // margin around the triangles, as a fraction of that side
+
+    glm::vec3 origin = glm::vec3(0.0f);
+    glm::ivec3 dims = glm::ivec3(0);
+    float cell = 0.0f;
+    std::vector<glm::vec4> nodes;   // distance, then the gradient
+
+    std::uint64_t key = 0;      // fingerprint of the triangles and settings baked
+    float bake_ms = 0.0f;
+    bool cached = false;        // nodes came from the cache file, not a bake
+
+    size_t bytes() const { return nodes.size() * sizeof(glm::vec4); }
+
+    void bake(const std::vector<glm::vec3>& triangles, ThreadPool& pool);
+
+    // Loads path if it holds a bake of the same triangles and settings,
+    // otherwise bakes and writes it there. A path that cannot be written
+    // only costs the next run another bake.
+    void bake(const std::vector<glm::vec3>& triangles, const std::string& path, ThreadPool& pool);
+    bool load(const std::string& path, std::uint64_t key);
+    bool save(const std::string& path) const;
+
+    // Trilinear distance at p, with the unit outward normal in normal. Points
+    // outside the grid are reported as far away.
+    float sample(const glm::vec3& p, glm::vec3& normal) const;
+
+    static std::uint64_t fingerprint(const std::vector<glm::vec3>& triangles, int resolution, float padding);
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include "Scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+static bool overlap(const std::vector<entt::id_type>& a, const std::vector<entt::id_type>& b) {
+    for (entt::id_type t : a) {
+        if (std::find(b.begin(), b.end(), t) != b.end()) return true;
+    }
+    return false;
+}
+
+static bool conflict(const Scheduler::System& a, const Scheduler::System& b) {
+    return overlap(a.write, b.write) || overlap(a.write, b.read) || overlap(a.read, b.write);
+}
+
+void Scheduler::build() {
+    // each system goes one stage after the last system before it that it
+    // conflicts with
+    std::vector<size_t> stage(systems.size(), 0);
+    for (size_t s = 0; s < systems.size(); ++s) {
+        for (size_t e = 0; e < s; ++e) {
+            if (conflict(systems[s], systems[e])) stage[s] = std::max(stage[s], stage[e] + 1);
+        }
+        if (stage[s] >= stages.size()) stages.resize(stage[s] + 1);
+        stages[stage[s]].push_back(s);
+    }
+}
+
+void Scheduler::run(float dt, ThreadPool& pool) {
+    if (stages.empty()) build();
+
+    auto step = [&](System& system) {
+        auto start = std::chrono::steady_clock::now();
+        system.step(registry, dt);
+        system.ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    for (auto& stage : stages) {
+        pool.parallel_for(stage.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) step(systems[stage[i]]);
+        });
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <entt/entt.hpp>
+
+#include "ThreadPool.h"
+
+// Runs the systems that step a registry. Every system names the component
+// types it reads and writes; systems are packed, in the order they were
+// added, into stages where no system writes what another one touches. A
+// stage runs its systems as blocks of the pool, a stage of one runs on the
+// caller with the whole pool to itself. A system later in the list that
+// depends on an earlier one always lands in a later stage.
+class Scheduler {
+    public:
+        template<typename... T> struct reads {};
+        template<typename... T> struct writes {};
+        using Step = std::function<void(entt::registry&, float)>;
+
+        struct System {
+            std::string name;
+            std::vector<entt::id_type> read, write;
+            Step step;
+            float ms = 0.0f;        // wall time of the last run
+        };
+
+        explicit Scheduler(entt::registry& registry) : registry(registry) {}
+
+        template<typename... R, typename... W>
+        void add(const std::string& name, reads<R...>, writes<W...>, Step step) {
+            // storage is created up front, so views built concurrently by
+            // systems of a stage only ever look it up
+            (registry.storage<R>(), ...);
+            (registry.storage<W>(), ...);
+            systems.push_back({name, {entt::type_hash<R>::value()...}, {entt::type_hash<W>::value()...}, std::move(step)});
+            stages.clear();
+        }
+
+        void run(float dt, ThreadPool& pool);
+
+        std::vector<System> systems;
+        std::vector<std::vector<size_t>> stages;    // indices into systems
+
+    private:
+        void build();
+
+        entt::registry& registry;
+};
+
+#endif
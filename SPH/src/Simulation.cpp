@@ -1,7 +1,11 @@
 #include "Simulation.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <memory>
 #include <iostream>
+#include <thread>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -13,10 +17,48 @@
 #include "MatrixStack.h"
 #include "Camera.h"
 #include "Transform.h"
+#include "Bake.h"
+#include "Boundary.h"
+#include "Cache.h"
+#include "Checkpoint.h"
 #include "Particles.h"
+#include "ParticleBuffer.h"
+#include "Profile.h"
+#include "RenderQueue.h"
+#include "SDF.h"
+#include "Surface.h"
 
 #define pi 3.141592653589f
 
+// What a checkpoint keeps of the scene. Walls, the collider and GL buffers
+// are rebuilt by set_scene, meshes go by the file they were loaded from.
+#define SCENE_COMPONENTS Tag, Transform, Material, Camera, Active, Mesh, Particles
+
+struct SceneOutput : CheckpointOutput {
+	using CheckpointOutput::operator();
+	void operator()(entt::entity entity, const Mesh& mesh) {
+		write(&entity, sizeof(entity));
+		write(mesh.asset);
+	}
+};
+
+struct SceneInput : CheckpointInput {
+	using CheckpointInput::CheckpointInput;
+	using CheckpointInput::operator();
+	void operator()(entt::entity& entity, Mesh& mesh) {
+		read(&entity, sizeof(entity));
+		read(mesh.asset);
+	}
+};
+
+// Copies every T of from onto the entities of into that same accepts.
+template<typename T, typename F>
+static void merge(entt::registry& into, const entt::registry& from, F&& same) {
+	for (auto&& [entity, component] : from.view<const T>().each()) {
+		if (same(entity)) into.emplace_or_replace<T>(entity, component);
+	}
+}
+
 std::ostream& operator<< (std::ostream &out, glm::vec3 const& x) {
 	out<<"<"<<x.x<<", "<<x.y<<", "<<x.z<<">\n";
 	return out;
@@ -26,13 +68,16 @@ std::ostream& operator<< (std::ostream &out, glm::vec4 const& x) {
 	return out;
 }
 
-Simulation::Simulation() {
+Simulation::Simulation() : scheduler(registry) {
 	for (int i = 0; i < 256; ++i) {
 		options[i] = false;
 	}
 }
 
 Simulation::~Simulation() {
+    stop_simulation();
+    finish_bake();
+    finish_checkpoints();
     glfwDestroyWindow(window);
     glfwTerminate();
 }
@@ -43,8 +88,166 @@ Entity Simulation::create_entity(std::string tag){
 	return entity;
 }
 
+void Simulation::set_threads(int threads) {
+	// 0 means one worker per hardware thread
+	pool = std::make_unique<ThreadPool>(threads);
+}
+
+void Simulation::set_bake(const std::string& path, unsigned channels) {
+	bake_path = path;
+	bake_channels = channels;
+}
+
+void Simulation::set_props(int count) {
+	props = count;
+}
+
+void Simulation::set_impostors(bool on) {
+	impostors = on;
+}
+
+void Simulation::set_surface(bool on) {
+	surface = on;
+}
+
+void Simulation::set_adaptive(bool on) {
+	adaptive = on;
+}
+
+void Simulation::set_sleeping(bool on) {
+	sleeping = on;
+}
+
+void Simulation::set_compact(bool on, bool density) {
+	compact = on;
+	density_color = density;
+}
+
+void Simulation::set_checkpoint(const std::string& path, bool restore) {
+	checkpoint_path = path;
+	restore_at_start = restore;
+}
+
+// Only the copy into memory holds up the frame, the writer thread does the rest.
+void Simulation::write_checkpoint() {
+	if (!playback_path.empty()) return;
+	auto start = std::chrono::steady_clock::now();
+	SceneOutput out;
+	checkpoint<SCENE_COMPONENTS>(registry, simulated_time, out);
+	float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	size_t bytes = out.bytes.size();
+	if (!checkpoints) checkpoints = std::make_unique<CheckpointWriter>();
+	checkpoints->write(checkpoint_path, std::move(out.bytes));
+	std::cout << "checkpoint of " << bytes / 1e6 << " MB taken in " << ms << " ms, writing " << checkpoint_path << "\n";
+}
+
+// The scene comes out of set_scene the same on every launch, so the entities
+// of a checkpoint are those already in the registry; a component only goes
+// onto an entity with the same tag, the walls and collider stay those the
+// scene built.
+bool Simulation::restore_checkpoint() {
+	if (!playback_path.empty()) return false;
+	if (checkpoints) checkpoints->wait();
+	auto start = std::chrono::steady_clock::now();
+	SceneInput in(checkpoint_path);
+	entt::registry loaded;
+	if (!restore<SCENE_COMPONENTS>(loaded, in)) {
+		std::cout << "Failed to restore checkpoint " << checkpoint_path << "\n";
+		return false;
+	}
+	float read_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	auto same = [&](entt::entity entity) {
+		return registry.valid(entity) && registry.all_of<Tag>(entity) && loaded.all_of<Tag>(entity)
+			&& registry.get<Tag>(entity).tag == loaded.get<Tag>(entity).tag;
+	};
+	merge<Transform>(registry, loaded, same);
+	merge<Material>(registry, loaded, same);
+	merge<Camera>(registry, loaded, same);
+	auto active = loaded.view<Active>();
+	if (std::any_of(active.begin(), active.end(), same)) {
+		registry.clear<Active>();
+		for (auto entity : active) {
+			if (same(entity)) registry.emplace<Active>(entity);
+		}
+	}
+
+	// copies of a file share one load, and its buffers
+	std::map<std::string, Mesh> meshes;
+	for (auto&& [entity, mesh] : loaded.view<Mesh>().each()) {
+		if (!same(entity) || mesh.asset.empty()) continue;
+		if (registry.all_of<Mesh>(entity) && registry.get<Mesh>(entity).asset == mesh.asset) continue;
+		auto found = meshes.find(mesh.asset);
+		if (found == meshes.end()) found = meshes.emplace(mesh.asset, Mesh(mesh.asset)).first;
+		registry.emplace_or_replace<Mesh>(entity, found->second);
+	}
+
+	int particles = 0;
+	for (auto&& [entity, loaded_particles] : loaded.view<Particles>().each()) {
+		if (!same(entity) || !registry.all_of<Particles>(entity)) continue;
+		Particles& live = registry.get<Particles>(entity);
+		loaded_particles.pool = live.pool;
+		loaded_particles.boundary = live.boundary;
+		loaded_particles.collider = live.collider;
+		if (bake && bake->header.particles != (std::uint32_t)loaded_particles.size) finish_bake();
+		live = std::move(loaded_particles);
+		particles += live.size;
+		if (registry.all_of<ParticleBuffer>(entity)) registry.get<ParticleBuffer>(entity).uploaded_step = -1;
+		if (registry.all_of<Surface>(entity)) registry.get<Surface>(entity).clear();
+		surface_meshes.erase(entity);
+	}
+	simulated_time = in.header.time;
+	total_time = 0.0f;
+
+	std::cout << "restored " << particles << " particles at " << simulated_time << " s from " << checkpoint_path << ", "
+		<< in.bytes_read / 1e6 << " MB read in " << read_ms << " ms (" << in.bytes_read / 1e3 / std::max(read_ms, 1e-3f) << " MB/s)\n";
+	return true;
+}
+
+void Simulation::finish_checkpoints() {
+	if (!checkpoints) return;
+	checkpoints->wait();
+	std::cout << "wrote " << checkpoints->written << " checkpoints, the last " << checkpoints->bytes_written / 1e6 << " MB at "
+		<< checkpoints->megabytes_per_second() << " MB/s, " << checkpoints->stalls << " stalls, " << checkpoints->failed << " failed\n";
+	checkpoints.reset();
+}
+
+void Simulation::set_profile(const std::string& path) {
+#ifdef SPH_PROFILE
+	profile_path = path;
+#else
+	std::cout << "built without SPH_PROFILE, --profile " << path << " ignored\n";
+#endif
+}
+
+void Simulation::write_profile() {
+#ifdef SPH_PROFILE
+	const Profiler& profiler = Profiler::get();
+	if (profiler.write_csv(profile_path + ".csv") && profiler.write_json(profile_path + ".json")) {
+		std::cout << "profile of the last " << profiler.frames() << " frames written to " << profile_path << ".csv/.json\n";
+	} else {
+		std::cout << "Failed to write profile " << profile_path << "\n";
+	}
+#endif
+}
+
+void Simulation::set_playback(const std::string& path) {
+	playback_path = path;
+}
+
+void Simulation::finish_bake() {
+	if (!bake) return;
+	bake->close();
+	std::cout << "baked " << bake->frames << " frames to " << bake_path << ": "
+		<< bake->bytes_per_particle_frame() << " bytes per particle per frame, "
+		<< bake->megabytes_per_second() << " MB/s written, "
+		<< bake->stalls << " stalls\n";
+	bake.reset();
+}
+
 void Simulation::create_window(const char * window_name) {
     // Create a windowed mode window and its OpenGL context.
+	title = window_name;
 	window = glfwCreateWindow(480 , 480 , window_name, NULL, NULL);
 	if(!window) {
 		glfwTerminate();
@@ -57,15 +260,28 @@ void Simulation::create_window(const char * window_name) {
 }
 
 void Simulation::init_programs(){
-	std::vector<std::string> mesh_attributes = {"aPos", "aNor"};
-	std::vector<std::string> mesh_uniforms = {"MV", "iMV", "P", "ka", "kd", "ks", "s", "a", "lightPos"};
-
-	pbr_program = Program("phong_vert.glsl", "phong_frag.glsl", mesh_attributes, mesh_uniforms);
-
-	std::vector<std::string> fluid_attributes = {"aPos", "aNor"};
-	std::vector<std::string> fluid_uniforms = {"MV", "iMV", "P", "ka", "kd", "ks", "s", "a", "lightPos"};
-
-fluid_program = Program("phong_instanced_vert.glsl", "phong_instanced_frag.glsl", fluid_attributes, fluid_uniforms);
+	// transforms and materials come per instance, see RenderQueue
+	std::vector<std::string> mesh_attributes = {"aPos", "aNor", "model", "normalMat", "ka", "kd", "ks", "shine"};
+	// camera, light and materials come from uniform blocks, see UniformBlocks
+	pbr_program = Program("phong_batched_vert.glsl", "phong_batched_frag.glsl", mesh_attributes, {});
+	pbr_program.bindUniformBlocks({{"Frame", FRAME_BLOCK}});
+
+	std::vector<std::string> fluid_attributes = {"aPos", "aNor", "position"};
+
+	// floats or QuantizedInstances, told apart by the decode uniforms
+	std::vector<std::string> decode_uniforms = {"decode_offset", "decode_scale"};
+	fluid_program = Program("phong_instanced_vert.glsl", "phong_instanced_frag.glsl", fluid_attributes, decode_uniforms);
+	fluid_program.bindUniformBlocks({{"Frame", FRAME_BLOCK}, {"Material", MATERIAL_BLOCK}});
+
+	// the same instance stream, a quad each, the sphere is ray cast per fragment
+	impostor_program = Program("sphere_impostor_vert.glsl", "sphere_impostor_frag.glsl", {"aPos", "position"}, decode_uniforms);
+	impostor_program.bindUniformBlocks({{"Frame", FRAME_BLOCK}, {"Material", MATERIAL_BLOCK}});
+	impostor_quad.posBuf = {
+		{-1.0f, -1.0f, 0.0f}, {1.0f, -1.0f, 0.0f}, {1.0f, 1.0f, 0.0f},
+		{-1.0f, -1.0f, 0.0f}, {1.0f, 1.0f, 0.0f}, {-1.0f, 1.0f, 0.0f},
+	};
+	init(impostor_quad);
+	sphere_levels[impostor_quad.posBufID] = {impostor_quad};
 }
 
 void Simulation::init_cameras(){
@@ -80,37 +296,389 @@ void Simulation::set_scene() {
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
 
+	if (!pool) set_threads(0);
+	// a pool is not shared between two callers, and the simulation's is busy stepping
+	render_pool = std::make_unique<ThreadPool>(std::max(1, pool->size() / 4));
+	mesh_group.emplace(registry.group<Transform>(entt::get<Mesh, Material>));
+	fluid_group.emplace(registry.group<ParticleBuffer>(entt::get<Mesh, Material>));
+
+	// a bunny on the floor, in the shot whether it is simulated or played back
+	glm::vec3 bunny_at(0.0f, -0.2f, 0.0f);
+	float bunny_scale = 0.2f;
+	auto bunny = create_entity("Bunny");
+	auto& bunny_mesh = bunny.add_component<Mesh>("bunny.obj");
+	bunny.add_component<Material>(glm::vec3(0.6f, 0.5f, 0.4f));
+	bunny.add_component<Transform>(bunny_at, glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(bunny_scale));
+
+	// props around the container; copies of one mesh share its buffers, so
+	// the render queue draws them all at once
+	if (props > 0) {
+		Mesh prop("cube.obj");
+		int side = (int) std::ceil(std::sqrt((float) props));
+		for (int i = 0; i < props; ++i) {
+			float u = (float)(i % side) / glm::max(side - 1, 1), w = (float)(i / side) / glm::max(side - 1, 1);
+			auto entity = create_entity("Prop");
+			entity.add_component<Mesh>(prop);
+			entity.add_component<Material>(glm::vec3(0.2f + 0.6f * u, 0.3f, 0.2f + 0.6f * w));
+			entity.add_component<Transform>(glm::vec3(4.0f * u - 2.0f, -0.4f, 4.0f * w - 2.0f),
+				glm::angleAxis(0.7f * i, glm::vec3(0.0f, 1.0f, 0.0f)), glm::vec3(0.05f));
+		}
+	}
+
+	if (!playback_path.empty()) {
+		// frames come from the mapping, nothing is simulated
+		auto shot = create_entity("Playback");
+		auto& cache = shot.add_component<ParticleCache>();
+		if (!cache.open(playback_path)) {
+			std::cout << "Failed to open particle cache " << playback_path << "\n";
+			exit(-1);
+		}
+		// no simulation thread plays back, so the whole pool culls
+		cache.pool = pool.get();
+		std::cout << "playing " << cache.frames() << " frames of " << cache.particles() << " particles, "
+			<< (cache.header.encoding == CACHE_Q16 ? "q16" : "raw") << ", "
+			<< cache.header.stride * cache.frames() / (1024 * 1024) << " MiB\n";
+		playback_frame = 0;
+		playback_time = cache.frames() ? cache.frame(0).time : 0.0f;
+		shot.add_component<ParticleBuffer>(cache.particles());
+		shot.add_component<Mesh>("sphere.obj");
+		shot.add_component<Material>(glm::vec3(0.1f, 0.3f, 0.85f));
+
+		current_time = glfwGetTime();
+		total_time = 0.0f;
+		return;
+	}
+
+	// a closed box around the fluid, sampled once into wall particles; only
+	// the triangles are needed, so the mesh never goes to the GPU
+	Mesh cube;
+	loadMesh("cube.obj", cube);
+	fitToUnitBox(cube);
+
 	auto fluid = create_entity("Fluid");
-	fluid.add_component<Particles>(100);
+	auto& particles = fluid.add_component<Particles>(100);
+	particles.pool = pool.get();
+	// a stiffness soft enough for the explicit step lets the walls leak
+	particles.solver = Solver::DFSPH;
+	particles.adaptive = adaptive;
+	particles.sleeping = sleeping;
+
+	auto container = create_entity("Container");
+	auto& walls = container.add_component<Boundary>();
+	walls.spacing = particles.radius;
+	walls.sample(cube * glm::vec3(0.6f));
+	walls.build(particles.r, particles.rho, *pool);
+	particles.boundary = &walls;
+
+	// the bunny sits on the floor for the fluid to land on, collided through
+	// a distance field that is baked once and then read from the cache
+	std::vector<glm::vec3> triangles = bunny_mesh * glm::vec3(bunny_scale);
+	for (auto& v : triangles) v += bunny_at;
+	auto& collider = bunny.add_component<SDF>();
+	collider.bake(triangles, std::string(BASE_DIR) + "bunny.sdf", *pool);
+	particles.collider = &collider;
+	std::cout << "bunny sdf " << collider.dims.x << "x" << collider.dims.y << "x" << collider.dims.z
+		<< (collider.cached ? " loaded in " : " baked in ") << collider.bake_ms << " ms, "
+		<< collider.bytes() / 1024 << " KiB\n";
+	fluid.add_component<ParticleBuffer>(particles);
 	fluid.add_component<Mesh>("sphere.obj");
 	fluid.add_component<Material>(glm::vec3(0.1f, 0.3f, 0.85f));
+	fluid.add_component<Surface>();
+
+	if (!bake_path.empty()) {
+		bake = std::make_unique<BakeWriter>(bake_path, particles.size, bake_channels);
+		if (!bake->ok()) {
+			std::cout << "Failed to open bake file " << bake_path << "\n";
+			bake.reset();
+		}
+	}
+
+	// fluid bodies do not interact, so each steps as a block of the pool;
+	// a lone body gets the whole pool for its own passes instead
+	scheduler.add("fluids", Scheduler::reads<Boundary, SDF>{}, Scheduler::writes<Particles>{}, [this](entt::registry& registry, float h) {
+		auto view = registry.view<Particles>();
+		std::vector<entt::entity> fluids(view.begin(), view.end());
+		pool->parallel_for(fluids.size(), 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) view.get<Particles>(fluids[i]).update(h);
+		});
+	});
+	if (bake) {
+		// only copies the arrays, the writer thread encodes and writes
+		scheduler.add("bake", Scheduler::reads<Particles>{}, Scheduler::writes<>{}, [this](entt::registry& registry, float h) {
+			auto view = registry.view<Particles>();
+			bake->write(view.get<Particles>(view.front()), simulated_time, h);
+		});
+	}
+
+	if (restore_at_start) restore_checkpoint();
 
 	// set all time params
 	current_time = glfwGetTime();
 	total_time = 0.0f;
+	start_simulation();
+}
+
+// Only the render thread touches the registry's structure, and only while
+// the simulation thread is stopped; otherwise each writes just the
+// components it owns, whose storage every pool needed exists by now.
+void Simulation::start_simulation() {
+	if (!playback_path.empty() || sim_running) return;
+	sim_paused = options[(unsigned) 'p'];
+	sim_surface = surface;
+	// the first state goes out from here, so there is one to draw at once
+	publish();
+	sim_frames.acquire();
+	sim_running = true;
+	sim_thread = std::thread([this] { simulate(); });
+}
+
+void Simulation::stop_simulation() {
+	if (!sim_running) return;
+	sim_running = false;
+	sim_thread.join();
+}
+
+void Simulation::send(SimEvent::Kind kind, glm::vec4 value) {
+	// a full queue means the thread is stalled, the event is stale by the time it looks
+	sim_events.push(SimEvent{kind, value});
+}
+
+// Steps the fluids in real time, at their own dt, and publishes each state
+// it reaches; sleeps while no step is due.
+void Simulation::simulate() {
+	auto last = std::chrono::steady_clock::now();
+	float debt = 0.0f, wall = 0.0f, simulated = 0.0f;
+	int steps = 0;
+	while (sim_running.load(std::memory_order_acquire)) {
+		bool changed = false;
+		SimEvent event;
+		while (sim_events.pop(event)) {
+			if (event.kind == SimEvent::Focus) {
+				// fluid near the camera keeps its full resolution
+				for (auto&& [entity, particles] : registry.view<Particles>().each()) particles.focus = event.value;
+			} else if (event.kind == SimEvent::Pause) {
+				sim_paused = event.value.x != 0.0f;
+			} else {
+				changed = sim_surface != (event.value.x != 0.0f);
+				sim_surface = event.value.x != 0.0f;
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		float elapsed = std::chrono::duration<float>(now - last).count();
+		last = now;
+		wall += elapsed;
+		if (wall > 0.5f) {
+			sim_hz = steps / wall;
+			realtime_factor = simulated / wall;
+			wall = simulated = 0.0f;
+			steps = 0;
+		}
+
+		float h = stable_dt();
+		int substeps = 0;
+		if (sim_paused) debt = 0.0f;
+		else debt += elapsed;
+		for (; debt >= h && substeps < max_substeps; ++substeps) {
+			update(h);
+			debt -= h;
+			simulated += h;
+			h = stable_dt();
+		}
+		// out of substeps: drop the debt instead of carrying it into the next
+		// wakeup, the fluid runs slow rather than spiraling into ever more steps
+		debt = glm::min(debt, h);
+		steps += substeps;
+
+		if (substeps > 0 || changed) publish();
+		else std::this_thread::sleep_for(std::chrono::duration<float>(sim_paused ? h : h - debt));
+	}
+}
+
+void Simulation::publish() {
+	SimFrame& frame = sim_frames.back();
+	auto view = registry.view<Particles>();
+	frame.fluids.resize(view.size());
+	size_t k = 0;
+	for (auto&& [entity, particles] : view.each()) {
+		FluidFrame& fluid = frame.fluids[k++];
+		// the slot holds what went out a few publishes back, and maybe of another fluid
+		if (fluid.entity != entity) fluid.surface_revision = -1;
+		fluid.entity = entity;
+		fluid.step = particles.steps;
+		if (compact) {
+			fluid.quantization = particles.quantization(density_color);
+			fluid.compact.resize(particles.size);
+			particles.pack(fluid.compact.data(), fluid.quantization);
+			fluid.instances.clear();
+		} else {
+			fluid.instances.resize(particles.size);
+			particles.pack(fluid.instances.data());
+			fluid.compact.clear();
+		}
+		fluid.splits = particles.splits;
+		fluid.merges = particles.merges;
+		fluid.asleep = particles.asleep;
+
+		Surface* extractor = sim_surface ? registry.try_get<Surface>(entity) : nullptr;
+		if (extractor) {
+			fluid.surface_ms = extractor->extract(particles) ? extractor->stats.ms : 0.0f;
+			fluid.surface_bytes = extractor->stats.bytes;
+			// the mesh is copied only when it changed since the slot had it
+			if (fluid.surface_revision != extractor->revision) {
+				fluid.surface_revision = extractor->revision;
+				fluid.posBuf = extractor->posBuf;
+				fluid.norBuf = extractor->norBuf;
+				fluid.indBuf = extractor->indBuf;
+			}
+		} else {
+			fluid.surface_revision = -1;
+			fluid.surface_ms = 0.0f;
+			fluid.surface_bytes = 0;
+			fluid.posBuf.clear();
+			fluid.norBuf.clear();
+			fluid.indBuf.clear();
+		}
+	}
+	frame.realtime_factor = realtime_factor;
+	frame.hz = sim_hz;
+	sim_frames.publish();
+}
+
+const Simulation::FluidFrame* Simulation::fluid_frame(entt::entity entity) const {
+	for (const FluidFrame& fluid : sim_frames.front().fluids) {
+		if (fluid.entity == entity) return &fluid;
+	}
+	return nullptr;
 }
 
 void Simulation::fixed_timestep_update() {
+	// a frame runs from here to the end of the next render_scene
+	PROFILE_FRAME();
 	new_time = glfwGetTime();
 	frame_time = new_time - current_time;
 	current_time = new_time;
-	total_time += frame_time;
+	hz_time += frame_time;
+	++hz_frames;
+	if (hz_time > 0.5f) {
+		render_hz = hz_frames / hz_time;
+		hz_time = 0.0f;
+		hz_frames = 0;
+	}
+
+	if (!playback_path.empty()) {
+		advance_playback();
+		return;
+	}
 
-	while (total_time >= dt) {
-		if (!options[(unsigned) 'p']) update();
-		total_time -= dt;
+	auto cameras = registry.view<Camera, Active>();
+	send(SimEvent::Focus, glm::vec4(cameras.get<Camera>(cameras.front()).position, focus_distance));
+	// whatever the simulation thread finished last, it never waits on us nor we on it
+	sim_frames.acquire();
+	const SimFrame& frame = sim_frames.front();
+
+	title_time += frame_time;
+	if (title_time > 0.5f) {
+		title_time = 0.0f;
+		std::string text = title + " - " + std::to_string(frame.realtime_factor) + "x realtime, sim " + std::to_string(frame.hz)
+			+ " Hz, render " + std::to_string(render_hz) + " Hz, " + particle_report() + instance_report() + render_report();
+		glfwSetWindowTitle(window, text.c_str());
 	}
 }
 
+void Simulation::advance_playback() {
+	auto view = registry.view<ParticleCache>();
+	auto& cache = view.get<ParticleCache>(view.front());
+	int frames = cache.frames();
+	if (frames == 0) return;
+
+	if (scrub) {
+		playback_frame = ((playback_frame + scrub) % frames + frames) % frames;
+		playback_time = cache.frame(playback_frame).time;
+	} else if (!options[(unsigned) 'p']) {
+		// frames were stepped with an adaptive dt, so follow their times
+		// rather than their count; past the last one the shot loops
+		playback_time += frame_time;
+		if (playback_time > cache.frame(frames - 1).time) {
+			playback_frame = 0;
+			playback_time = cache.frame(0).time;
+		}
+		while (playback_frame + 1 < frames && cache.frame(playback_frame + 1).time <= playback_time) ++playback_frame;
+	}
+
+	title_time += frame_time;
+	if (title_time > 0.5f) {
+		title_time = 0.0f;
+		std::string text = title + " - frame " + std::to_string(playback_frame + 1) + "/" + std::to_string(frames) + ", render "
+			+ std::to_string(render_hz) + " Hz, " + render_report();
+		glfwSetWindowTitle(window, text.c_str());
+	}
+}
+
+std::string Simulation::particle_report() const {
+	if (!adaptive && !sleeping) return "";
+	int count = 0, splits = 0, merges = 0, asleep = 0;
+	for (const FluidFrame& fluid : sim_frames.front().fluids) {
+		count += (int)(fluid.instances.size() + fluid.compact.size());
+		splits += fluid.splits;
+		merges += fluid.merges;
+		asleep += fluid.asleep;
+	}
+	std::string text = std::to_string(count) + " particles, ";
+	if (adaptive) text += std::to_string(splits) + " split, " + std::to_string(merges) + " merged, ";
+	if (sleeping) text += std::to_string(count - asleep) + " active, " + std::to_string(asleep) + " asleep, ";
+	return text;
+}
+
+// Bounds on how far a decoded instance lies from its particle, over the fluids.
+std::string Simulation::instance_report() const {
+	if (!compact) return "";
+	float position = 0.0f, radius = 0.0f;
+	for (const FluidFrame& fluid : sim_frames.front().fluids) {
+		position = glm::max(position, fluid.quantization.position_error());
+		radius = glm::max(radius, fluid.quantization.radius_error());
+	}
+	return "compact instances, position error <= " + std::to_string(position) + ", radius error <= " + std::to_string(radius) + ", ";
+}
+
+std::string Simulation::render_report() const {
+	return std::to_string(render_stats.draws) + " draws, " + std::to_string(render_stats.state_changes) + " state changes, "
+		+ std::to_string(render_stats.uniform_calls) + " uniform calls, " + std::to_string(render_stats.uniform_bytes) + " uniform bytes, "
+		+ std::to_string(render_stats.cpu_ms) + " ms to submit " + std::to_string(render_stats.items) + " items, "
+		+ std::to_string(render_stats.visible) + " particles visible, " + std::to_string(render_stats.culled) + " culled, "
+		+ std::to_string(render_stats.triangles) + " triangles, "
+		+ std::to_string(render_stats.upload_bytes >> 10) + " KiB uploaded in " + std::to_string(render_stats.upload_ms) + " ms"
+		+ (surface ? ", surface " + std::to_string(render_stats.surface_ms) + " ms, " + std::to_string(render_stats.surface_bytes >> 20) + " MiB" : "");
+}
+
+const std::vector<Mesh>& Simulation::levels_of(const Mesh& sphere) {
+	auto found = sphere_levels.find(sphere.posBufID);
+	if (found != sphere_levels.end()) return found->second;
+
+	// the sphere as loaded, then clustered to 3 and 2 cells a side
+	std::vector<Mesh> levels = {sphere};
+	for (int cells = 3; (int)levels.size() < CULL_LODS; --cells) {
+		levels.push_back(simplify(sphere, cells));
+		init(levels.back());
+	}
+	return sphere_levels[sphere.posBufID] = std::move(levels);
+}
+
+float Simulation::stable_dt() {
+	float h = dt;
+	for (auto&& [entity, particles] : registry.view<Particles>().each()) {
+		h = glm::min(h, particles.stable_dt());
+	}
+	return h;
+}
+
 void Simulation::integrate(float h) {
 
 } 
 
-void Simulation::update() {
-	auto view = registry.view<Particles>();
-	auto entity = view.front();
-	auto& particles = view.get<Particles>(entity);
-	particles.update(dt);
+void Simulation::update(float h) {
+	simulated_time += h;
+	scheduler.run(h, *pool);
 }
 
 
@@ -122,6 +690,7 @@ void Simulation::resize_window() {
 }
 
 void Simulation::render_scene() {
+	PROFILE_SCOPE(Phase::Render);
 	auto view = registry.view<Camera, Active>();
 	auto entity = view.front();
 	auto& camera = view.get<Camera>(entity);
@@ -145,58 +714,79 @@ void Simulation::render_scene() {
 }
 
 void Simulation::draw_entities(MatrixStack& MV, MatrixStack& P) {
-	glm::mat4 iMV;
+	auto start = std::chrono::steady_clock::now();
+	render_stats = RenderStats();
 	glm::vec3 world_light_pos = MV * lightPos;
-
-	pbr_program.bind();
-	for (auto&& [entity, mesh, material, transform]: registry.view<Mesh, Material, Transform>().each()) {
-		P.pushMatrix();
-		MV.pushMatrix();
-
-			MV *= (glm::mat4) transform;
-			iMV = glm::transpose(glm::inverse(MV.topMatrix()));
-
-			glUniform3f(pbr_program.getUniform("lightPos"), world_light_pos.x, world_light_pos.y, world_light_pos.z);
-			glUniformMatrix4fv(pbr_program.getUniform("P"), 1, GL_FALSE, glm::value_ptr(P.topMatrix()));
-			glUniformMatrix4fv(pbr_program.getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV.topMatrix()));
-			glUniformMatrix4fv(pbr_program.getUniform("iMV"), 1, GL_FALSE, glm::value_ptr(iMV));
-			glUniform3f(pbr_program.getUniform("ka"), material.ka.x, material.ka.y, material.ka.z);
-			glUniform3f(pbr_program.getUniform("kd"), material.kd.x, material.kd.y, material.kd.z);
-			glUniform3f(pbr_program.getUniform("ks"), material.ks.x, material.ks.y, material.ks.z);
-			glUniform1f(pbr_program.getUniform("s"), material.s );
-			glUniform1f(pbr_program.getUniform("a"), material.a );
-			draw(pbr_program, mesh);
-
-		MV.popMatrix();	
-		P.popMatrix();
+	// once for every program, MV holds just the view here
+	uniform_blocks.set_frame(P.topMatrix(), MV.topMatrix(), world_light_pos, render_stats);
+
+	// meshes go through the queue, one instanced draw per distinct mesh;
+	// groups keep the transforms, and the instance buffers, packed in the
+	// order they are walked
+	for (auto&& [entity, transform, mesh, material]: mesh_group->each()) {
+		render_queue.submit(pbr_program, mesh, material, (glm::mat4) transform);
 	}
-	pbr_program.unbind();
-
-
-
-
-	fluid_program.bind();
-	for (auto&& [entity, fluid, mesh, material] : registry.view<Particles, Mesh, Material>().each()) {
-		P.pushMatrix();
-		MV.pushMatrix();
-
-		iMV = glm::transpose(glm::inverse(MV.topMatrix()));
-
-		glUniform3f(fluid_program.getUniform("lightPos"), world_light_pos.x, world_light_pos.y, world_light_pos.z);
-		glUniformMatrix4fv(fluid_program.getUniform("P"), 1, GL_FALSE, glm::value_ptr(P.topMatrix()));
-		glUniformMatrix4fv(fluid_program.getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV.topMatrix()));
-		glUniformMatrix4fv(fluid_program.getUniform("iMV"), 1, GL_FALSE, glm::value_ptr(iMV));
-		glUniform3f(fluid_program.getUniform("ka"), material.ka.x, material.ka.y, material.ka.z);
-		glUniform3f(fluid_program.getUniform("kd"), material.kd.x, material.kd.y, material.kd.z);
-		glUniform3f(fluid_program.getUniform("ks"), material.ks.x, material.ks.y, material.ks.z);
-		glUniform1f(fluid_program.getUniform("s"), material.s );
-		glUniform1f(fluid_program.getUniform("a"), material.a );
-		fluid.render(fluid_program, mesh);
+	// fluid surfaces are meshes like any other, in world space
+	// extracted by the simulation thread, as it published the step
+	if (surface) {
+		for (auto&& [entity, extractor, material] : registry.view<Surface, Material>().each()) {
+			const FluidFrame* fluid = fluid_frame(entity);
+			if (!fluid) continue;
+			SurfaceMesh& out = surface_meshes[entity];
+			if (fluid->surface_revision >= 0 && out.revision != fluid->surface_revision) {
+				out.mesh.posBuf = fluid->posBuf;
+				out.mesh.norBuf = fluid->norBuf;
+				out.mesh.indBuf = fluid->indBuf;
+				::update(out.mesh);
+				out.revision = fluid->surface_revision;
+				render_stats.surface_ms += fluid->surface_ms;
+			}
+			render_stats.surface_bytes += fluid->surface_bytes;
+			if (!out.mesh.indBuf.empty()) render_queue.submit(pbr_program, out.mesh, material, glm::mat4(1.0f));
+		}
+	}
+	render_queue.flush(render_stats);
 
-		MV.popMatrix();	
-		P.popMatrix();
+	// fluids are instanced already, culled to the frustum and drawn with one
+	// instanced draw per level of detail
+	if (fluid_group->empty()) {
+		render_stats.cpu_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return;
+	}
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	Frustum frustum = make_frustum(P.topMatrix(), MV.topMatrix(), height);
+
+	Program& program = impostors ? impostor_program : fluid_program;
+	program.bind();
+	++render_stats.state_changes;
+	for (auto&& [entity, buffer, mesh, material] : fluid_group->each()) {
+		if (surface && registry.all_of<Particles, Surface>(entity)) continue;
+		uniform_blocks.bind_material(material, render_stats);
+		// once per rendered frame, however many steps ran since the last one,
+		// and again when the camera moved
+		{
+			PROFILE_SCOPE(Phase::Upload);
+			const FluidFrame* fluid = fluid_frame(entity);
+			if (fluid && compact) upload(buffer, fluid->compact.data(), (int)fluid->compact.size(), fluid->step, fluid->quantization, &frustum, render_pool.get());
+			else if (fluid) upload(buffer, fluid->instances.data(), (int)fluid->instances.size(), fluid->step, &frustum, render_pool.get());
+			else if (auto* cache = registry.try_get<ParticleCache>(entity)) upload(buffer, *cache, playback_frame, &frustum);
+		}
+		int draws = draw(program, buffer, levels_of(impostors ? impostor_quad : mesh));
+		// the decode uniforms
+		render_stats.uniform_calls += 2;
+		render_stats.uniform_bytes += 2 * sizeof(glm::vec4);
+		++render_stats.items;
+		render_stats.draws += draws;
+		render_stats.state_changes += draws;
+		render_stats.visible += buffer.instances;
+		render_stats.culled += buffer.cull_stats.culled;
+		render_stats.triangles += buffer.triangles;
+		render_stats.upload_bytes += buffer.bytes_uploaded;
+		render_stats.upload_ms += buffer.upload_ms;
 	} 
-	fluid_program.unbind();
+	program.unbind();
+	render_stats.cpu_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 bool Simulation::window_closed() {
@@ -298,6 +888,42 @@ void Simulation::input_capture(){
 	camera.inputs[(unsigned)'a'] = glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS;
 	camera.inputs[(unsigned)'q'] = glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS;
 	camera.inputs[(unsigned)'e'] = glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS;
+
+	// p pauses, the arrows step a played back shot a frame at a time
+	bool pause = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+	if (pause && !pause_held) {
+		options[(unsigned) 'p'] = !options[(unsigned) 'p'];
+		send(SimEvent::Pause, glm::vec4(options[(unsigned) 'p']));
+	}
+	pause_held = pause;
+	// i switches fluids between sphere meshes and impostors
+	bool impostor = glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS;
+	if (impostor && !impostors_held) impostors = !impostors;
+	impostors_held = impostor;
+	// m between particles and the surface
+	bool remesh = glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS;
+	if (remesh && !surface_held) {
+		surface = !surface;
+		send(SimEvent::Surface, glm::vec4(surface));
+	}
+	surface_held = remesh;
+
+	bool dump = glfwGetKey(window, GLFW_KEY_F2) == GLFW_PRESS;
+	if (dump && !profile_held) write_profile();
+	profile_held = dump;
+	// F5 checkpoints the scene, F9 goes back to the checkpoint; both see the
+	// simulation thread between steps
+	bool save = glfwGetKey(window, GLFW_KEY_F5) == GLFW_PRESS;
+	bool load = glfwGetKey(window, GLFW_KEY_F9) == GLFW_PRESS;
+	if ((save && !checkpoint_held) || (load && !restore_held)) {
+		stop_simulation();
+		if (save && !checkpoint_held) write_checkpoint();
+		if (load && !restore_held) restore_checkpoint();
+		start_simulation();
+	}
+	checkpoint_held = save;
+	restore_held = load;
+	scrub = (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) - (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS);
 	
 	// options[(unsigned) 'x'] = ImGui::IsKeyReleased(ImGuiKey_F) ? !options[(unsigned) 'x'] : options[(unsigned) 'x'];
 	// options[(unsigned)'c'] = ImGui::IsKeyReleased(ImGuiKey_C) ? !options[(unsigned) 'c'] : options[(unsigned) 'c'];
@@ -2,19 +2,44 @@
 #ifndef SIMULATION_H
 #define SIMULATION_H
 
+#include <atomic>
+#include <map>
 #include <vector>
 #include <string>
+#include <memory>
+#include <optional>
+#include <thread>
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+// read ahead of Checkpoint.h, so without the warning it turns off there
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#endif
 #include <entt/entt.hpp>
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
 
 #include "GLSL.h"
+#include "Handoff.h"
+#include "Material.h"
+#include "Mesh.h"
+#include "ParticleBuffer.h"
 #include "Program.h"
-
+#include "Quantize.h"
+#include "RenderQueue.h"
+#include "Scheduler.h"
+#include "ThreadPool.h"
+#include "Transform.h"
+#include "UniformBlocks.h"
+
+class BakeWriter;
+class CheckpointWriter;
 class Entity;
 class MatrixStack;
 
@@ -27,12 +52,43 @@ class Simulation {
         void operator=(Simulation const&);
         ~Simulation();
 
+        void set_threads(int threads);
+        // Streams every step of the fluid to path from set_scene on;
+        // channels adds BAKE_VELOCITY and/or BAKE_DENSITY to the positions.
+        void set_bake(const std::string& path, unsigned channels = 0);
+        // Plays a particle cache back instead of simulating; the frames loop
+        // at the speed they were simulated.
+        void set_playback(const std::string& path);
+        // Scatters count small cubes around the scene, to load the renderer.
+        void set_props(int count);
+        // Draws fluids as ray cast sphere impostors, one quad a particle,
+        // rather than as instanced sphere meshes. I switches at runtime.
+        void set_impostors(bool on);
+        // Draws fluids as their surface, remeshed when they step, rather
+        // than as particles. M switches at runtime.
+        void set_surface(bool on);
+        // Writes per phase timings of the last PROFILE_FRAMES frames to
+        // path.csv and path.json when F2 is pressed. Needs SPH_PROFILE.
+        void set_profile(const std::string& path);
+        // Lets the fluid merge its particles where it is deep and split them
+        // back near its surface, the walls, the bunny and the camera.
+        void set_adaptive(bool on);
+        // Lets fluid particles that have come to rest sleep until disturbed.
+        void set_sleeping(bool on);
+        // Sends fluids to the GPU as QuantizedInstances, 8 bytes a particle
+        // rather than 16; density shades them by their density too.
+        void set_compact(bool on, bool density = false);
+        // F5 writes a checkpoint of the scene to path, from a thread of its
+        // own, F9 restores it; restore also does once the scene is set.
+        void set_checkpoint(const std::string& path, bool restore = false);
         void create_window(const char * window_name);
         void init_programs();
         void init_cameras();
         void set_scene();
         void render_scene();
         void move_camera();
+        // Takes the newest state the simulation thread published, or plays
+        // the cache back, and reports both rates in the title.
         void fixed_timestep_update();
         void resize_window();
         void swap_buffers();
@@ -53,17 +109,72 @@ class Simulation {
 
         
     private:
-        void update();        
+        // What the simulation thread publishes of a fluid once it stepped,
+        // everything the renderer reads of it.
+        struct FluidFrame {
+            entt::entity entity = entt::null;
+            int step = -1;                      // Particles::steps
+            std::vector<glm::vec4> instances;   // Particles::pack
+            std::vector<QuantizedInstance> compact;     // or its compact form, against quantization
+            Quantization quantization;
+            std::vector<glm::vec3> posBuf, norBuf;  // its surface, while drawn
+            std::vector<unsigned> indBuf;
+            long long surface_revision = -1;    // Surface::revision of the mesh, -1 while not drawn
+            float surface_ms = 0.0f;            // to extract it, 0 when it stayed
+            size_t surface_bytes = 0;
+            int splits = 0, merges = 0, asleep = 0;
+        };
+        struct SimFrame {
+            std::vector<FluidFrame> fluids;
+            float realtime_factor = 1.0f;
+            float hz = 0.0f;                    // steps per wall second
+        };
+        // An input event for the simulation thread.
+        struct SimEvent {
+            enum Kind { Focus, Pause, Surface } kind;
+            glm::vec4 value;                    // eye and focus distance, or x as the switch
+        };
+
+        // The simulation thread owns the fluids, their walls, collider and
+        // surfaces, and the render thread everything else; checkpoints stop
+        // it, as they touch both.
+        void start_simulation();
+        void stop_simulation();
+        void simulate();
+        void publish();
+        void send(SimEvent::Kind kind, glm::vec4 value);
+        const FluidFrame* fluid_frame(entt::entity entity) const;
+
+        void update(float h);
+        float stable_dt();
         void integrate(float h);
         void draw_entities(MatrixStack& MV, MatrixStack& P);
         void error_callback_impl(int error, const char *description);
+        void finish_bake();
+        void advance_playback();
+        void write_profile();
+        void write_checkpoint();
+        bool restore_checkpoint();
+        void finish_checkpoints();
+        std::string render_report() const;
+        std::string particle_report() const;
+        std::string instance_report() const;
+        const std::vector<Mesh>& levels_of(const Mesh& sphere);
         
-        float   dt = 1.0f/64.0f, 
+        float   dt = 1.0f/64.0f,            // largest step, the fluids may ask for less
                 current_time, 
                 total_time, 
                 new_time, 
                 frame_time, 
-                eps = 0.01f;
+                eps = 0.01f,
+                realtime_factor = 1.0f,     // simulated seconds per wall second, smoothed
+                title_time = 0.0f,
+                simulated_time = 0.0f;      // sum of all steps taken
+        int max_substeps = 8;               // per wakeup, beyond that the simulation slows down
+        float render_hz = 0.0f,             // frames per wall second, smoothed
+              hz_time = 0.0f;
+        int hz_frames = 0;
+        std::string title;
 
         glm::vec3   lightPos = glm::vec3(0.0f, 30.0f, 0.0f),
                     gravity = glm::vec3(0.0f, -9.0f, 0.0f),
@@ -75,9 +186,69 @@ class Simulation {
 
         GLFWwindow *window;   
 
-        Program pbr_program, fluid_program;
+        Program pbr_program, fluid_program, impostor_program;
+        Mesh impostor_quad;                 // two triangles spanning [-1, 1]^2, its own only level
+        bool impostors = false,
+             impostors_held = false;
+
+        // GL side of a fluid's Surface
+        struct SurfaceMesh {
+            Mesh mesh;
+            long long revision = -1;        // Surface::revision it was uploaded at
+        };
+        std::map<entt::entity, SurfaceMesh> surface_meshes;
+        bool surface = false,
+             surface_held = false;
+
+        bool adaptive = false,
+             sleeping = false,
+             compact = false,
+             density_color = false;
+        float focus_distance = 1.0f;        // fluid closer to the camera keeps full resolution
+
+        std::unique_ptr<ThreadPool> pool;
+        std::unique_ptr<ThreadPool> render_pool;    // culls on the render thread, pool is the simulation thread's
+
+        std::string bake_path;
+        unsigned bake_channels = 0;
+        std::unique_ptr<BakeWriter> bake;
+
+        std::string playback_path;
+        int playback_frame = 0,
+            scrub = 0;                      // frames to step this frame, from the arrow keys
+        float playback_time = 0.0f;         // simulated time of the shot being shown
+        bool pause_held = false;
+
+        std::string profile_path = "profile";
+        bool profile_held = false;
+
+        std::string checkpoint_path = "checkpoint.sphk";
+        bool restore_at_start = false,
+             checkpoint_held = false,
+             restore_held = false;
+        std::unique_ptr<CheckpointWriter> checkpoints;
+
+        int props = 0;
+        RenderQueue render_queue;
+        UniformBlocks uniform_blocks;
+        RenderStats render_stats;           // of the last rendered frame
+        std::map<unsigned, std::vector<Mesh>> sphere_levels;   // fluid spheres' levels of detail, by position buffer
 
         entt::registry registry;      
+        Scheduler scheduler;                // steps the registry, set up by set_scene
+        // made by set_scene before the simulation thread starts, groups sort
+        // the pools they own
+        std::optional<entt::group<entt::owned_t<Transform>, entt::get_t<Mesh, Material>, entt::exclude_t<>>> mesh_group;
+        std::optional<entt::group<entt::owned_t<ParticleBuffer>, entt::get_t<Mesh, Material>, entt::exclude_t<>>> fluid_group;
+
+        std::thread sim_thread;
+        std::atomic<bool> sim_running{false};
+        TripleBuffer<SimFrame> sim_frames;  // newest published state, front is the render thread's
+        SpscQueue<SimEvent, 256> sim_events;
+        // the simulation thread's own copies of the switches
+        bool sim_paused = false,
+             sim_surface = false;
+        float sim_hz = 0.0f;
 };
 
 
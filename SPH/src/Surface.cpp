@@ -0,0 +1,430 @@
+#include "Surface.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+
+#include "Particles.h"
+
+static const int side = SURFACE_BLOCK;
+static const int nodes = SURFACE_BLOCK * SURFACE_BLOCK * SURFACE_BLOCK;
+// a block's field with the ring of nodes around it that its cells and
+// gradients read, -1 to SURFACE_BLOCK + 1 along each axis
+static const int padded = SURFACE_BLOCK + 3;
+
+static std::uint64_t pack(const glm::ivec3& c) {
+    const std::int64_t bias = 1 << 20, mask = (1 << 21) - 1;
+    return (std::uint64_t)((c.x + bias) & mask) | (std::uint64_t)((c.y + bias) & mask) << 21 | (std::uint64_t)((c.z + bias) & mask) << 42;
+}
+
+static glm::ivec3 corner(int k) {
+    return glm::ivec3(k & 1, k >> 1 & 1, k >> 2 & 1);
+}
+
+// Marching cubes cases, built rather than typed in. Corner k of a cube sits
+// at corner(k) and is inside when its value reaches iso; edge e runs from
+// corner start[e] along axis[e]. On every face the curve enters the inside
+// corners where the walk around the face, counterclockwise from outside,
+// goes from an outside corner to an inside one, and leaves at the next edge
+// going the other way. Faces with two inside corners across a diagonal thus
+// keep them apart, the same way from either cube sharing the face, so the
+// surface has no holes. Each crossed edge is entered on one of its faces and
+// left on the other, which chains the face segments into loops around the
+// cube; loops are fanned into triangles facing the outside corners.
+struct Cases {
+    int start[12], axis[12];
+    std::vector<int> triangles[256];    // 3 edges each
+
+    Cases() {
+        int edge_of[8][3];
+        int e = 0;
+        for (int k = 0; k < 8; ++k) {
+            for (int a = 0; a < 3; ++a) {
+                if (k >> a & 1) continue;
+                start[e] = k;
+                axis[e] = a;
+                edge_of[k][a] = e++;
+            }
+        }
+        auto edge_between = [&](int a, int b) {
+            int lo = std::min(a, b), bit = a ^ b;
+            return edge_of[lo][bit == 1 ? 0 : bit == 2 ? 1 : 2];
+        };
+
+        // corners of every face, counterclockwise around its outward normal
+        int faces[6][4];
+        for (int a = 0; a < 3; ++a) {
+            for (int s = 0; s < 2; ++s) {
+                int u = (a + 1) % 3, v = (a + 2) % 3;
+                if (!s) std::swap(u, v);
+                const int cu[4] = {0, 1, 1, 0}, cv[4] = {0, 0, 1, 1};
+                for (int i = 0; i < 4; ++i) faces[2*a + s][i] = s << a | cu[i] << u | cv[i] << v;
+            }
+        }
+
+        for (int c = 0; c < 256; ++c) {
+            int next[12];
+            std::fill(next, next + 12, -1);
+            for (const auto& face : faces) {
+                int edges[4], entering[4], crossings = 0;
+                for (int i = 0; i < 4; ++i) {
+                    bool from = c >> face[i] & 1, to = c >> face[(i + 1) % 4] & 1;
+                    if (from == to) continue;
+                    edges[crossings] = edge_between(face[i], face[(i + 1) % 4]);
+                    entering[crossings++] = to;
+                }
+                for (int i = 0; i < crossings; ++i) {
+                    if (!entering[i]) continue;
+                    int j = (i + 1) % crossings;
+                    while (entering[j]) j = (j + 1) % crossings;
+                    next[edges[i]] = edges[j];
+                }
+            }
+
+            bool visited[12] = {};
+            for (int first = 0; first < 12; ++first) {
+                if (next[first] < 0 || visited[first]) continue;
+                std::vector<int> loop;
+                for (int e = first; !visited[e]; e = next[e]) {
+                    visited[e] = true;
+                    loop.push_back(e);
+                }
+                for (size_t i = 1; i + 1 < loop.size(); ++i) {
+                    triangles[c].insert(triangles[c].end(), {loop[0], loop[i], loop[i + 1]});
+                }
+            }
+        }
+    }
+};
+
+void Surface::clear() {
+    slots.clear();
+    blocks.clear();
+    free_slots.clear();
+    active.clear();
+    posBuf.clear();
+    norBuf.clear();
+    indBuf.clear();
+    spacing = h = 0.0f;
+    stats = SurfaceStats();
+    ++revision;
+}
+
+int Surface::find(const glm::ivec3& coord) const {
+    auto found = slots.find(pack(coord));
+    return found == slots.end() ? -1 : found->second;
+}
+
+// The block at coord, created if needed, counted in reach this extract.
+int Surface::acquire(const glm::ivec3& coord) {
+    int slot = find(coord);
+    if (slot < 0) {
+        if (free_slots.empty()) {
+            slot = (int)blocks.size();
+            blocks.emplace_back();
+        } else {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        blocks[slot].coord = coord;
+        slots.emplace(pack(coord), slot);
+    }
+    Block& block = blocks[slot];
+    if (block.epoch != epoch) {
+        block.epoch = epoch;
+        block.count = 0;
+    }
+    return slot;
+}
+
+bool Surface::extract(Particles& particles) {
+    auto start = std::chrono::steady_clock::now();
+    ThreadPool& pool = particles.workers();
+    float s = cell > 0.0f ? cell : particles.radius;
+    float reach = support * particles.radius;
+    if (s != spacing || reach != h) {
+        clear();
+        spacing = s;
+        h = reach;
+    }
+    float span = side * spacing;
+    size_t n = particles.size;
+    const float* x = particles.x;
+    const float* y = particles.y;
+    const float* z = particles.z;
+    const float* mass = particles.mass;
+    float unit = 1.0f / particles.mpp;
+    ++epoch;
+
+    // every particle's block; z ordered particles mostly repeat the last one
+    home.resize(n);
+    homes.clear();
+    glm::ivec3 last(INT_MIN);
+    int slot = -1;
+    for (size_t i = 0; i < n; ++i) {
+        glm::vec3 p(x[i], y[i], z[i]);
+        glm::ivec3 c(glm::floor(p / span));
+        if (c != last) {
+            slot = acquire(c);
+            last = c;
+        }
+        Block& block = blocks[slot];
+        if (block.count++ == 0) {
+            block.lo = block.hi = p;
+            homes.push_back(slot);
+        } else {
+            block.lo = glm::min(block.lo, p);
+            block.hi = glm::max(block.hi, p);
+        }
+        home[i] = slot;
+    }
+    std::vector<unsigned> cursor(blocks.size());
+    unsigned total = 0;
+    for (int b : homes) {
+        blocks[b].begin = cursor[b] = total;
+        total += blocks[b].count;
+    }
+    order.resize(n);
+    for (size_t i = 0; i < n; ++i) order[cursor[home[i]]++] = (unsigned)i;
+
+    // and every block a splat reaches, one node further: the ones left out
+    // are then empty next to their neighbors too, so no crossed edge starts
+    // in a block that does not exist
+    float margin = h + spacing;
+    for (size_t k = 0, count = homes.size(); k < count; ++k) {
+        glm::ivec3 lo(glm::floor((blocks[homes[k]].lo - margin) / span));
+        glm::ivec3 hi(glm::floor((blocks[homes[k]].hi + margin) / span));
+        for (int cz = lo.z; cz <= hi.z; ++cz) {
+            for (int cy = lo.y; cy <= hi.y; ++cy) {
+                for (int cx = lo.x; cx <= hi.x; ++cx) acquire(glm::ivec3(cx, cy, cz));
+            }
+        }
+    }
+
+    // blocks out of reach go, with their part of the mesh
+    std::vector<glm::ivec3> dropped;
+    for (int b : active) {
+        if (blocks[b].epoch == epoch) continue;
+        dropped.push_back(blocks[b].coord);
+        slots.erase(pack(blocks[b].coord));
+        blocks[b] = Block();
+        free_slots.push_back(b);
+    }
+    active.clear();
+    for (int b = 0; b < (int)blocks.size(); ++b) {
+        if (blocks[b].epoch == epoch) active.push_back(b);
+    }
+
+    auto splat_start = std::chrono::steady_clock::now();
+    float inv_h2 = 1.0f / (h * h);
+    float limit = threshold * iso;
+    pool.parallel_for(active.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t a = begin; a < end; ++a) {
+            Block& block = blocks[active[a]];
+            block.value.assign(nodes, 0.0f);
+            glm::ivec3 origin = block.coord * side;
+            glm::vec3 lo = glm::vec3(origin) * spacing - h, hi = glm::vec3(origin + side - 1) * spacing + h;
+
+            // (1 - r^2/h^2)^3 of every particle in reach, gathered from the
+            // blocks around in a fixed order; merged particles count for
+            // all the ones they stand for, so the sparser interior stays full
+            for (int dz = -1; dz <= 1; ++dz) {
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        int b = find(block.coord + glm::ivec3(dx, dy, dz));
+                        if (b < 0 || blocks[b].count == 0) continue;
+                        const Block& other = blocks[b];
+                        if (glm::any(glm::lessThan(other.hi, lo)) || glm::any(glm::greaterThan(other.lo, hi))) continue;
+                        for (unsigned k = other.begin; k < other.begin + other.count; ++k) {
+                            unsigned i = order[k];
+                            glm::vec3 p(x[i], y[i], z[i]);
+                            glm::ivec3 first = glm::max(glm::ivec3(glm::ceil((p - h) / spacing)) - origin, glm::ivec3(0));
+                            glm::ivec3 past = glm::min(glm::ivec3(glm::floor((p + h) / spacing)) - origin, glm::ivec3(side - 1));
+                            glm::vec3 d0 = glm::vec3(origin) * spacing - p;
+                            float weight = mass[i] * unit;
+                            for (int nz = first.z; nz <= past.z; ++nz) {
+                                float dz = d0.z + nz * spacing;
+                                for (int ny = first.y; ny <= past.y; ++ny) {
+                                    float dy = d0.y + ny * spacing;
+                                    float* row = &block.value[(nz * side + ny) * side];
+                                    float r2 = (dz * dz + dy * dy) * inv_h2;
+                                    for (int nx = first.x; nx <= past.x; ++nx) {
+                                        float dx = d0.x + nx * spacing;
+                                        float q = glm::max(0.0f, 1.0f - r2 - dx * dx * inv_h2);
+                                        row[nx] += weight * q * q * q;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            // new blocks, and ones whose nodes moved far enough, are remeshed
+            bool moved = block.meshed.empty();
+            for (int k = 0; k < nodes && !moved; ++k) moved = std::abs(block.value[k] - block.meshed[k]) > limit;
+            block.remesh = moved;
+        }
+    });
+
+    // the blocks below read their nodes in their cells and edges, so are
+    // remeshed too, from their own field as it was meshed; only changed
+    // blocks take their new field, which keeps every edge crossed, or not,
+    // the same for all the cells around it
+    std::vector<int> changed;
+    for (int b : active) {
+        if (blocks[b].remesh) changed.push_back(b);
+    }
+    auto below = [&](const glm::ivec3& coord) {
+        for (int k = 1; k < 8; ++k) {
+            int b = find(coord - corner(k));
+            if (b >= 0) blocks[b].remesh = true;
+        }
+    };
+    for (int b : changed) {
+        below(blocks[b].coord);
+        blocks[b].meshed = blocks[b].value;
+    }
+    for (const glm::ivec3& coord : dropped) below(coord);
+    std::vector<int> remesh;
+    for (int b : active) {
+        if (blocks[b].remesh) remesh.push_back(b);
+    }
+
+    auto march_start = std::chrono::steady_clock::now();
+    pool.parallel_for(remesh.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; ++r) march(blocks[remesh[r]]);
+    });
+    for (int b : remesh) blocks[b].remesh = false;
+
+    auto assemble_start = std::chrono::steady_clock::now();
+    bool updated = !remesh.empty() || !dropped.empty();
+    if (updated) {
+        assemble(pool);
+        ++revision;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    stats.blocks = (int)active.size();
+    stats.remeshed = (int)remesh.size();
+    stats.vertices = (int)posBuf.size();
+    stats.triangles = (int)indBuf.size() / 3;
+    stats.splat_ms = std::chrono::duration<float, std::milli>(march_start - splat_start).count();
+    stats.march_ms = std::chrono::duration<float, std::milli>(assemble_start - march_start).count();
+    stats.assemble_ms = std::chrono::duration<float, std::milli>(end - assemble_start).count();
+    stats.ms = std::chrono::duration<float, std::milli>(end - start).count();
+    stats.bytes = (posBuf.capacity() + norBuf.capacity()) * sizeof(glm::vec3) + indBuf.capacity() * sizeof(unsigned)
+        + blocks.capacity() * sizeof(Block) + slots.size() * (sizeof(std::uint64_t) + sizeof(int) + 2 * sizeof(void*))
+        + (home.capacity() + order.capacity()) * sizeof(unsigned);
+    for (const Block& block : blocks) {
+        stats.bytes += (block.value.capacity() + block.meshed.capacity()) * sizeof(float) + block.vertex.capacity() * sizeof(int)
+            + (block.pos.capacity() + block.nor.capacity()) * sizeof(glm::vec3) + block.corners.capacity() * sizeof(std::uint32_t);
+    }
+    return updated;
+}
+
+void Surface::march(Block& block) {
+    static const Cases cases;
+
+    float field[padded * padded * padded];
+    const float* around[27];
+    for (int d = 0; d < 27; ++d) {
+        int b = find(block.coord + glm::ivec3(d % 3 - 1, d / 3 % 3 - 1, d / 9 - 1));
+        around[d] = b < 0 || blocks[b].meshed.empty() ? nullptr : blocks[b].meshed.data();
+    }
+    for (int pz = -1; pz <= side + 1; ++pz) {
+        for (int py = -1; py <= side + 1; ++py) {
+            for (int px = -1; px <= side + 1; ++px) {
+                glm::ivec3 d(px < 0 ? -1 : px >= side, py < 0 ? -1 : py >= side, pz < 0 ? -1 : pz >= side);
+                glm::ivec3 local = glm::ivec3(px, py, pz) - d * side;
+                const float* values = around[(d.z + 1) * 9 + (d.y + 1) * 3 + d.x + 1];
+                field[((pz + 1) * padded + py + 1) * padded + px + 1] = values ? values[(local.z * side + local.y) * side + local.x] : 0.0f;
+            }
+        }
+    }
+    auto at = [&](const glm::ivec3& n) { return field[((n.z + 1) * padded + n.y + 1) * padded + n.x + 1]; };
+    auto gradient = [&](const glm::ivec3& n) {
+        return glm::vec3(at(n + glm::ivec3(1, 0, 0)) - at(n - glm::ivec3(1, 0, 0)),
+            at(n + glm::ivec3(0, 1, 0)) - at(n - glm::ivec3(0, 1, 0)),
+            at(n + glm::ivec3(0, 0, 1)) - at(n - glm::ivec3(0, 0, 1)));
+    };
+
+    // a vertex on every crossed edge starting at one of the block's nodes
+    glm::ivec3 origin = block.coord * side;
+    block.vertex.assign(nodes * 3, -1);
+    block.pos.clear();
+    block.nor.clear();
+    for (int k = 0; k < nodes; ++k) {
+        glm::ivec3 n(k % side, k / side % side, k / (side * side));
+        float v0 = at(n);
+        for (int a = 0; a < 3; ++a) {
+            glm::ivec3 m = n;
+            ++m[a];
+            float v1 = at(m);
+            if ((v0 >= iso) == (v1 >= iso)) continue;
+            float t = (iso - v0) / (v1 - v0);
+            glm::vec3 p = glm::vec3(origin + n);
+            p[a] += t;
+            // the field falls off outwards
+            glm::vec3 g = glm::mix(gradient(n), gradient(m), t);
+            float length = glm::length(g);
+            block.vertex[k * 3 + a] = (int)block.pos.size();
+            block.pos.push_back(p * spacing);
+            block.nor.push_back(length > 0.0f ? -g / length : glm::vec3(0.0f, 1.0f, 0.0f));
+        }
+    }
+
+    // and the triangles of every cell whose lowest node it holds, each
+    // corner named by the block, this one or one above, holding its edge
+    block.corners.clear();
+    for (int k = 0; k < nodes; ++k) {
+        glm::ivec3 n(k % side, k / side % side, k / (side * side));
+        int cube = 0;
+        for (int c = 0; c < 8; ++c) cube |= (at(n + corner(c)) >= iso) << c;
+        for (int e : cases.triangles[cube]) {
+            glm::ivec3 s = n + corner(cases.start[e]);
+            glm::ivec3 d(s.x >= side, s.y >= side, s.z >= side);
+            glm::ivec3 local = s - d * side;
+            std::uint32_t edge = ((local.z * side + local.y) * side + local.x) * 3 + cases.axis[e];
+            block.corners.push_back((std::uint32_t)(d.x | d.y << 1 | d.z << 2) << 16 | edge);
+        }
+    }
+}
+
+void Surface::assemble(ThreadPool& pool) {
+    size_t count = active.size();
+    std::vector<unsigned> first_vertex(count + 1, 0), first_corner(count + 1, 0);
+    std::vector<int> rank(blocks.size(), -1);
+    for (size_t a = 0; a < count; ++a) {
+        const Block& block = blocks[active[a]];
+        rank[active[a]] = (int)a;
+        first_vertex[a + 1] = first_vertex[a] + (unsigned)block.pos.size();
+        first_corner[a + 1] = first_corner[a] + (unsigned)block.corners.size();
+    }
+    posBuf.resize(first_vertex[count]);
+    norBuf.resize(first_vertex[count]);
+    indBuf.resize(first_corner[count]);
+
+    pool.parallel_for(count, 1, [&](size_t begin, size_t end) {
+        for (size_t a = begin; a < end; ++a) {
+            const Block& block = blocks[active[a]];
+            std::copy(block.pos.begin(), block.pos.end(), posBuf.begin() + first_vertex[a]);
+            std::copy(block.nor.begin(), block.nor.end(), norBuf.begin() + first_vertex[a]);
+
+            const Block* above[8];
+            unsigned offset[8];
+            for (int k = 0; k < 8; ++k) {
+                int b = find(block.coord + corner(k));
+                above[k] = b < 0 ? nullptr : &blocks[b];
+                offset[k] = b < 0 ? 0 : first_vertex[rank[b]];
+            }
+            unsigned* out = &indBuf[first_corner[a]];
+            for (size_t c = 0; c < block.corners.size(); ++c) {
+                std::uint32_t code = block.corners[c] >> 16, edge = block.corners[c] & 0xffff;
+                // a block above always holds the vertex, see extract
+                out[c] = offset[code] + (unsigned)above[code]->vertex[edge];
+            }
+        }
+    });
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#ifndef SURFACE_H
+#define SURFACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "ThreadPool.h"
+
+struct Particles;
+
+// Cells along each side of a surface block.
+#define SURFACE_BLOCK 8
+
+struct SurfaceStats {
+    int blocks = 0;             // in reach of a particle
+    int remeshed = 0;           // by the last extract
+    int vertices = 0, triangles = 0;
+    float splat_ms = 0.0f, march_ms = 0.0f, assemble_ms = 0.0f;
+    float ms = 0.0f;            // of the whole last extract
+    size_t bytes = 0;           // blocks, their meshes and the output
+};
+
+// Fluid surface, the iso surface of a density field splatted from the
+// particles onto a lattice of nodes. Only blocks of SURFACE_BLOCK^3 nodes in
+// reach of a particle exist; each gathers the particles of the 27 blocks
+// around it, so splatting runs a block per task without atomics. Marching
+// cubes then runs per block too, over the cells whose lowest node the block
+// holds. A vertex belongs to the block holding the lower node of its edge
+// and triangles name it by that edge, so blocks share vertices and a block
+// can be remeshed without touching the blocks that use its vertices. Only
+// blocks whose nodes moved by more than threshold, and the blocks below them
+// whose cells read those nodes, are remeshed; the indexed mesh is then
+// stitched back together from every block's part.
+class Surface {
+    public:
+        float cell = 0.0f;          // node spacing, 0 for the particles' rest spacing
+        float support = 2.0f;       // splat radius, in rest spacings
+        float iso = 0.5f;           // field value on the surface, a lone particle peaks at 1
+        float threshold = 0.02f;    // node change, relative to iso, a block keeps its mesh through
+
+        // every vertex shared by the triangles around it, normals point out
+        std::vector<glm::vec3> posBuf, norBuf;
+        std::vector<unsigned> indBuf;
+        SurfaceStats stats;
+        unsigned revision = 0;      // counts the changes to the mesh, clear included
+
+        // Brings the mesh up to date with the particles. Returns whether it
+        // changed.
+        bool extract(Particles& particles);
+        void clear();
+
+    private:
+        struct Block {
+            glm::ivec3 coord;
+            unsigned epoch = 0;             // last extract it was in reach in
+            int count = 0;                  // particles in it
+            unsigned begin = 0;             // and where they start in order
+            glm::vec3 lo, hi;               // their bounds
+            bool remesh = false;
+            std::vector<float> value;       // node field, x fastest
+            std::vector<float> meshed;      // the field its mesh was built from
+            std::vector<int> vertex;        // 3 edges per node, x y z, to a vertex in pos, or -1
+            std::vector<glm::vec3> pos, nor;
+            std::vector<std::uint32_t> corners;     // upper neighbor << 16 | its edge, 3 per triangle
+        };
+
+        int acquire(const glm::ivec3& coord);
+        int find(const glm::ivec3& coord) const;
+        void march(Block& block);
+        void assemble(ThreadPool& pool);
+
+        std::unordered_map<std::uint64_t, int> slots;  // block coordinates -> blocks
+        std::vector<Block> blocks;
+        std::vector<int> free_slots;
+        std::vector<int> active;            // slots in reach, ascending
+        std::vector<int> homes;             // of which holding particles
+        std::vector<int> home;              // particle -> its block
+        std::vector<unsigned> order;        // particles by block
+        unsigned epoch = 0;
+        float spacing = 0.0f, h = 0.0f;     // of the current field
+};
+
+#endif
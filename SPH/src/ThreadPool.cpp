@@ -0,0 +1,91 @@
+#include "ThreadPool.h"
+
+thread_local const ThreadPool* ThreadPool::running = nullptr;
+
+ThreadPool::ThreadPool(int threads) : threads(threads) {
+    if (this->threads <= 0) this->threads = std::max(1u, std::thread::hardware_concurrency());
+    queues.reset(new Queue[this->threads]);
+    for (int t = 0; t < this->threads; ++t) queues[t].range = 0;
+    for (int t = 1; t < this->threads; ++t) workers.emplace_back(&ThreadPool::loop, this, t);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+void ThreadPool::run(size_t blocks, const std::function<void(size_t)>& fn) {
+    if (threads == 1 || blocks == 1 || running == this) {
+        for (size_t b = 0; b < blocks; ++b) fn(b);
+        return;
+    }
+
+    for (int t = 0; t < threads; ++t) {
+        std::uint64_t front = blocks * t / threads, back = blocks * (t + 1) / threads;
+        queues[t].range.store(front << 32 | back);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &fn;
+        busy = threads - 1;
+        ++generation;
+    }
+    wake.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+    task = nullptr;
+}
+
+bool ThreadPool::pop(int slot, bool back, size_t& block) {
+    std::atomic<std::uint64_t>& range = queues[slot].range;
+    std::uint64_t r = range.load();
+    for (;;) {
+        std::uint64_t front = r >> 32, end = r & 0xffffffffu;
+        if (front >= end) return false;
+        std::uint64_t next = back ? (front << 32 | (end - 1)) : ((front + 1) << 32 | end);
+        if (range.compare_exchange_weak(r, next)) {
+            block = back ? end - 1 : front;
+            return true;
+        }
+    }
+}
+
+void ThreadPool::work(int self) {
+    const ThreadPool* outer = running;
+    running = this;
+    size_t block;
+    bool found = true;
+    while (found) {
+        while (pop(self, false, block)) (*task)(block);
+        found = false;
+        for (int k = 1; k < threads && !found; ++k) {
+            found = pop((self + k) % threads, true, block);
+        }
+        if (found) (*task)(block);
+    }
+    running = outer;
+}
+
+void ThreadPool::loop(int self) {
+    unsigned seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+        }
+        work(self);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers that split a range into blocks of `grain` items. Each
+// worker starts on its own contiguous share of the blocks and, once that runs
+// dry, steals single blocks from the back of the others. Block boundaries only
+// depend on n and grain, never on the thread count or on who ran what, so any
+// computation that writes per block results is reproducible bit for bit.
+// The calling thread works as slot 0; a pool of one thread runs inline, and
+// so does a parallel_for called from inside one of the pool's own blocks,
+// which lets work that spreads over the pool itself run as a block of it.
+class ThreadPool {
+    public:
+        explicit ThreadPool(int threads = 0);
+        ~ThreadPool();
+        ThreadPool(ThreadPool const&) = delete;
+        void operator=(ThreadPool const&) = delete;
+
+        int size() const { return threads; }
+
+        // fn(begin, end) over [0, n) in blocks of grain
+        template<typename F>
+        void parallel_for(size_t n, size_t grain, F&& fn) {
+            if (n == 0) return;
+            grain = std::max<size_t>(grain, 1);
+            size_t blocks = (n + grain - 1) / grain;
+            run(blocks, [&](size_t b) {
+                size_t begin = b * grain;
+                fn(begin, std::min(n, begin + grain));
+            });
+        }
+
+        // map(begin, end) per block, then a left fold of the block results in
+        // block order, which keeps float sums independent of the thread count
+        template<typename T, typename Map, typename Combine>
+        T parallel_reduce(size_t n, size_t grain, T init, Map&& map, Combine&& combine) {
+            if (n == 0) return init;
+            grain = std::max<size_t>(grain, 1);
+            size_t blocks = (n + grain - 1) / grain;
+            std::vector<T> partial(blocks, init);
+            run(blocks, [&](size_t b) {
+                size_t begin = b * grain;
+                partial[b] = map(begin, std::min(n, begin + grain));
+            });
+            T result = init;
+            for (auto& p : partial) result = combine(result, p);
+            return result;
+        }
+
+    private:
+        // front block in the high 32 bits, one past the back block in the low ones
+        struct alignas(64) Queue { std::atomic<std::uint64_t> range; };
+
+        void run(size_t blocks, const std::function<void(size_t)>& task);
+        void work(int self);
+        void loop(int self);
+        bool pop(int slot, bool back, size_t& block);
+
+        static thread_local const ThreadPool* running;  // pool whose block this thread is in
+
+        int threads;
+        std::unique_ptr<Queue[]> queues;
+        std::vector<std::thread> workers;
+
+        std::mutex mutex;
+        std::condition_variable wake, done;
+        const std::function<void(size_t)>* task = nullptr;
+        unsigned generation = 0;
+        int busy = 0;
+        bool stop = false;
+};
+
+#endif
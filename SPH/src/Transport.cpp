@@ -0,0 +1,203 @@
+#include "Transport.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// a shared memory peer silent for this long is taken to be gone
+#define TRANSPORT_TIMEOUT_S 60
+
+#ifndef _WIN32
+
+SocketTransport::SocketTransport(int ranks): Transport(ranks), fds(ranks * ranks, -1) {
+    for (int a = 0; a < ranks; ++a) {
+        for (int b = a + 1; b < ranks; ++b) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+                failed = true;
+                continue;
+            }
+            // both ends poll, so neither blocks halfway through a message
+            for (int fd : pair) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            end(a, b) = pair[0];
+            end(b, a) = pair[1];
+        }
+    }
+}
+
+SocketTransport::~SocketTransport() {
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+}
+
+void SocketTransport::bind(int r) {
+    rank = r;
+    bytes_sent = 0;
+    for (int from = 0; from < ranks; ++from) {
+        if (from == rank) continue;
+        for (int to = 0; to < ranks; ++to) {
+            if (end(from, to) >= 0) close(end(from, to));
+            end(from, to) = -1;
+        }
+    }
+}
+
+// a message is its 8 byte length, then the payload
+bool SocketTransport::exchange(int peer, const std::vector<char>& out, std::vector<char>& in) {
+    int fd = end(rank, peer);
+    if (fd < 0) return false;
+    std::uint64_t out_size = out.size(), in_size = 0;
+    size_t sent = 0, received = 0;
+    size_t send_total = sizeof(out_size) + out.size(), receive_total = sizeof(in_size);
+    bool sized = false;
+
+    while (sent < send_total || received < receive_total) {
+        pollfd p = {fd, (short)((sent < send_total ? POLLOUT : 0) | (received < receive_total ? POLLIN : 0)), 0};
+        if (poll(&p, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (p.revents & (POLLERR | POLLNVAL)) return false;
+        if (sent < send_total && (p.revents & POLLOUT)) {
+            const char* data = sent < sizeof(out_size) ? reinterpret_cast<const char*>(&out_size) + sent : out.data() + (sent - sizeof(out_size));
+            size_t count = sent < sizeof(out_size) ? sizeof(out_size) - sent : send_total - sent;
+            ssize_t n = send(fd, data, count, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+            if (n > 0) sent += (size_t)n;
+        }
+        if (received < receive_total && (p.revents & (POLLIN | POLLHUP))) {
+            char* data = received < sizeof(in_size) ? reinterpret_cast<char*>(&in_size) + received : in.data() + (received - sizeof(in_size));
+            size_t count = received < sizeof(in_size) ? sizeof(in_size) - received : receive_total - received;
+            ssize_t n = recv(fd, data, count, 0);
+            if (n == 0) return false;
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+            if (n > 0) received += (size_t)n;
+            if (!sized && received == sizeof(in_size)) {
+                sized = true;
+                in.resize(in_size);
+                receive_total += in_size;
+            }
+        }
+    }
+    bytes_sent += out.size();
+    return true;
+}
+
+// Holds one part of a message at a time: the writer fills it once posted
+// equals taken, the reader empties it once posted is ahead. The part itself
+// follows the mailbox, a cache line in.
+struct alignas(64) SharedMemoryTransport::Mailbox {
+    std::atomic<std::uint64_t> posted;
+    std::atomic<std::uint64_t> taken;
+    std::uint64_t total;                    // bytes in the whole message
+    std::uint64_t bytes;                    // in this part
+
+    unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+};
+
+SharedMemoryTransport::SharedMemoryTransport(int ranks, size_t slot): Transport(ranks), slot(slot) {
+    stride = (sizeof(Mailbox) + slot + 63) & ~(size_t)63;
+    mapped = stride * ranks * ranks;
+    void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        mapped = 0;
+        return;
+    }
+    mapping = static_cast<unsigned char*>(p);
+    for (int from = 0; from < ranks; ++from) {
+        for (int to = 0; to < ranks; ++to) {
+            Mailbox* box = mailbox(from, to);
+            new (&box->posted) std::atomic<std::uint64_t>(0);
+            new (&box->taken) std::atomic<std::uint64_t>(0);
+        }
+    }
+}
+
+SharedMemoryTransport::~SharedMemoryTransport() {
+    if (mapping) munmap(mapping, mapped);
+}
+
+SharedMemoryTransport::Mailbox* SharedMemoryTransport::mailbox(int from, int to) {
+    return reinterpret_cast<Mailbox*>(mapping + stride * (from * ranks + to));
+}
+
+// the mapping stays whole, every rank only touches the mailboxes to and from it
+void SharedMemoryTransport::bind(int r) {
+    rank = r;
+    bytes_sent = 0;
+}
+
+bool SharedMemoryTransport::exchange(int peer, const std::vector<char>& out, std::vector<char>& in) {
+    if (!mapping) return false;
+    Mailbox* outbox = mailbox(rank, peer);
+    Mailbox* inbox = mailbox(peer, rank);
+    size_t sent = 0, received = 0, receive_total = 0;
+    bool sending = true, receiving = true;
+    auto last = std::chrono::steady_clock::now();
+
+    // every message takes at least one part, so empty ones arrive too
+    while (sending || receiving) {
+        bool progress = false;
+        if (sending && outbox->posted.load(std::memory_order_acquire) == outbox->taken.load(std::memory_order_acquire)) {
+            size_t count = std::min(slot, out.size() - sent);
+            std::memcpy(outbox->data(), out.data() + sent, count);
+            outbox->total = out.size();
+            outbox->bytes = count;
+            outbox->posted.fetch_add(1, std::memory_order_release);
+            sent += count;
+            sending = sent < out.size();
+            progress = true;
+        }
+        if (receiving && inbox->posted.load(std::memory_order_acquire) != inbox->taken.load(std::memory_order_relaxed)) {
+            if (received == 0) {
+                receive_total = inbox->total;
+                in.resize(receive_total);
+            }
+            std::memcpy(in.data() + received, inbox->data(), inbox->bytes);
+            received += inbox->bytes;
+            inbox->taken.fetch_add(1, std::memory_order_release);
+            receiving = received < receive_total;
+            progress = true;
+        }
+        if (progress) {
+            last = std::chrono::steady_clock::now();
+        } else {
+            if (std::chrono::steady_clock::now() - last > std::chrono::seconds(TRANSPORT_TIMEOUT_S)) return false;
+            sched_yield();
+        }
+    }
+    bytes_sent += out.size();
+    return true;
+}
+
+std::unique_ptr<Transport> make_transport(const std::string& kind, int ranks) {
+    std::unique_ptr<Transport> transport;
+    if (kind == "shm") {
+        transport = std::make_unique<SharedMemoryTransport>(ranks);
+    } else if (kind == "socket") {
+        transport = std::make_unique<SocketTransport>(ranks);
+    }
+    if (transport && !transport->ok()) transport.reset();
+    return transport;
+}
+
+#else
+
+std::unique_ptr<Transport> make_transport(const std::string&, int) {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Moves messages between the processes of a Domain, one process a rank, on
+// one machine. A transport is made before the ranks fork, so every rank
+// inherits its channels, then bound to its rank in each of them. Its one
+// primitive is a swap: both peers call exchange with each other, each sends
+// its message and gets the other's. Sending and receiving interleave, so
+// neither the order of the calls nor the size of the messages can deadlock.
+// POSIX only.
+class Transport {
+    public:
+        virtual ~Transport() = default;
+        Transport(Transport const&) = delete;
+        Transport& operator=(Transport const&) = delete;
+
+        // Keeps the channels of rank, drops every other one.
+        virtual void bind(int rank) = 0;
+        // False once the peer is gone, in is then undefined.
+        virtual bool exchange(int peer, const std::vector<char>& out, std::vector<char>& in) = 0;
+        virtual const char* name() const = 0;
+        virtual bool ok() const = 0;
+
+        int rank = 0, ranks = 1;
+        std::uint64_t bytes_sent = 0;       // payload, since bind
+
+    protected:
+        explicit Transport(int ranks): ranks(ranks) {}
+};
+
+// A Unix socket pair between every two ranks.
+class SocketTransport : public Transport {
+    public:
+        explicit SocketTransport(int ranks);
+        ~SocketTransport() override;
+
+        void bind(int rank) override;
+        bool exchange(int peer, const std::vector<char>& out, std::vector<char>& in) override;
+        const char* name() const override { return "socket"; }
+        bool ok() const override { return !failed; }
+
+    private:
+        int& end(int from, int to) { return fds[from * ranks + to]; }
+        std::vector<int> fds;               // end of the pair from -> to, held by from
+        bool failed = false;
+};
+
+// A mailbox for every ordered pair of ranks in one anonymous shared mapping.
+// Messages larger than a mailbox go in turns, a slot at a time; waiting
+// spins, yielding the core, so it suits ranks that each own one.
+class SharedMemoryTransport : public Transport {
+    public:
+        explicit SharedMemoryTransport(int ranks, std::size_t slot = 1 << 20);
+        ~SharedMemoryTransport() override;
+
+        void bind(int rank) override;
+        bool exchange(int peer, const std::vector<char>& out, std::vector<char>& in) override;
+        const char* name() const override { return "shm"; }
+        bool ok() const override { return mapping != nullptr; }
+
+    private:
+        struct Mailbox;
+        Mailbox* mailbox(int from, int to);
+        std::size_t slot, stride;
+        unsigned char* mapping = nullptr;
+        std::size_t mapped = 0;
+};
+
+// "shm" or "socket", null for any other kind or when the channels cannot be made.
+std::unique_ptr<Transport> make_transport(const std::string& kind, int ranks);
+
+#endif
@@ -0,0 +1,63 @@
+#include "UniformBlocks.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "GLSL.h"
+
+void UniformBlocks::set_frame(const glm::mat4& P, const glm::mat4& V, const glm::vec3& light, RenderStats& stats) {
+    FrameBlock block = {P, V, glm::vec4(light, 1.0f)};
+    if (!frame) {
+        glGenBuffers(1, &frame);
+        glBindBuffer(GL_UNIFORM_BUFFER, frame);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), &block, GL_DYNAMIC_DRAW);
+    } else {
+        glBindBuffer(GL_UNIFORM_BUFFER, frame);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameBlock), &block);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK, frame);
+    stats.uniform_calls += 4;
+    stats.uniform_bytes += sizeof(FrameBlock);
+}
+
+void UniformBlocks::bind_material(const Material& material, RenderStats& stats) {
+    std::uint32_t key = hash(material);
+    size_t slot = known.size();
+    for (auto range = slots.equal_range(key); range.first != range.second; ++range.first) {
+        if (known[range.first->second] == material) slot = range.first->second;
+    }
+
+    if (slot == known.size()) {
+        if (!stride) {
+            GLint alignment = 256;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+            stride = (sizeof(MaterialBlock) + alignment - 1) / alignment * alignment;
+        }
+        MaterialBlock block = {glm::vec4(material.ka, 0.0f), glm::vec4(material.kd, 0.0f), glm::vec4(material.ks, 0.0f),
+            glm::vec4(material.s, material.a, 0.0f, 0.0f)};
+        known.push_back(material);
+        slots.emplace(key, slot);
+        staging.resize(std::max(staging.size(), known.size() * stride));
+        std::memcpy(staging.data() + slot * stride, &block, sizeof(block));
+
+        if (!materials) glGenBuffers(1, &materials);
+        glBindBuffer(GL_UNIFORM_BUFFER, materials);
+        if (known.size() > capacity) {
+            // doubles, the blocks already built come along
+            capacity = capacity ? 2 * capacity : 16;
+            staging.resize(capacity * stride);
+            glBufferData(GL_UNIFORM_BUFFER, staging.size(), staging.data(), GL_STATIC_DRAW);
+            stats.uniform_bytes += staging.size();
+        } else {
+            glBufferSubData(GL_UNIFORM_BUFFER, slot * stride, sizeof(block), &block);
+            stats.uniform_bytes += sizeof(block);
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        stats.uniform_calls += 3;
+        GLSL::checkError(GET_FILE_LINE);
+    }
+
+    glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK, materials, slot * stride, sizeof(MaterialBlock));
+    ++stats.uniform_calls;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#ifndef UNIFORMBLOCKS_H
+#define UNIFORMBLOCKS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include "Material.h"
+#include "RenderQueue.h"
+
+// Binding points of the shared uniform blocks, the same in every program.
+#define FRAME_BLOCK 0
+#define MATERIAL_BLOCK 1
+
+// std140 layouts of the blocks as the shaders declare them.
+struct FrameBlock {
+    glm::mat4 P;
+    glm::mat4 V;
+    glm::vec4 lightPos;     // view space
+};
+
+struct MaterialBlock {
+    glm::vec4 ka, kd, ks;
+    glm::vec4 shine;        // s, a
+};
+
+// Uniform buffers shared by all programs. The frame block holds the camera
+// and light, filled and bound once a frame whatever the number of programs
+// and entities. Material blocks are built the first time a material is seen
+// and kept, all in one buffer, so drawing with a material is one range bind.
+class UniformBlocks {
+    public:
+        UniformBlocks() = default;
+        UniformBlocks(UniformBlocks const&) = delete;
+        void operator=(UniformBlocks const&) = delete;
+
+        void set_frame(const glm::mat4& P, const glm::mat4& V, const glm::vec3& light, RenderStats& stats);
+        void bind_material(const Material& material, RenderStats& stats);
+
+    private:
+        unsigned frame = 0, materials = 0;
+        size_t stride = 0;                  // of material blocks, the GL offset alignment
+        size_t capacity = 0;                // material blocks the buffer holds
+        std::vector<Material> known;        // material of each block
+        std::vector<unsigned char> staging; // every block, to refill a grown buffer
+        std::unordered_multimap<std::uint32_t, size_t> slots;
+};
+
+#endif
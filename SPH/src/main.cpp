@@ -1,5 +1,7 @@
 #include <iostream>
 #include <string>
+#include <cstdlib>
+#include <cstring>
 #define GLEW_STATIC
 #define GLM_FORCE_RADIANS
 
@@ -14,6 +16,24 @@ int main(int argc, char **argv) {
 
 	Simulation &sim = Simulation::get_instance();
 
+	// SPH [threads] [--bake file] [--play cache] [--props n] [--impostors] [--surface] [--profile prefix] [--adaptive] [--sleep] [--compact] [--density-color] [--checkpoint file] [--restore file], all hardware threads by default
+	sim.set_threads(argc > 1 ? std::atoi(argv[1]) : 0);
+	for (int i = 1; i < argc; ++i) {
+		bool more = i + 1 < argc;
+		if (!std::strcmp(argv[i], "--bake") && more) sim.set_bake(argv[i + 1]);
+		else if (!std::strcmp(argv[i], "--play") && more) sim.set_playback(argv[i + 1]);
+		else if (!std::strcmp(argv[i], "--props") && more) sim.set_props(std::atoi(argv[i + 1]));
+		else if (!std::strcmp(argv[i], "--impostors")) sim.set_impostors(true);
+		else if (!std::strcmp(argv[i], "--surface")) sim.set_surface(true);
+		else if (!std::strcmp(argv[i], "--profile") && more) sim.set_profile(argv[i + 1]);
+		else if (!std::strcmp(argv[i], "--adaptive")) sim.set_adaptive(true);
+		else if (!std::strcmp(argv[i], "--sleep")) sim.set_sleeping(true);
+		else if (!std::strcmp(argv[i], "--compact")) sim.set_compact(true);
+		else if (!std::strcmp(argv[i], "--density-color")) sim.set_compact(true, true);
+		else if (!std::strcmp(argv[i], "--checkpoint") && more) sim.set_checkpoint(argv[i + 1]);
+		else if (!std::strcmp(argv[i], "--restore") && more) sim.set_checkpoint(argv[i + 1], true);
+	}
+
 	glfwSetErrorCallback(&Simulation::error_callback);
 	if(!glfwInit()) return -1;
 
@@ -25,6 +45,11 @@ int main(int argc, char **argv) {
 	glGetError();
 	std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
 	std::cout << "GLSL version: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
+	// every program reads the camera, light and materials from uniform blocks
+	if (!GLEW_ARB_uniform_buffer_object) {
+		std::cout << "Failed to find GL_ARB_uniform_buffer_object, which the shaders need (OpenGL 3.1)\n";
+		return -1;
+	}
 
 	// GLuint vaoId = 0;
 	// glGenVertexArrays(1, &vaoId);
@@ -33,6 +58,7 @@ int main(int argc, char **argv) {
 	sim.init_programs();
 	sim.init_cameras();
 	sim.set_scene();	
+	// the fluid steps on a thread of its own from here on, this one renders
 	while (!sim.window_closed()) {
 		sim.resize_window();
 		sim.input_capture();